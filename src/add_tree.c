@@ -0,0 +1,485 @@
+/*
+ * Copyright (C) 2016 - Christian Jürgens <christian.textfs@gmail.com>
+ * Copyright (C) 2016 - Dirk Klingenberg <blademountain35@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * */
+
+/*
+ * Recursive add
+ *
+ * "add -r hostdir /target/" lists the host tree first, in name order.
+ * Up to ADD_THREADS workers then read the regular files and encode
+ * their blocks into hex lines, at most ADD_WINDOW entries ahead. The
+ * calling thread is the committer: it takes the entries in list order,
+ * creates directories and symlinks and allocates and copies the file
+ * blocks, so the image looks like the result of single adds. Only the
+ * committer touches struct tfs, the image is written back once at the
+ * end of the command.
+ * */
+
+#include <dirent.h>
+#include "protos.h"
+#include "spec_tfs.h"
+
+/*
+ * Check a block for data
+ * @blk			- BLOCKSIZE bytes
+ * @return	- TRUE if all bytes are 0, writefile() leaves a hole
+ * */
+int add_hole(const u8 *blk)
+{
+	int i;
+
+	for (i = 0; i < BLOCKSIZE && !blk[i]; i++);
+
+	return i == BLOCKSIZE;
+}
+
+/*
+ * Append a host path to the list
+ * @tree		- entries
+ * @src			- host path
+ * @path		- path in the image
+ * @return	- new entry, NULL if the path is skipped
+ * */
+struct add_entry *add_push(struct add_tree *tree, const char *src,
+													 const char *path)
+{
+	struct add_entry *e;
+	struct stat sb, img;
+
+	if (lstat(src, &sb))
+	{
+		die("stat(%s)", src);
+	}
+	if (!fstat(fileno(tree->fs->fp), &img) && sb.st_dev == img.st_dev
+			&& sb.st_ino == img.st_ino)
+	{
+		fprintf(stderr, "%s: skipped, it is the file system\n", src);
+		return NULL;
+	}
+	if (!S_ISREG(sb.st_mode) && !S_ISDIR(sb.st_mode) && !S_ISLNK(sb.st_mode))
+	{
+		fprintf(stderr, "%s: skipped, not a file, directory or symlink\n", src);
+		return NULL;
+	}
+	if (S_ISREG(sb.st_mode) && UPPER(sb.st_size, BLOCKSIZE) > MAX_FILE_BLOCKS)
+	{
+		fatalmsg("%s: file bigger than maximum size", src);
+	}
+	if (tree->n == tree->size)
+	{
+		tree->size = tree->size ? tree->size * 2 : 64;
+		tree->entries = realloc(tree->entries, tree->size * sizeof(struct add_entry));
+
+		if (!tree->entries)
+		{
+			die("realloc");
+		}
+	}
+	e = memset(tree->entries + tree->n++, 0, sizeof(struct add_entry));
+	e->src = strdup(src);
+	strcpy(e->path, path);
+	e->mode = sb.st_mode;
+	e->size = sb.st_size;
+	e->atime = sb.st_atime;
+	e->mtime = sb.st_mtime;
+	e->ctime = sb.st_ctime;
+
+	if (!e->src)
+	{
+		die("strdup");
+	}
+	if (S_ISREG(sb.st_mode))
+	{
+		tree->files++;
+	}
+	return e;
+}
+
+/*
+ * List a host path and, for a directory, everything below it
+ * @tree	- entries
+ * @src		- host path
+ * @path	- path in the image, shorter than PATH_SIZE
+ * */
+void add_walk(struct add_tree *tree, const char *src, const char *path)
+{
+	struct add_entry *e = add_push(tree, src, path);
+	struct dirent **names;
+	int i, n;
+
+	if (!e || !S_ISDIR(e->mode))
+	{
+		return;
+	}
+	if ((n = scandir(src, &names, NULL, alphasort)) < 0)
+	{
+		die("scandir(%s)", src);
+	}
+	for (i = 0; i < n; i++)
+	{
+		const char *name = names[i]->d_name;
+		char childPath[PATH_SIZE];
+		char *childSrc;
+
+		if (!strcmp(name, ".") || !strcmp(name, ".."))
+		{
+			continue;
+		}
+		if (strlen(path) + 1 + strlen(name) >= PATH_SIZE)
+		{
+			fatalmsg("%s/%s: path too long", path, name);
+		}
+		sprintf(childPath, "%s/%s", path, name);
+		childSrc = domalloc(strlen(src) + strlen(name) + 2, 0);
+		sprintf(childSrc, "%s/%s", src, name);
+
+		add_walk(tree, childSrc, childPath);
+		free(childSrc);
+	}
+	for (i = 0; i < n; i++)
+	{
+		free(names[i]);
+	}
+	free(names);
+}
+
+/*
+ * Read a regular file into its entry, runs in a worker. Errors are
+ * kept in the entry and reported by the committer.
+ * @e				- entry
+ * @encode	- encode the blocks, FALSE with TFS_ARENA
+ * */
+void add_read(struct add_entry *e, int encode)
+{
+	unsigned long nBlocks = UPPER(e->size, BLOCKSIZE);
+	unsigned long i;
+	FILE *fp = fopen(e->src, "rb");
+
+	if (!fp)
+	{
+		e->err = errno;
+		return;
+	}
+	e->data = malloc(nBlocks * BLOCKSIZE + 1);
+	e->text = encode ? malloc(nBlocks * DATA_TEXT_SIZE + 1) : NULL;
+
+	if (!e->data || (encode && !e->text))
+	{
+		e->err = ENOMEM;
+		fclose(fp);
+		return;
+	}
+	// The size of lstat() is kept, even if the file grows meanwhile
+	e->size = fread(e->data, 1, e->size, fp);
+
+	if (ferror(fp))
+	{
+		e->err = errno ? errno : EIO;
+	}
+	fclose(fp);
+
+	nBlocks = UPPER(e->size, BLOCKSIZE);
+	memset(e->data + e->size, 0, nBlocks * BLOCKSIZE - e->size);
+
+	for (i = 0; encode && i < nBlocks; i++)
+	{
+		if (!add_hole(e->data + i * BLOCKSIZE))
+		{
+			e->textLen = encodeDataBlock(e->data + i * BLOCKSIZE, BLOCKSIZE,
+																	 e->text + i * DATA_TEXT_SIZE);
+		}
+	}
+}
+
+/*
+ * Worker thread: read the next regular files of the list
+ * @arg			- struct add_tree
+ * @return	- NULL
+ * */
+void *add_worker(void *arg)
+{
+	struct add_tree *tree = arg;
+	struct add_entry *e;
+
+	pthread_mutex_lock(&tree->lock);
+
+	while (!tree->stop)
+	{
+		// Directories and symlinks are left to the committer
+		while (tree->next < tree->n && !S_ISREG(tree->entries[tree->next].mode))
+		{
+			tree->next++;
+		}
+		if (tree->next == tree->n)
+		{
+			break;
+		}
+		if (tree->next >= tree->committed + ADD_WINDOW)
+		{
+			pthread_cond_wait(&tree->cond, &tree->lock);
+			continue;
+		}
+		e = tree->entries + tree->next++;
+		pthread_mutex_unlock(&tree->lock);
+
+		add_read(e, !tree->fs->arena);
+
+		pthread_mutex_lock(&tree->lock);
+		e->ready = 1;
+		pthread_cond_broadcast(&tree->cond);
+	}
+	pthread_mutex_unlock(&tree->lock);
+
+	return NULL;
+}
+
+/*
+ * Wait until a regular file is read, the committer reads it itself if
+ * no worker took it
+ * @tree	- entries
+ * @i		- entry
+ * */
+void add_wait(struct add_tree *tree, unsigned long i)
+{
+	struct add_entry *e = tree->entries + i;
+
+	pthread_mutex_lock(&tree->lock);
+
+	while (!e->ready)
+	{
+		if (tree->next <= i)
+		{
+			tree->next = i + 1;
+			pthread_mutex_unlock(&tree->lock);
+
+			add_read(e, !tree->fs->arena);
+
+			pthread_mutex_lock(&tree->lock);
+			e->ready = 1;
+		}
+		else
+		{
+			pthread_cond_wait(&tree->cond, &tree->lock);
+		}
+	}
+	pthread_mutex_unlock(&tree->lock);
+}
+
+/*
+ * Create a regular file from its read entry, like doadd()
+ * @fs	- file system structure
+ * @e	- entry
+ * */
+void add_commit(struct tfs *fs, struct add_entry *e)
+{
+	unsigned long nBlocks = UPPER(e->size, BLOCKSIZE);
+	unsigned long i;
+	int inode;
+	u32 *map;
+
+	if (nBlocks > fs->free_zones)
+	{
+		fatalmsg("The file %s is too big for filesystem", e->src);
+	}
+	inode = make_node(fs, e->path, e->mode, 0, 0, e->size, e->atime, e->mtime,
+										e->ctime, NULL);
+
+	reserve_blocks(fs, inode, e->size);
+	map = write_map(fs, INODE(fs, inode), nBlocks);
+
+	for (i = 0; i < nBlocks; i++)
+	{
+		u8 *blk = e->data + i * BLOCKSIZE;
+
+		if (add_hole(blk))
+		{
+			continue;
+		}
+		if (e->text)
+		{
+			write_mapped_text(fs, inode, map, i, blk, e->text + i * DATA_TEXT_SIZE,
+												e->textLen);
+		}
+		else
+		{
+			write_mapped_block(fs, inode, map, i, blk);
+		}
+	}
+	write_block_map(fs, inode, map, nBlocks);
+
+	trunc_inode(fs, inode, e->size);
+	release_blocks(fs);
+}
+
+/*
+ * Stop and join the workers and free the list
+ * @tree	- entries, freed
+ * */
+void add_end(struct add_tree *tree)
+{
+	unsigned long i;
+	int t;
+
+	pthread_mutex_lock(&tree->lock);
+	tree->stop = TRUE;
+	pthread_cond_broadcast(&tree->cond);
+	pthread_mutex_unlock(&tree->lock);
+
+	for (t = 0; t < tree->nThreads; t++)
+	{
+		pthread_join(tree->threads[t], NULL);
+	}
+	for (i = 0; i < tree->n; i++)
+	{
+		free(tree->entries[i].src);
+		free(tree->entries[i].data);
+		free(tree->entries[i].text);
+	}
+	free(tree->entries);
+	pthread_mutex_destroy(&tree->lock);
+	pthread_cond_destroy(&tree->cond);
+	free(tree);
+}
+
+/*
+ * Add a host file or directory tree
+ * @fs			- file system structure
+ * @src			- host path
+ * @target	- directory to add to, with "/" at the end
+ * */
+void doadd_tree(struct tfs *fs, const char *src, const char *target)
+{
+	struct add_tree *tree = domalloc(sizeof(struct add_tree), 0);
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	jmp_buf env, *saved = fatal_jmp;
+	char name[PATH_SIZE], path[PATH_SIZE];
+	unsigned long i, blocks = 0;
+	char *p;
+	int rc;
+
+	tree->fs = fs;
+	pthread_mutex_init(&tree->lock, NULL);
+	pthread_cond_init(&tree->cond, NULL);
+
+	// Workers are stopped before the error goes on
+	if ((rc = setjmp(env)))
+	{
+		add_end(tree);
+		fatal_jmp = saved;
+
+		if (saved)
+		{
+			longjmp(*saved, rc);
+		}
+		fprintf(stderr, "%s\n", fatal_text);
+		exit(ERROR);
+	}
+	fatal_jmp = &env;
+
+	if (!*target || target[strlen(target) - 1] != '/')
+	{
+		fatalmsg("For the root path use [Sourcepath] [/] \n"
+						 "For another path use [Sourcepath] [directory/] ");
+	}
+	// The name of the host path without "/" at the end
+	if (strlen(src) >= PATH_SIZE)
+	{
+		fatalmsg("%s: path too long", src);
+	}
+	strcpy(name, src);
+
+	while ((p = strrchr(name, '/')) && p > name && !p[1])
+	{
+		*p = 0;
+	}
+	p = strrchr(name, '/') ? strrchr(name, '/') + 1 : name;
+
+	if (!*p || !strcmp(p, ".") || !strcmp(p, ".."))
+	{
+		fatalmsg("%s: no name to add, use the directory name", src);
+	}
+	if (strlen(target) + strlen(p) >= PATH_SIZE)
+	{
+		fatalmsg("%s%s: path too long", target, p);
+	}
+	sprintf(path, "%s%s", target, p);
+	add_walk(tree, src, path);
+
+	for (i = 0; i < tree->n; i++)
+	{
+		blocks += S_ISREG(tree->entries[i].mode) ? UPPER(tree->entries[i].size, BLOCKSIZE) : 0;
+	}
+	if (blocks > fs->free_zones)
+	{
+		fatalmsg("%s is too big for filesystem\n"
+						 "It needs %lu blocks, %lu blocks are free", src, blocks,
+						 fs->free_zones);
+	}
+	while (tree->nThreads < cpus && tree->nThreads < ADD_THREADS
+				 && tree->nThreads < tree->files)
+	{
+		if (pthread_create(&tree->threads[tree->nThreads], NULL, add_worker, tree))
+		{
+			break;
+		}
+		tree->nThreads++;
+	}
+	for (i = 0; i < tree->n; i++)
+	{
+		struct add_entry *e = tree->entries + i;
+
+		if (S_ISDIR(e->mode))
+		{
+			domkdir(fs, e->path, FALSE);
+		}
+		else if (S_ISLNK(e->mode))
+		{
+			char link[BLOCKSIZE];
+			ssize_t len = readlink(e->src, link, sizeof(link) - 1);
+
+			if (len < 0)
+			{
+				die("readlink(%s)", e->src);
+			}
+			link[len] = 0;
+			domklnk(fs, link, e->path);
+		}
+		else
+		{
+			add_wait(tree, i);
+
+			if (e->err)
+			{
+				errno = e->err;
+				die("%s", e->src);
+			}
+			add_commit(fs, e);
+
+			free(e->data);
+			free(e->text);
+			e->data = NULL;
+			e->text = NULL;
+		}
+		pthread_mutex_lock(&tree->lock);
+		tree->committed = i + 1;
+		pthread_cond_broadcast(&tree->cond);
+		pthread_mutex_unlock(&tree->lock);
+	}
+	add_end(tree);
+	fatal_jmp = saved;
+}
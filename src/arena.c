@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2016 - Christian Jürgens <christian.textfs@gmail.com>
+ * Copyright (C) 2016 - Dirk Klingenberg <blademountain35@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * */
+
+/*
+ * Block arena
+ *
+ * With TFS_ARENA, open_fs() decodes every data block of the image into
+ * one array of BLOCKSIZE byte blocks, split over ARENA_THREADS threads.
+ * readVirtualBlock() and writeVirtualDataBlock() then only copy binary
+ * data, the hex lines of changed blocks are encoded again, in parallel,
+ * by flushArena() when the file system is closed.
+ * */
+
+#include <pthread.h>
+#include "protos.h"
+#include "spec_tfs.h"
+
+/*
+ * Decode a range of blocks into the arena
+ * @arg			- struct arena_job
+ * @return	- NULL
+ * */
+void *decodeArenaJob(void *arg)
+{
+	struct arena_job *job = arg;
+	struct tfs *fs = job->fs;
+	unsigned long blk;
+	char *text;
+
+	for (blk = job->first; blk < job->first + job->n; blk++)
+	{
+		text = goto_dataBlk(fs, blk);
+
+		// Damaged blocks stay out, readVirtualBlock() reports them
+		if (text && decodeDataBlock(text, ARENA_BLOCK(fs, blk)) != ERROR)
+		{
+			fs->arenaValid[blk] = 1;
+			job->done++;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Encode changed arena blocks into their slots
+ * @arg			- struct arena_job
+ * @return	- NULL
+ * */
+void *encodeArenaJob(void *arg)
+{
+	struct arena_job *job = arg;
+	unsigned long i;
+
+	for (i = 0; i < job->n; i++)
+	{
+		unsigned long blk = job->blocks[i];
+
+		encodeDataBlock(ARENA_BLOCK(job->fs, blk), BLOCKSIZE,
+										goto_dataBlk(job->fs, blk));
+	}
+	return NULL;
+}
+
+/*
+ * Run jobs in threads, the last one in the calling thread
+ * @jobs		- jobs
+ * @nJobs		- number of jobs
+ * @fn			- thread function
+ * */
+void runArenaJobs(struct arena_job *jobs, int nJobs, void *(*fn)(void *))
+{
+	pthread_t threads[ARENA_THREADS];
+	int i, started;
+
+	for (started = 0; started < nJobs - 1; started++)
+	{
+		if (pthread_create(&threads[started], NULL, fn, jobs + started))
+		{
+			break;
+		}
+	}
+	// Jobs without a thread are done here
+	for (i = started; i < nJobs; i++)
+	{
+		fn(jobs + i);
+	}
+	for (i = 0; i < started; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+}
+
+/*
+ * Number of threads for n blocks
+ * @n				- blocks to process
+ * @return	- 1 .. ARENA_THREADS
+ * */
+int arenaThreads(unsigned long n)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	long nThreads = n / ARENA_MIN_BLOCKS;
+
+	if (nThreads > cpus)
+	{
+		nThreads = cpus;
+	}
+	if (nThreads > ARENA_THREADS)
+	{
+		nThreads = ARENA_THREADS;
+	}
+	return nThreads < 1 ? 1 : nThreads;
+}
+
+/*
+ * Decode all data blocks of the image into the arena
+ * @fs	- file system structure
+ * */
+void decodeArena(struct tfs *fs)
+{
+	struct arena_job jobs[ARENA_THREADS];
+	unsigned long nBlocks = fs->sb->fs_sizeInBlocks;
+	unsigned long per, blk = 0;
+	int i, nJobs = arenaThreads(nBlocks);
+
+	fs->arena = domalloc(nBlocks * BLOCKSIZE, -1);
+	fs->arenaValid = domalloc(nBlocks, 0);
+	per = UPPER(nBlocks, nJobs);
+
+	for (i = 0; i < nJobs; i++, blk += per)
+	{
+		jobs[i].fs = fs;
+		jobs[i].blocks = NULL;
+		jobs[i].first = blk;
+		jobs[i].n = blk + per < nBlocks ? per : nBlocks - blk;
+		jobs[i].done = 0;
+	}
+	runArenaJobs(jobs, nJobs, decodeArenaJob);
+
+	for (i = 0; i < nJobs; i++)
+	{
+		fs->arenaBlocks += jobs[i].done;
+	}
+}
+
+/*
+ * Encode the arena blocks changed since open_fs() into virtualFS
+ * @fs	- file system structure
+ * */
+void flushArena(struct tfs *fs)
+{
+	struct arena_job jobs[ARENA_THREADS];
+	unsigned long nBlocks = fs->sb->fs_sizeInBlocks;
+	unsigned long *blocks = domalloc(nBlocks * sizeof(unsigned long), -1);
+	unsigned long blk, n = 0, per, first = 0;
+	int i, nJobs;
+
+	for (blk = 0; blk < nBlocks; blk++)
+	{
+		if (fs->arenaValid[blk] && bit((char *) fs->dirty_bmap, blk))
+		{
+			blocks[n++] = blk;
+		}
+	}
+	nJobs = arenaThreads(n);
+	per = UPPER(n, nJobs);
+
+	for (i = 0; i < nJobs; i++, first += per)
+	{
+		jobs[i].fs = fs;
+		jobs[i].blocks = blocks + first;
+		jobs[i].n = first >= n ? 0 : first + per < n ? per : n - first;
+	}
+	runArenaJobs(jobs, nJobs, encodeArenaJob);
+
+	free(blocks);
+}
+
+/*
+ * Free the arena
+ * @fs	- file system structure
+ * */
+void freeArena(struct tfs *fs)
+{
+	free(fs->arena);
+	fs->arena = NULL;
+	free(fs->arenaValid);
+	fs->arenaValid = NULL;
+}
+
+/*
+ * Forget the arena copy of a block whose slot was rewritten
+ * @fs	- file system structure
+ * @blk	- block-id
+ * */
+void dropArenaBlock(struct tfs *fs, unsigned long blk)
+{
+	if (fs->arena && blk < fs->sb->fs_sizeInBlocks)
+	{
+		fs->arenaValid[blk] = 0;
+	}
+}
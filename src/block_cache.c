@@ -0,0 +1,272 @@
+/*
+ * Copyright (C) 2016 - Christian Jürgens <christian.textfs@gmail.com>
+ * Copyright (C) 2016 - Dirk Klingenberg <blademountain35@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * */
+
+/*
+ * Cache of decoded data blocks
+ *
+ * readVirtualBlock() keeps the last decoded blocks, so blocks that are
+ * read again (directories, index blocks) need not be parsed from their
+ * hex lines again. The cache is write-through: writeVirtualDataBlock()
+ * still encodes into virtualFS and updates a cached copy of the block.
+ * The least recently used block is evicted when the budget is used up.
+ *
+ * The budget is TEXTFS_CACHE_KB kilobytes (DEFAULT_CACHE_KB if unset),
+ * 0 turns the cache off.
+ * */
+
+#include "protos.h"
+#include "spec_tfs.h"
+
+/*
+ * Create the cache of a file system on first use
+ * @fs			- file system structure
+ * @return	- the cache
+ * */
+struct tfs_block_cache *init_block_cache(struct tfs *fs)
+{
+	struct tfs_block_cache *cache;
+	const char *budget = getenv("TEXTFS_CACHE_KB");
+	unsigned long kb = budget ? strtoul(budget, NULL, 10) : DEFAULT_CACHE_KB;
+	unsigned long i;
+
+	cache = domalloc(sizeof(struct tfs_block_cache), 0);
+	cache->nEntries = kb * 1024 / sizeof(struct tfs_cached_block);
+	cache->nSlots = fs->sb->fs_sizeInBlocks;
+	cache->head = cache->tail = ERROR;
+
+	if (cache->nEntries > cache->nSlots)
+	{
+		cache->nEntries = cache->nSlots;
+	}
+	if (cache->nEntries)
+	{
+		cache->entry = domalloc(cache->nEntries * sizeof(struct tfs_cached_block), -1);
+		cache->slot = domalloc(cache->nSlots * sizeof(int), -1);
+
+		for (i = 0; i < cache->nSlots; i++)
+		{
+			cache->slot[i] = ERROR;
+		}
+	}
+	fs->cache = cache;
+
+	return cache;
+}
+
+/*
+ * Take an entry out of the LRU list
+ * @cache	- block cache
+ * @e			- entry
+ * */
+void unlink_cached_block(struct tfs_block_cache *cache, int e)
+{
+	struct tfs_cached_block *entry = cache->entry + e;
+
+	if (entry->prev == ERROR)
+	{
+		cache->head = entry->next;
+	}
+	else
+	{
+		cache->entry[entry->prev].next = entry->next;
+	}
+	if (entry->next == ERROR)
+	{
+		cache->tail = entry->prev;
+	}
+	else
+	{
+		cache->entry[entry->next].prev = entry->prev;
+	}
+}
+
+/*
+ * Put an entry in front of the LRU list
+ * @cache	- block cache
+ * @e			- entry
+ * */
+void push_cached_block(struct tfs_block_cache *cache, int e)
+{
+	struct tfs_cached_block *entry = cache->entry + e;
+
+	entry->prev = ERROR;
+	entry->next = cache->head;
+
+	if (cache->head != ERROR)
+	{
+		cache->entry[cache->head].prev = e;
+	}
+	cache->head = e;
+
+	if (cache->tail == ERROR)
+	{
+		cache->tail = e;
+	}
+}
+
+/*
+ * Look up a decoded block
+ * @fs			- file system structure
+ * @blk			- block-id
+ * @buf			- store block to buf (BLOCKSIZE)
+ * @return	- FOUND or NOT_FOUND
+ * */
+int cache_lookup(struct tfs *fs, unsigned long blk, u8 *buf)
+{
+	struct tfs_block_cache *cache = fs->cache ? fs->cache : init_block_cache(fs);
+	int e;
+
+	if (!cache->nEntries || blk >= cache->nSlots)
+	{
+		return NOT_FOUND;
+	}
+	e = cache->slot[blk];
+
+	if (e == ERROR)
+	{
+		cache->misses++;
+		return NOT_FOUND;
+	}
+	cache->hits++;
+	memcpy(buf, cache->entry[e].data, BLOCKSIZE);
+
+	if (cache->head != e)
+	{
+		unlink_cached_block(cache, e);
+		push_cached_block(cache, e);
+	}
+	return FOUND;
+}
+
+/*
+ * Keep a decoded block, the least recently used one makes room
+ * @fs			- file system structure
+ * @blk			- block-id
+ * @buf			- decoded block (BLOCKSIZE)
+ * */
+void cache_store(struct tfs *fs, unsigned long blk, const u8 *buf)
+{
+	struct tfs_block_cache *cache = fs->cache ? fs->cache : init_block_cache(fs);
+	int e;
+
+	if (!cache->nEntries || blk >= cache->nSlots)
+	{
+		return;
+	}
+	e = cache->slot[blk];
+
+	if (e != ERROR)
+	{
+		unlink_cached_block(cache, e);
+	}
+	else if (cache->used < cache->nEntries)
+	{
+		e = cache->used++;
+	}
+	else
+	{
+		e = cache->tail;
+		unlink_cached_block(cache, e);
+		cache->slot[cache->entry[e].blk] = ERROR;
+		cache->evictions++;
+	}
+	cache->entry[e].blk = blk;
+	memcpy(cache->entry[e].data, buf, BLOCKSIZE);
+	cache->slot[blk] = e;
+	push_cached_block(cache, e);
+}
+
+/*
+ * Replace a cached block after it was written, blocks that are not
+ * cached stay out
+ * @fs			- file system structure
+ * @blk			- block-id
+ * @buf			- new content (BLOCKSIZE)
+ * */
+void cache_update(struct tfs *fs, unsigned long blk, const u8 *buf)
+{
+	struct tfs_block_cache *cache = fs->cache;
+
+	if (cache && blk < cache->nSlots && cache->nEntries
+			&& cache->slot[blk] != ERROR)
+	{
+		memcpy(cache->entry[cache->slot[blk]].data, buf, BLOCKSIZE);
+	}
+}
+
+/*
+ * Forget a block whose slot was rewritten
+ * @fs			- file system structure
+ * @blk			- block-id
+ * */
+void cache_drop(struct tfs *fs, unsigned long blk)
+{
+	struct tfs_block_cache *cache = fs->cache;
+	int e;
+
+	if (!cache || blk >= cache->nSlots || !cache->nEntries
+			|| (e = cache->slot[blk]) == ERROR)
+	{
+		return;
+	}
+	unlink_cached_block(cache, e);
+	cache->slot[blk] = ERROR;
+
+	// Move the last entry in use into the hole, keeping its LRU position
+	if (e != --cache->used)
+	{
+		struct tfs_cached_block *entry = cache->entry + e;
+
+		*entry = cache->entry[cache->used];
+		cache->slot[entry->blk] = e;
+
+		if (entry->prev == ERROR)
+		{
+			cache->head = e;
+		}
+		else
+		{
+			cache->entry[entry->prev].next = e;
+		}
+		if (entry->next == ERROR)
+		{
+			cache->tail = e;
+		}
+		else
+		{
+			cache->entry[entry->next].prev = e;
+		}
+	}
+}
+
+/*
+ * Free the block cache
+ * @fs	- file system structure
+ * */
+void free_block_cache(struct tfs *fs)
+{
+	if (!fs->cache)
+	{
+		return;
+	}
+	free(fs->cache->entry);
+	free(fs->cache->slot);
+	free(fs->cache);
+	fs->cache = NULL;
+}
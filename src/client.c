@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2016 - Christian Jürgens <christian.textfs@gmail.com>
+ * Copyright (C) 2016 - Dirk Klingenberg <blademountain35@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * */
+
+/*
+ * tfsclient: send one command to "TextFS img serve", see serve.c
+ *
+ * tfsclient /path/sock dir /
+ * tfsclient /path/sock sync
+ * tfsclient /path/sock shutdown
+ * */
+
+#include "spec_tfs.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * Read exactly n bytes
+ * @fd			- socket
+ * @buf			- buffer
+ * @n				- number of bytes
+ * @return	- 0, ERROR at end of file or on error
+ * */
+static int client_read(int fd, void *buf, size_t n)
+{
+	while (n)
+	{
+		ssize_t r = read(fd, buf, n);
+
+		if (r < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (r <= 0)
+		{
+			return ERROR;
+		}
+		buf = (char *) buf + r;
+		n -= r;
+	}
+	return 0;
+}
+
+/*
+ * Connect to a server
+ * @path		- socket path
+ * @return	- socket
+ * */
+static int client_connect(const char *path)
+{
+	struct sockaddr_un addr = {0};
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)))
+	{
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	return fd;
+}
+
+int main(int argc, char **argv)
+{
+	static char buf[SERVE_FRAME_MAX];
+	struct tfs_frame frame = {FRAME_REQUEST, 0};
+	int fd, i;
+
+	if (argc < 3)
+	{
+		printf("\nUsage: %s [socket] [command] {arguments} \n\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	for (i = 2; i < argc; i++)
+	{
+		size_t len = strlen(argv[i]) + 1;
+
+		if (frame.len + len > SERVE_FRAME_MAX)
+		{
+			fprintf(stderr, "%s: command too long\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+		memcpy(buf + frame.len, argv[i], len);
+		frame.len += len;
+	}
+	fd = client_connect(argv[1]);
+
+	if (write(fd, &frame, sizeof(frame)) != sizeof(frame)
+			|| write(fd, buf, frame.len) != frame.len)
+	{
+		perror(argv[1]);
+		return EXIT_FAILURE;
+	}
+	// Output until the exit status
+	while (!client_read(fd, &frame, sizeof(frame)))
+	{
+		if (frame.type == FRAME_STATUS)
+		{
+			return frame.len;
+		}
+		if (frame.len > SERVE_FRAME_MAX || client_read(fd, buf, frame.len))
+		{
+			break;
+		}
+		fwrite(buf, 1, frame.len, frame.type == FRAME_ERR ? stderr : stdout);
+	}
+	fprintf(stderr, "%s: connection lost\n", argv[1]);
+
+	return EXIT_FAILURE;
+}
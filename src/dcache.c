@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2016 - Christian Jürgens <christian.textfs@gmail.com>
+ * Copyright (C) 2016 - Dirk Klingenberg <blademountain35@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * */
+
+/*
+ * Dentry cache
+ *
+ * find_inode() remembers the result of every path component it looks
+ * up, keyed by (parent inode, name). Names that were not found are
+ * kept as negative entries. The cache has DENTRY_SLOTS slots, a new
+ * entry replaces the one in its slot.
+ *
+ * dname_add() and dname_rem() drop the entry of the name they change,
+ * clr_inode() drops all entries in and to the inode it clears.
+ * */
+
+#include "protos.h"
+#include "spec_tfs.h"
+
+/*
+ * Slot of a name in the dentry cache
+ * @parent	- inode of the directory
+ * @name		- name (nul or "/" terminated)
+ * @hash		- set to the hash of the name
+ * @len			- set to the compared length of the name
+ * @return	- slot number
+ * */
+unsigned long dentry_slot(int parent, const char *name, u32 *hash, int *len)
+{
+	*hash = hash_dir_name(name, len);
+
+	return (*hash ^ (u32) parent * 2654435761u) % DENTRY_SLOTS;
+}
+
+/*
+ * Look up a path component in the dentry cache
+ * @fs 			- file system structure
+ * @parent	- inode of the directory
+ * @name		- name (nul or "/" terminated)
+ * @inode		- set to the inode of the name, ERROR if it does not exist
+ * @return	- FOUND if the name is cached, else NOT_FOUND
+ * */
+int dentry_lookup(struct tfs *fs, int parent, const char *name, int *inode)
+{
+	struct tfs_dentry *dentry;
+	u32 hash;
+	int len;
+
+	if (!fs->dcache)
+	{
+		fs->dcache = domalloc(DENTRY_SLOTS * sizeof(struct tfs_dentry), 0);
+	}
+	dentry = fs->dcache + dentry_slot(parent, name, &hash, &len);
+
+	if (dentry->parent != parent || dentry->hash != hash
+			|| strncmp(dentry->name, name, len) || dentry->name[len])
+	{
+		fs->dcache_misses++;
+		return NOT_FOUND;
+	}
+	if (dentry->inode == ERROR)
+	{
+		fs->dcache_negative++;
+	}
+	fs->dcache_hits++;
+	*inode = dentry->inode;
+
+	return FOUND;
+}
+
+/*
+ * Remember a path component
+ * @fs 			- file system structure
+ * @parent	- inode of the directory
+ * @name		- name (nul or "/" terminated)
+ * @inode		- inode of the name, ERROR if it does not exist
+ * */
+void dentry_insert(struct tfs *fs, int parent, const char *name, int inode)
+{
+	struct tfs_dentry *dentry;
+	u32 hash;
+	int len;
+
+	if (!fs->dcache)
+	{
+		return;
+	}
+	dentry = fs->dcache + dentry_slot(parent, name, &hash, &len);
+	memcpy(dentry->name, name, len);
+	dentry->name[len] = 0;
+	dentry->parent = parent;
+	dentry->hash = hash;
+	dentry->inode = inode;
+}
+
+/*
+ * Forget a name, after it was added to or removed from a directory
+ * @fs 			- file system structure
+ * @parent	- inode of the directory
+ * @name		- name (nul or "/" terminated)
+ * */
+void dentry_forget(struct tfs *fs, int parent, const char *name)
+{
+	struct tfs_dentry *dentry;
+	u32 hash;
+	int len;
+
+	if (!fs->dcache)
+	{
+		return;
+	}
+	dentry = fs->dcache + dentry_slot(parent, name, &hash, &len);
+
+	if (dentry->parent == parent && dentry->hash == hash
+			&& !strncmp(dentry->name, name, len) && !dentry->name[len])
+	{
+		dentry->parent = 0;
+		fs->dcache_invalidations++;
+	}
+}
+
+/*
+ * Forget all names in and to an inode, after it was cleared
+ * @fs 			- file system structure
+ * @inode		- inode
+ * */
+void dentry_forget_inode(struct tfs *fs, int inode)
+{
+	int i;
+
+	if (!fs->dcache)
+	{
+		return;
+	}
+	for (i = 0; i < DENTRY_SLOTS; i++)
+	{
+		struct tfs_dentry *dentry = fs->dcache + i;
+
+		if (dentry->parent && (dentry->parent == inode || dentry->inode == inode))
+		{
+			dentry->parent = 0;
+			fs->dcache_invalidations++;
+		}
+	}
+}
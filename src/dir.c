@@ -36,6 +36,83 @@ void outent(FILE *fp, const char *dirPtr, int namlen)
 	putc('\n', fp);
 }
 
+/*
+ * Call a function for every entry of a directory,
+ * B-tree directories in name order
+ * @fs			- file system structure
+ * @inode		- inode of the directory
+ * @fn			- called with the name, the inode of the entry and arg,
+ * 						a return value other than 0 ends the walk
+ * @arg			- passed to fn
+ * @return	- the value that ended the walk, else 0
+ * */
+int walk_dir(struct tfs *fs, int inode,
+						 int (*fn)(const char *name, int inode, void *arg), void *arg)
+{
+	char name[DIRNAME_SIZE + 1] = {0};
+	int fdirsize = INODE(fs, inode)->i_size;
+	int dentsz = DIRSIZE(fs);
+	int i, j, bsz, rc;
+	u8 blk[BLOCKSIZE];
+
+	if (is_btree_dir(fs, inode))
+	{
+		// Leaves are chained in name order
+		btree_first_leaf(fs, inode, blk);
+
+		for (;;)
+		{
+			for (j = 0; j < BTREE_HEADER(blk)->count; j++)
+			{
+				memcpy(name, BTREE_ENTRY(blk, j) + 2, DIRNAME_SIZE);
+
+				if ((rc = fn(name, *((u16 *) BTREE_ENTRY(blk, j)), arg)))
+				{
+					return rc;
+				}
+			}
+			if (!BTREE_HEADER(blk)->next)
+			{
+				return 0;
+			}
+			read_inoblk(fs, inode, BTREE_HEADER(blk)->next, blk);
+		}
+	}
+
+	for (i = 0; i < fdirsize; i += BLOCKSIZE)
+	{
+		u32 live;
+
+		bsz = read_inoblk(fs, inode, i / BLOCKSIZE, blk);
+
+		for (live = dir_live_mask(blk, bsz); live; live &= live - 1)
+		{
+			j = __builtin_ctz(live) * dentsz;
+			memcpy(name, blk + j + 2, DIRNAME_SIZE);
+
+			if ((rc = fn(name, *((u16 *) (blk + j)), arg)))
+			{
+				return rc;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Print the name of a directory entry, for walk_dir()
+ * @name		- name
+ * @inode		- inode of the entry
+ * @arg			- file to write to
+ * @return	- 0
+ * */
+int print_dirent(const char *name, int inode, void *arg)
+{
+	outent((FILE *) arg, name, DIRNAME_SIZE);
+
+	return 0;
+}
+
 /*
  * List contents of a directory
  * @fs	 - file system structure
@@ -44,10 +121,6 @@ void outent(FILE *fp, const char *dirPtr, int namlen)
 void dodir(struct tfs *fs,const char *path)
 {
   int inode = find_inode(fs,path);
-  int i,bsz,j;
-  u8 blk[BLOCKSIZE];
-  int fdirsize;
-  int dentsz = DIRSIZE(fs);
 
   if (inode == ERROR)
   {
@@ -61,22 +134,7 @@ void dodir(struct tfs *fs,const char *path)
 		fatalmsg("%s: is not a directory",path);
 	}
 
-	fdirsize = ino->i_size;
-
-  for (i = 0; i < fdirsize; i += BLOCKSIZE)
-  {
-    bsz = read_inoblk(fs,inode,i / BLOCKSIZE,blk);
-    for (j = 0; j < bsz ; j+= dentsz)
-    {
-      u16 fino = *((u16 *)(blk+j));
-
-      if (!fino)
-      {
-      	continue;
-      }
-      outent(stdout,(char *)blk+j+2,dentsz-2);
-    }
-  }
+	walk_dir(fs,inode,print_dirent,stdout);
 }
 
 /*
@@ -114,13 +172,18 @@ void cmd_dir(struct tfs *fs, int argc, char **argv)
  * Create a directory
  * @fs			- file system structure
  * @newdir  - directory name
+ * @btree		- TRUE for a B-tree directory
  * */
-int domkdir(struct tfs *fs, char *newdir)
+int domkdir(struct tfs *fs, char *newdir, int btree)
 {
 	int dinode;
 	int ninode = make_node(fs, newdir, 0755 | S_IFDIR, 0, 0, 0,
 												 NOW, NOW, NOW, &dinode);
 
+	if (btree)
+	{
+		btree_create(fs, ninode);
+	}
 	dname_add(fs, ninode, ".", ninode);
 	dname_add(fs, ninode, "..", dinode);
 
@@ -131,17 +194,19 @@ int domkdir(struct tfs *fs, char *newdir)
 }
 
 /*
- * Command to create directories
+ * Command to create directories, with -b as B-tree directories
  * @fs - file system structure
  * @argc - from command line
  * @argv - from command line
  * */
 void cmd_mkdir(struct tfs *fs, int argc, char **argv)
 {
-	int i;
-	for (i = 3; i < argc; i++)
+	int i = 3;
+	int btree = argc > 3 && !strcmp(argv[3], "-b");
+
+	for (i += btree; i < argc; i++)
 	{
-		domkdir(fs, argv[i]);
+		domkdir(fs, argv[i], btree);
 	}
 }
 
@@ -254,7 +319,7 @@ void cmd_stat(struct tfs *fs, int argc, char **argv)
 	{
 		int i;
 
-		for (i = 3; i <= argc; i++)
+		for (i = 3; i < argc; i++)
 		{
 			printf("%s:\n", argv[i]);
 			dostat(fs, argv[i]);
@@ -262,6 +327,25 @@ void cmd_stat(struct tfs *fs, int argc, char **argv)
 	}
 }
 
+/*
+ * Show free blocks and inodes, like UNIX df
+ * @fs 		- file system structure
+ * @argc	- from command line
+ * @argv 	- from command line
+ * */
+void cmd_df(struct tfs *fs, int argc, char **argv)
+{
+	unsigned long blocks = fs->sb->fs_sizeInBlocks - fs->sb->firstdatazone;
+
+	printf("%-12s %10s %10s %10s\n", argv[1], "total", "used", "free");
+	printf("%-12s %10lu %10lu %10lu\n", "data-blocks", blocks,
+				 blocks - fs->free_zones, fs->free_zones);
+	printf("%-12s %10u %10lu %10lu\n", "inodes", fs->sb->nInodes,
+				 fs->sb->nInodes - fs->free_inodes, fs->free_inodes);
+	printf("%-12s %10lu %10lu %10lu\n", "bytes", blocks * BLOCKSIZE,
+				 (blocks - fs->free_zones) * BLOCKSIZE, fs->free_zones * BLOCKSIZE);
+}
+
 /*
  * Remove an empty directory
  * @fs 	- file system structure
@@ -296,13 +380,46 @@ void dormdir(struct tfs *fs,const char *dir)
 
 	fdirsize = ino->i_size;
 
+  if (is_btree_dir(fs,inode))
+  {
+    // Leaves are never merged, emptied ones stay in the chain
+    btree_first_leaf(fs,inode,blk);
+
+    for (;;)
+    {
+      for (j = 0; j < BTREE_HEADER(blk)->count; j++)
+      {
+        char *name = (char *)BTREE_ENTRY(blk,j)+2;
+
+        if (!strcmp(name,".."))
+        {
+          pinode = *((u16 *)BTREE_ENTRY(blk,j));
+        }
+        else if (strcmp(name,"."))
+        {
+          fatalmsg("%s: not empty",dir);
+        }
+      }
+      if (!BTREE_HEADER(blk)->next)
+      {
+        break;
+      }
+      read_inoblk(fs,inode,BTREE_HEADER(blk)->next,blk);
+    }
+    fdirsize = 0;
+  }
+
   // Do a directory scan...
   for (i = 0; i < fdirsize; i += BLOCKSIZE)
   {
+    u32 live;
+
     bsz = read_inoblk(fs,inode,i / BLOCKSIZE,blk);
 
-    for (j = 0; j < bsz ; j+= dentsz)
+    // Only "." and ".." may be left
+    for (live = dir_live_mask(blk,bsz); live; live &= live - 1)
     {
+      j = __builtin_ctz(live) * dentsz;
       u16 fino = *((u16 *)(blk+j));
 
       if (blk[j+2] == '.' && blk[j+3] == 0)
@@ -314,14 +431,12 @@ void dormdir(struct tfs *fs,const char *dir)
         pinode = fino;
         continue;
       }
-      if (fino != 0)
-      {
-      	fatalmsg("%s: not empty",dir);
-      }
+      fatalmsg("%s: not empty",dir);
     }
   }
 
   // Free stuff
+  begin_change(fs);
   trunc_inode(fs,inode,0);
   clr_inode(fs, inode);
   INODE(fs,pinode)->i_nlinks--;
@@ -364,9 +479,13 @@ void dounlink(struct tfs *fs, char *fpath)
 	char *dir = fpath;
 	char *fname = strrchr(fpath, '/');
 	int dinode, inode;
-	char dir_string[64];
+	char dir_string[PATH_SIZE];
 	char *dir_ptr;
 
+	if (strlen(fpath) >= PATH_SIZE)
+	{
+		fatalmsg("%s: path too long", fpath);
+	}
 	strcpy(dir_string, dir);
 
 	if (fname)
@@ -398,11 +517,12 @@ void dounlink(struct tfs *fs, char *fpath)
 	// Make sure file is not a directory
 	struct tfs_inode *ino = INODE(fs, inode);
 
-	if(ino->i_mode == 16877)
+	if (S_ISDIR(ino->i_mode))
 	{
-		fatalmsg("%s: is a directory", dir);
+		fatalmsg("%s: is a directory", fpath);
 	}
 
+	begin_change(fs);
 	dname_rem(fs, dinode, fname);
 
 	if (--(ino->i_nlinks))
@@ -0,0 +1,360 @@
+/*
+ * Copyright (C) 2016 - Christian Jürgens <christian.textfs@gmail.com>
+ * Copyright (C) 2016 - Dirk Klingenberg <blademountain35@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * */
+
+/*
+ * B-tree directories (mkdir -b)
+ *
+ * Every block of the directory is a node. The first DIRENT_SIZE bytes
+ * hold struct tfs_btree_header, its inode field is 0, so the node is
+ * never mistaken for a flat directory, whose first entry is ".". The
+ * BTREE_ENTRIES entries that follow have the layout of directory
+ * entries and are sorted by name:
+ *
+ * - leaf blocks (directory-leaf-block): inode and name,
+ * - index blocks (index-block): file block of a child and the first
+ *   name stored below it.
+ *
+ * File block 0 is the root. Leaves are chained in name order, so a
+ * listing walks the leaves without sorting. Removed names leave their
+ * leaf shorter, nodes are never merged.
+ * */
+
+#include "protos.h"
+#include "spec_tfs.h"
+
+/*
+ * Is a directory a B-tree
+ * @fs 			- file system structure
+ * @dinode	- inode of the directory
+ * @return	- TRUE for a B-tree directory
+ * */
+int is_btree_dir(struct tfs *fs, int dinode)
+{
+	u8 blk[BLOCKSIZE];
+
+	// Only flat directories get a hash index
+	if ((fs->dirIndex && fs->dirIndex[dinode - 1])
+			|| INODE(fs, dinode)->i_size < BLOCKSIZE)
+	{
+		return 0;
+	}
+	read_inoblk(fs, dinode, 0, blk);
+
+	return !BTREE_HEADER(blk)->zero && BTREE_HEADER(blk)->magic == BTREE_MAGIC;
+}
+
+/*
+ * Directory entry name padded with nul bytes
+ * @key		- DIRNAME_SIZE bytes
+ * @name	- name (nul or "/" terminated)
+ * */
+void btree_key(char *key, const char *name)
+{
+	int i;
+
+	for (i = 0; i < DIRNAME_SIZE && name[i] && name[i] != '/'; i++)
+	{
+		key[i] = name[i];
+	}
+	memset(key + i, 0, DIRNAME_SIZE - i);
+}
+
+/*
+ * Position of a key in a node
+ * @blk			- node
+ * @key			- key from btree_key()
+ * @return	- number of entries not greater than key
+ * */
+int btree_upper(const u8 *blk, const char *key)
+{
+	int lo = 0, hi = BTREE_HEADER(blk)->count;
+
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+
+		if (strncmp(key, (char *) BTREE_ENTRY(blk, mid) + 2, DIRNAME_SIZE) < 0)
+		{
+			hi = mid;
+		}
+		else
+		{
+			lo = mid + 1;
+		}
+	}
+	return lo;
+}
+
+/*
+ * Go down to the leaf a key belongs to
+ * @fs 			- file system structure
+ * @dinode	- inode of the directory
+ * @key			- key from btree_key()
+ * @path		- file blocks of the nodes from the root, BTREE_MAX_DEPTH
+ * @slot		- entry taken in each index node
+ * @blk			- set to the leaf
+ * @return	- depth of the leaf
+ * */
+int btree_find_leaf(struct tfs *fs, int dinode, const char *key, u32 *path,
+										int *slot, u8 *blk)
+{
+	int depth = 0;
+
+	path[0] = 0;
+	read_inoblk(fs, dinode, 0, blk);
+
+	while (BTREE_HEADER(blk)->type == BTREE_NODE)
+	{
+		int i = btree_upper(blk, key);
+
+		// Names below the first key are kept in the first child
+		slot[depth] = i ? i - 1 : 0;
+
+		if (++depth == BTREE_MAX_DEPTH)
+		{
+			fatalmsg("directory inode %d: B-tree too deep", dinode);
+		}
+		path[depth] = *((u16 *) BTREE_ENTRY(blk, slot[depth - 1]));
+		read_inoblk(fs, dinode, path[depth], blk);
+	}
+	return depth;
+}
+
+/*
+ * Find a name in a B-tree directory
+ * @fs 			- file system structure
+ * @dinode	- inode of the directory
+ * @lname 	- filename (nul or "/" terminated)
+ * @blkp 		- file block where name was found
+ * @offp 		- offset pointer where name was found
+ * @return	- inode for found name, -1 on error.
+ * */
+int btree_lookup(struct tfs *fs, int dinode, const char *lname, u32 *blkp,
+								 int *offp)
+{
+	u32 path[BTREE_MAX_DEPTH];
+	int slot[BTREE_MAX_DEPTH];
+	char key[DIRNAME_SIZE];
+	u8 blk[BLOCKSIZE];
+	int depth, i;
+
+	btree_key(key, lname);
+	depth = btree_find_leaf(fs, dinode, key, path, slot, blk);
+	i = btree_upper(blk, key) - 1;
+
+	if (i < 0 || strncmp(key, (char *) BTREE_ENTRY(blk, i) + 2, DIRNAME_SIZE))
+	{
+		return ERROR;
+	}
+	if (blkp)
+	{
+		*blkp = path[depth];
+	}
+	if (offp)
+	{
+		*offp = BTREE_ENTRY(blk, i) - blk;
+	}
+	return *((u16 *) BTREE_ENTRY(blk, i));
+}
+
+/*
+ * Write a node of a B-tree directory
+ * @fs 			- file system structure
+ * @dinode	- inode of the directory
+ * @nblk		- file block of the node
+ * @blk			- node
+ * */
+void btree_write(struct tfs *fs, int dinode, u32 nblk, u8 *blk)
+{
+	write_node_to_inode(fs, dinode, nblk, blk,
+											BTREE_HEADER(blk)->type == BTREE_LEAF ? DIR_LEAF_BLOCK
+																													 : INDEX_BLOCK);
+}
+
+/*
+ * Append a node to a B-tree directory
+ * @fs 			- file system structure
+ * @dinode	- inode of the directory
+ * @return	- file block of the new node
+ * */
+u32 btree_new_node(struct tfs *fs, int dinode)
+{
+	u32 nblk = INODE(fs, dinode)->i_size / BLOCKSIZE;
+
+	// Index entries keep file blocks in 16 bits
+	if (nblk > 0xffff)
+	{
+		fatalmsg("directory inode %d: B-tree full", dinode);
+	}
+	INODE(fs, dinode)->i_size += BLOCKSIZE;
+
+	return nblk;
+}
+
+/*
+ * Turn an empty directory into a B-tree with an empty root leaf
+ * @fs 			- file system structure
+ * @dinode	- inode of the directory
+ * */
+void btree_create(struct tfs *fs, int dinode)
+{
+	u8 blk[BLOCKSIZE] = {0};
+
+	BTREE_HEADER(blk)->magic = BTREE_MAGIC;
+	BTREE_HEADER(blk)->type = BTREE_LEAF;
+	INODE(fs, dinode)->i_size = 0;
+	btree_write(fs, dinode, btree_new_node(fs, dinode), blk);
+}
+
+/*
+ * Add a name to a B-tree directory, nodes that overflow are split
+ * and their upper half moves to a new node
+ * @fs 			- file system structure
+ * @dinode	- inode of the directory
+ * @name		- name to add
+ * @inode		- inode number
+ * */
+void btree_insert(struct tfs *fs, int dinode, const char *name, int inode)
+{
+	u32 path[BTREE_MAX_DEPTH];
+	int slot[BTREE_MAX_DEPTH];
+	char key[DIRNAME_SIZE];
+	u8 blk[BLOCKSIZE], right[BLOCKSIZE], entry[DIRENT_SIZE];
+	u8 entries[(BTREE_ENTRIES + 1) * DIRENT_SIZE];
+	int depth, pos, count, half;
+
+	btree_key(key, name);
+	depth = btree_find_leaf(fs, dinode, key, path, slot, blk);
+	pos = btree_upper(blk, key);
+
+	*((u16 *) entry) = inode;
+	memcpy(entry + 2, key, DIRNAME_SIZE);
+
+	for (;;)
+	{
+		struct tfs_btree_header *hdr = BTREE_HEADER(blk);
+		u32 lblk, rblk;
+
+		count = hdr->count;
+
+		if (count < BTREE_ENTRIES)
+		{
+			memmove(BTREE_ENTRY(blk, pos + 1), BTREE_ENTRY(blk, pos),
+							(count - pos) * DIRENT_SIZE);
+			memcpy(BTREE_ENTRY(blk, pos), entry, DIRENT_SIZE);
+			hdr->count++;
+			btree_write(fs, dinode, path[depth], blk);
+			return;
+		}
+		// Split: all entries in order, the upper half goes right
+		memcpy(entries, BTREE_ENTRY(blk, 0), pos * DIRENT_SIZE);
+		memcpy(entries + pos * DIRENT_SIZE, entry, DIRENT_SIZE);
+		memcpy(entries + (pos + 1) * DIRENT_SIZE, BTREE_ENTRY(blk, pos),
+					 (count - pos) * DIRENT_SIZE);
+		half = (count + 1) / 2;
+
+		memset(right, 0, BLOCKSIZE);
+		*BTREE_HEADER(right) = *hdr;
+		BTREE_HEADER(right)->count = count + 1 - half;
+		memcpy(BTREE_ENTRY(right, 0), entries + half * DIRENT_SIZE,
+					 (count + 1 - half) * DIRENT_SIZE);
+
+		memset(BTREE_ENTRY(blk, 0), 0, BTREE_ENTRIES * DIRENT_SIZE);
+		hdr->count = half;
+		memcpy(BTREE_ENTRY(blk, 0), entries, half * DIRENT_SIZE);
+
+		// The root stays in block 0, both halves move below it
+		lblk = depth ? path[depth] : btree_new_node(fs, dinode);
+		rblk = btree_new_node(fs, dinode);
+
+		if (hdr->type == BTREE_LEAF)
+		{
+			hdr->next = rblk;
+		}
+		btree_write(fs, dinode, lblk, blk);
+		btree_write(fs, dinode, rblk, right);
+
+		if (!depth)
+		{
+			memset(blk, 0, BLOCKSIZE);
+			hdr->magic = BTREE_MAGIC;
+			hdr->type = BTREE_NODE;
+			hdr->count = 2;
+			memcpy(BTREE_ENTRY(blk, 0), entries, DIRENT_SIZE);
+			*((u16 *) BTREE_ENTRY(blk, 0)) = lblk;
+			memcpy(BTREE_ENTRY(blk, 1), BTREE_ENTRY(right, 0), DIRENT_SIZE);
+			*((u16 *) BTREE_ENTRY(blk, 1)) = rblk;
+			btree_write(fs, dinode, 0, blk);
+			return;
+		}
+		// The parent gets the first name of the new node
+		memcpy(entry, BTREE_ENTRY(right, 0), DIRENT_SIZE);
+		*((u16 *) entry) = rblk;
+		pos = slot[--depth] + 1;
+		read_inoblk(fs, dinode, path[depth], blk);
+	}
+}
+
+/*
+ * Remove a name from a B-tree directory
+ * @fs 			- file system structure
+ * @dinode	- inode of the directory
+ * @name		- name to remove
+ * @return	- FOUND or NOT_FOUND
+ * */
+int btree_remove(struct tfs *fs, int dinode, const char *name)
+{
+	u32 path[BTREE_MAX_DEPTH];
+	int slot[BTREE_MAX_DEPTH];
+	char key[DIRNAME_SIZE];
+	u8 blk[BLOCKSIZE];
+	int depth, i, count;
+
+	btree_key(key, name);
+	depth = btree_find_leaf(fs, dinode, key, path, slot, blk);
+	i = btree_upper(blk, key) - 1;
+
+	if (i < 0 || strncmp(key, (char *) BTREE_ENTRY(blk, i) + 2, DIRNAME_SIZE))
+	{
+		return NOT_FOUND;
+	}
+	count = --BTREE_HEADER(blk)->count;
+	memmove(BTREE_ENTRY(blk, i), BTREE_ENTRY(blk, i + 1), (count - i) * DIRENT_SIZE);
+	memset(BTREE_ENTRY(blk, count), 0, DIRENT_SIZE);
+	btree_write(fs, dinode, path[depth], blk);
+
+	return FOUND;
+}
+
+/*
+ * Read the first leaf of a B-tree directory, the others follow
+ * through the next field of their headers
+ * @fs 			- file system structure
+ * @dinode	- inode of the directory
+ * @blk			- set to the leaf
+ * */
+void btree_first_leaf(struct tfs *fs, int dinode, u8 *blk)
+{
+	read_inoblk(fs, dinode, 0, blk);
+
+	while (BTREE_HEADER(blk)->type == BTREE_NODE)
+	{
+		read_inoblk(fs, dinode, *((u16 *) BTREE_ENTRY(blk, 0)), blk);
+	}
+}
@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2016 - Christian Jürgens <christian.textfs@gmail.com>
+ * Copyright (C) 2016 - Dirk Klingenberg <blademountain35@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * */
+
+/*
+ * Directory index
+ *
+ * The first lookup in a directory reads all its entries into a hash
+ * table (name -> inode, position) and a bitmap of the free entries.
+ * ilookup_name(), dname_add() and dname_rem() then work on the index
+ * and only touch the directory block they change.
+ * */
+
+#include "protos.h"
+#include "spec_tfs.h"
+
+/*
+ * Hash of a name as far as directory entries hold it: up to '/',
+ * nul or DIRNAME_SIZE characters
+ * @name		- name
+ * @len			- set to the compared length
+ * @return	- hash value
+ * */
+u32 hash_dir_name(const char *name, int *len)
+{
+	u32 hash = 2166136261u;
+	int i;
+
+	for (i = 0; i < DIRNAME_SIZE && name[i] && name[i] != '/'; i++)
+	{
+		hash = (hash ^ (u8) name[i]) * 16777619u;
+	}
+	*len = i;
+
+	return hash;
+}
+
+/*
+ * Make room for n entry positions in the free entry bitmap
+ * @index	- directory index
+ * @n			- number of entry positions
+ * */
+void grow_dir_holes(struct tfs_dir_index *index, unsigned long n)
+{
+	// find_next_bit() reads whole 64 bit words
+	unsigned long bytes = UPPER(n, 64) * 8;
+
+	if (bytes > index->holeBytes)
+	{
+		bytes = bytes < 2 * index->holeBytes ? 2 * index->holeBytes : bytes;
+		index->holes = realloc(index->holes, bytes);
+
+		if (!index->holes)
+		{
+			die("realloc");
+		}
+		memset(index->holes + index->holeBytes, 0, bytes - index->holeBytes);
+		index->holeBytes = bytes;
+	}
+}
+
+/*
+ * Add a name to the hash table of a directory
+ * @index	- directory index
+ * @name		- name (as in the directory entry)
+ * @inode	- inode of the name
+ * @pos		- byte position of the entry in the directory
+ * */
+void dir_index_insert(struct tfs_dir_index *index, const char *name, int inode,
+											u32 pos)
+{
+	struct tfs_dir_entry *entry;
+	int len, e;
+	u32 hash = hash_dir_name(name, &len);
+
+	if (index->freeEntry != ERROR)
+	{
+		e = index->freeEntry;
+		index->freeEntry = index->entry[e].next;
+	}
+	else
+	{
+		if (index->nEntries == index->maxEntries)
+		{
+			index->maxEntries = index->maxEntries ? 2 * index->maxEntries : 16;
+			index->entry = realloc(index->entry,
+														 index->maxEntries * sizeof(struct tfs_dir_entry));
+			if (!index->entry)
+			{
+				die("realloc");
+			}
+		}
+		e = index->nEntries++;
+	}
+	entry = index->entry + e;
+	memcpy(entry->name, name, len);
+	entry->name[len] = 0;
+	entry->hash = hash;
+	entry->inode = inode;
+	entry->pos = pos;
+	entry->next = index->bucket[hash % DIR_INDEX_BUCKETS];
+	index->bucket[hash % DIR_INDEX_BUCKETS] = e;
+}
+
+/*
+ * Find a name in the hash table of a directory
+ * @index	- directory index
+ * @lname	- name (nul or "/" terminated)
+ * @return	- entry or NULL
+ * */
+struct tfs_dir_entry *dir_index_find(struct tfs_dir_index *index,
+																		 const char *lname)
+{
+	int len, e;
+	u32 hash = hash_dir_name(lname, &len);
+
+	for (e = index->bucket[hash % DIR_INDEX_BUCKETS]; e != ERROR;
+			 e = index->entry[e].next)
+	{
+		struct tfs_dir_entry *entry = index->entry + e;
+
+		if (entry->hash == hash && !strncmp(entry->name, lname, len)
+				&& !entry->name[len])
+		{
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Remove an entry from the hash table of a directory
+ * @index	- directory index
+ * @entry	- entry found by dir_index_find()
+ * */
+void dir_index_remove(struct tfs_dir_index *index, struct tfs_dir_entry *entry)
+{
+	int e = entry - index->entry;
+	int *link = &index->bucket[entry->hash % DIR_INDEX_BUCKETS];
+
+	while (*link != e)
+	{
+		link = &index->entry[*link].next;
+	}
+	*link = entry->next;
+	entry->next = index->freeEntry;
+	index->freeEntry = e;
+}
+
+/*
+ * Index of a directory, read on first use
+ * @fs 			- file system structure
+ * @dinode	- inode of the directory
+ * @return	- directory index
+ * */
+struct tfs_dir_index *dir_index(struct tfs *fs, int dinode)
+{
+	struct tfs_dir_index *index;
+	u8 blk[BLOCKSIZE];
+	int fdirsize = INODE(fs, dinode)->i_size;
+	int dentsz = DIRSIZE(fs);
+	int i, j, bsz;
+
+	if (!fs->dirIndex)
+	{
+		fs->dirIndex = domalloc(fs->sb->nInodes * sizeof(struct tfs_dir_index *), 0);
+	}
+	if (fs->dirIndex[dinode - 1])
+	{
+		return fs->dirIndex[dinode - 1];
+	}
+	index = domalloc(sizeof(struct tfs_dir_index), 0);
+	index->freeEntry = ERROR;
+
+	for (i = 0; i < DIR_INDEX_BUCKETS; i++)
+	{
+		index->bucket[i] = ERROR;
+	}
+	grow_dir_holes(index, fdirsize / dentsz);
+
+	// Same walk as a directory scan, the first of equal names wins
+	for (i = 0; i < fdirsize; i += BLOCKSIZE)
+	{
+		u32 live;
+
+		bsz = read_inoblk(fs, dinode, i / BLOCKSIZE, blk);
+		live = dir_live_mask(blk, bsz);
+
+		for (j = 0; j < bsz; j += dentsz)
+		{
+			u16 fino = *((u16 *) (blk + j));
+			char *name = (char *) blk + j + 2;
+
+			if (!(live & 1u << (j / dentsz)))
+			{
+				setbit((char *) index->holes, (i + j) / dentsz);
+			}
+			else if (!dir_index_find(index, name))
+			{
+				dir_index_insert(index, name, fino, i + j);
+			}
+		}
+	}
+	fs->dirIndex[dinode - 1] = index;
+
+	return index;
+}
+
+/*
+ * Drop the index of a directory
+ * @fs 			- file system structure
+ * @dinode	- inode of the directory
+ * */
+void drop_dir_index(struct tfs *fs, int dinode)
+{
+	struct tfs_dir_index *index;
+
+	if (!fs->dirIndex || !(index = fs->dirIndex[dinode - 1]))
+	{
+		return;
+	}
+	free(index->entry);
+	free(index->holes);
+	free(index);
+	fs->dirIndex[dinode - 1] = NULL;
+}
+
+/*
+ * Free all directory indexes
+ * @fs 			- file system structure
+ * */
+void free_dir_indexes(struct tfs *fs)
+{
+	int i;
+
+	if (!fs->dirIndex)
+	{
+		return;
+	}
+	for (i = 1; i <= fs->sb->nInodes; i++)
+	{
+		drop_dir_index(fs, i);
+	}
+	free(fs->dirIndex);
+	fs->dirIndex = NULL;
+}
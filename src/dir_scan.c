@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2016 - Christian Jürgens <christian.textfs@gmail.com>
+ * Copyright (C) 2016 - Dirk Klingenberg <blademountain35@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * */
+
+/*
+ * Directory block scanner
+ *
+ * A directory block holds BLOCKSIZE / DIRENT_SIZE entries, so the state of
+ * a whole block fits into one mask: bit k is set if entry k is in use.
+ * On x86 CPUs with AVX2 the inode fields of 8 entries are tested with
+ * one gather and compare, else entry by entry.
+ * */
+
+#include "protos.h"
+#include "spec_tfs.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DIR_SCAN_AVX2
+#endif
+
+/*
+ * Entries of a directory block that are in use, entry by entry
+ * @blk			- directory block
+ * @nEntries	- entries in the block
+ * @return	- bit k set if entry k has an inode
+ * */
+u32 dir_live_mask_scalar(const u8 *blk, int nEntries)
+{
+	u32 mask = 0;
+	int k;
+
+	for (k = 0; k < nEntries; k++)
+	{
+		if (*((u16 *) (blk + k * DIRENT_SIZE)))
+		{
+			mask |= 1u << k;
+		}
+	}
+	return mask;
+}
+
+#ifdef DIR_SCAN_AVX2
+/*
+ * Entries of a directory block that are in use, 8 entries at once
+ * @blk			- directory block
+ * @nEntries	- entries in the block
+ * @return	- bit k set if entry k has an inode
+ * */
+__attribute__((target("avx2")))
+u32 dir_live_mask_avx2(const u8 *blk, int nEntries)
+{
+	const __m256i offsets = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m256i inodes = _mm256_set1_epi32(0xffff);
+	const __m256i zero = _mm256_setzero_si256();
+	u32 mask = 0;
+	int k;
+
+	for (k = 0; k + 8 <= nEntries; k += 8)
+	{
+		// First 4 bytes of entries k .. k+7, the inode is the low half
+		__m256i fields = _mm256_i32gather_epi32((const int *) (blk + k * DIRENT_SIZE),
+																						_mm256_slli_epi32(offsets, 5), 1);
+		__m256i empty = _mm256_cmpeq_epi32(_mm256_and_si256(fields, inodes), zero);
+
+		mask |= (u32) (~_mm256_movemask_ps(_mm256_castsi256_ps(empty)) & 0xff) << k;
+	}
+	if (k < nEntries)
+	{
+		mask |= dir_live_mask_scalar(blk + k * DIRENT_SIZE, nEntries - k) << k;
+	}
+	return mask;
+}
+#endif
+
+/*
+ * Entries of a directory block that are in use
+ * @blk			- directory block, as read by read_inoblk()
+ * @bsz			- bytes of the block that belong to the directory
+ * @return	- bit k set if entry k has an inode
+ * */
+u32 dir_live_mask(const u8 *blk, int bsz)
+{
+	int nEntries = UPPER(bsz, DIRENT_SIZE);
+
+#ifdef DIR_SCAN_AVX2
+	if (__builtin_cpu_supports("avx2"))
+	{
+		return dir_live_mask_avx2(blk, nEntries);
+	}
+#endif
+	return dir_live_mask_scalar(blk, nEntries);
+}
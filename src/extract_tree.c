@@ -0,0 +1,381 @@
+/*
+ * Copyright (C) 2016 - Christian Jürgens <christian.textfs@gmail.com>
+ * Copyright (C) 2016 - Dirk Klingenberg <blademountain35@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * */
+
+/*
+ * Recursive extract
+ *
+ * "extract -r /dir hostdir" walks the image tree with walk_dir(),
+ * creates the host directories and symlinks and reads the block map of
+ * every regular file. Up to EXTRACT_THREADS threads then decode the
+ * files into host files. They only read virtualFS (or the arena), never
+ * the block cache, so they need no lock. Mode and time are restored as
+ * by doextract(), for directories after their files are written.
+ *
+ * Image names are checked before they become host paths, and nothing
+ * is written through a symlink: a crafted image must not reach outside
+ * of the target directory.
+ * */
+
+#include <fcntl.h>
+#include <utime.h>
+#include "protos.h"
+#include "spec_tfs.h"
+
+/*
+ * Append an image entry to the list, directories and symlinks are
+ * created on the host right away
+ * @tree		- entries
+ * @dst			- host path
+ * @inode		- inode of the entry
+ * @return	- new entry
+ * */
+struct extract_entry *extract_push(struct extract_tree *tree, const char *dst,
+																	 int inode)
+{
+	struct tfs_inode *ino = INODE(tree->fs, inode);
+	struct extract_entry *e;
+
+	if (tree->n == tree->size)
+	{
+		tree->size = tree->size ? tree->size * 2 : 64;
+		tree->entries = realloc(tree->entries,
+														tree->size * sizeof(struct extract_entry));
+		if (!tree->entries)
+		{
+			die("realloc");
+		}
+	}
+	e = memset(tree->entries + tree->n++, 0, sizeof(struct extract_entry));
+	e->dst = strdup(dst);
+	e->inode = inode;
+	e->mode = ino->i_mode;
+	e->atime = ino->i_atime;
+	e->size = ino->i_size;
+
+	if (!e->dst)
+	{
+		die("strdup");
+	}
+	if (S_ISDIR(e->mode))
+	{
+		struct stat sb;
+
+		// The mode is restored once the directory is filled
+		if (mkdir(dst, 0700) && errno != EEXIST)
+		{
+			die("mkdir(%s)", dst);
+		}
+		// Below the target directory an existing one must be no symlink
+		if (tree->n > 1 && (lstat(dst, &sb) || !S_ISDIR(sb.st_mode)))
+		{
+			fatalmsg("%s: not a directory", dst);
+		}
+	}
+	else if (S_ISLNK(e->mode))
+	{
+		char *target = domalloc(UPPER(e->size, BLOCKSIZE) * BLOCKSIZE + 1, 0);
+		u32 i;
+
+		for (i = 0; i * BLOCKSIZE < e->size; i++)
+		{
+			read_inoblk(tree->fs, inode, i, (u8 *) target + i * BLOCKSIZE);
+		}
+		target[e->size] = 0;
+
+		if (symlink(target, dst))
+		{
+			die("symlink(%s)", dst);
+		}
+		free(target);
+	}
+	else if (S_ISREG(e->mode))
+	{
+		e->map = read_block_map(tree->fs, ino, UPPER(e->size, BLOCKSIZE));
+		tree->files++;
+	}
+	return e;
+}
+
+/*
+ * walk_dir() function: append a directory entry
+ * @name		- name of the entry
+ * @inode		- inode of the entry
+ * @arg			- struct extract_tree, parent is the host directory
+ * @return	- 0
+ * */
+int extract_name(const char *name, int inode, void *arg)
+{
+	struct extract_tree *tree = arg;
+	char *dst;
+
+	if (!strcmp(name, ".") || !strcmp(name, ".."))
+	{
+		if (!S_ISDIR(INODE(tree->fs, inode)->i_mode))
+		{
+			fatalmsg("%s/%s: is not a directory", tree->parent, name);
+		}
+		return 0;
+	}
+	// The name becomes part of a host path
+	if (!*name || strchr(name, '/'))
+	{
+		fatalmsg("%s: invalid name \"%s\"", tree->parent, name);
+	}
+	dst = domalloc(strlen(tree->parent) + strlen(name) + 2, 0);
+	sprintf(dst, "%s/%s", tree->parent, name);
+
+	extract_push(tree, dst, inode);
+	free(dst);
+
+	return 0;
+}
+
+/*
+ * List a directory entry and everything below it
+ * @tree	- entries
+ * @i		- entry of the directory
+ * */
+void extract_walk(struct extract_tree *tree, unsigned long i)
+{
+	unsigned long first = tree->n, last;
+
+	tree->parent = tree->entries[i].dst;
+	walk_dir(tree->fs, tree->entries[i].inode, extract_name, tree);
+
+	// Subdirectories once this directory is listed, walk_dir() calls do not nest
+	for (last = tree->n; first < last; first++)
+	{
+		if (S_ISDIR(tree->entries[first].mode))
+		{
+			extract_walk(tree, first);
+		}
+	}
+}
+
+/*
+ * Decode a data block like readVirtualBlock(), without the block cache
+ * @fs			- file system structure
+ * @blk			- block-id
+ * @buf			- BLOCKSIZE bytes
+ * @return	- 0 or ERROR if the block holds no valid data
+ * */
+int extract_block(struct tfs *fs, unsigned long blk, u8 *buf)
+{
+	if (fs->arena && blk < fs->sb->fs_sizeInBlocks && fs->arenaValid[blk])
+	{
+		memcpy(buf, ARENA_BLOCK(fs, blk), BLOCKSIZE);
+		return 0;
+	}
+	return readVirtualDataBlock(goto_dataBlk(fs, blk), (unsigned long) buf);
+}
+
+/*
+ * Write a regular file to the host, runs in a worker. Errors are kept
+ * in the entry.
+ * @fs	- file system structure
+ * @e	- entry
+ * */
+void extract_write(struct tfs *fs, struct extract_entry *e)
+{
+	unsigned long nBlocks = UPPER(e->size, BLOCKSIZE);
+	unsigned long i;
+	u8 blk[BLOCKSIZE];
+	int fd = open(e->dst, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0600);
+	FILE *fp = fd < 0 ? NULL : fdopen(fd, "wb");
+
+	if (!fp)
+	{
+		e->err = errno;
+
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		return;
+	}
+	for (i = 0; i < nBlocks && !e->err && !e->badBlock; i++)
+	{
+		int bsz = i == nBlocks - 1 && e->size % BLOCKSIZE ? e->size % BLOCKSIZE
+																											: BLOCKSIZE;
+
+		if (!e->map[i])
+		{
+			// A hole
+			if (fseek(fp, bsz, SEEK_CUR))
+			{
+				e->err = errno;
+			}
+		}
+		else if (extract_block(fs, e->map[i], blk) == ERROR)
+		{
+			e->badBlock = e->map[i];
+		}
+		else if (fwrite(blk, 1, bsz, fp) != bsz)
+		{
+			e->err = errno;
+		}
+	}
+	// A hole at the end has no bytes written
+	if ((fflush(fp) || ftruncate(fileno(fp), e->size)) && !e->err)
+	{
+		e->err = errno;
+	}
+	fclose(fp);
+
+	restore_attrs(e->dst, e->mode, e->atime);
+}
+
+/*
+ * Worker thread: write the next regular files of the list
+ * @arg			- struct extract_tree
+ * @return	- NULL
+ * */
+void *extract_worker(void *arg)
+{
+	struct extract_tree *tree = arg;
+
+	for (;;)
+	{
+		unsigned long i;
+
+		pthread_mutex_lock(&tree->lock);
+		i = tree->next++;
+		pthread_mutex_unlock(&tree->lock);
+
+		if (i >= tree->n)
+		{
+			break;
+		}
+		if (S_ISREG(tree->entries[i].mode))
+		{
+			extract_write(tree->fs, tree->entries + i);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Join the workers and free the list
+ * @tree	- entries, freed
+ * */
+void extract_end(struct extract_tree *tree)
+{
+	unsigned long i;
+	int t;
+
+	for (t = 0; t < tree->nThreads; t++)
+	{
+		pthread_join(tree->threads[t], NULL);
+	}
+	for (i = 0; i < tree->n; i++)
+	{
+		free(tree->entries[i].dst);
+		free(tree->entries[i].map);
+	}
+	free(tree->entries);
+	pthread_mutex_destroy(&tree->lock);
+	free(tree);
+}
+
+/*
+ * Extract a directory tree to the host
+ * @fs		- file system structure
+ * @path	- directory in the image
+ * @dst		- host directory, created if it does not exist
+ * */
+void doextract_tree(struct tfs *fs, const char *path, const char *dst)
+{
+	struct extract_tree *tree = domalloc(sizeof(struct extract_tree), 0);
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	jmp_buf env, *saved = fatal_jmp;
+	struct extract_entry *e;
+	unsigned long i;
+	int inode, rc;
+
+	tree->fs = fs;
+	pthread_mutex_init(&tree->lock, NULL);
+
+	// The list is freed before the error goes on
+	if ((rc = setjmp(env)))
+	{
+		extract_end(tree);
+		fatal_jmp = saved;
+
+		if (saved)
+		{
+			longjmp(*saved, rc);
+		}
+		fprintf(stderr, "%s\n", fatal_text);
+		exit(ERROR);
+	}
+	fatal_jmp = &env;
+
+	if ((inode = find_inode(fs, path)) == ERROR)
+	{
+		fatalmsg("%s: not found", path);
+	}
+	if (!S_ISDIR(INODE(fs, inode)->i_mode))
+	{
+		fatalmsg("%s: is not a directory", path);
+	}
+	extract_push(tree, dst, inode);
+	extract_walk(tree, 0);
+
+	// The calling thread is a worker too
+	while (tree->nThreads + 1 < cpus && tree->nThreads < EXTRACT_THREADS - 1
+				 && tree->nThreads + 1 < tree->files)
+	{
+		if (pthread_create(&tree->threads[tree->nThreads], NULL, extract_worker, tree))
+		{
+			break;
+		}
+		tree->nThreads++;
+	}
+	extract_worker(tree);
+
+	for (; tree->nThreads; tree->nThreads--)
+	{
+		pthread_join(tree->threads[tree->nThreads - 1], NULL);
+	}
+	for (i = 0; i < tree->n; i++)
+	{
+		e = tree->entries + i;
+
+		if (e->err)
+		{
+			errno = e->err;
+			die("%s", e->dst);
+		}
+		if (e->badBlock)
+		{
+			fatalmsg("block-id: %lu: no valid data block", e->badBlock);
+		}
+	}
+	// Children first, their files change the time of the directory
+	for (i = tree->n; i--; )
+	{
+		if (S_ISDIR(tree->entries[i].mode))
+		{
+			restore_attrs(tree->entries[i].dst, tree->entries[i].mode,
+										tree->entries[i].atime);
+		}
+	}
+	extract_end(tree);
+	fatal_jmp = saved;
+}
@@ -0,0 +1,485 @@
+/*
+ * Copyright (C) 2016 - Christian Jürgens <christian.textfs@gmail.com>
+ * Copyright (C) 2016 - Dirk Klingenberg <blademountain35@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * */
+
+/*
+ * Codec for the hex dump lines of data blocks:
+ *
+ * 000:\t00 11 22 33 44 55 66 77  88 99 aa bb cc dd ee ff  |ASCII-column    |
+ *
+ * Every line is DATA_LINE_WIDTH - 1 characters long, so the hex digit
+ * of byte k of a line is always found at the same column. A block of
+ * BLOCKSIZE bytes is DATA_TEXT_SIZE characters including the blank line.
+ * */
+
+#include "spec_tfs.h"
+#include "protos.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_AVX2
+#endif
+
+#define LINES_PER_BLOCK (BLOCKSIZE / 16)
+#define LINE_STRIDE (DATA_LINE_WIDTH - 1)
+#define HEX_COLUMN 5								// behind "000:\t"
+#define HEX_CHARS 48								// "00 .. 77  88 .. ff" without last space
+#define HEX_DIGITS 0xdb6db66db6dbULL	// columns of hex digits in HEX_CHARS
+#define HEX_ALL ((1ULL << HEX_CHARS) - 1)
+
+// Column of the high nibble of byte k in a line
+#define HEX_POS(k) (3 * (k) + ((k) > 7))
+
+/*
+ * Check line label "NNN:\t" and separator behind the last byte
+ * @line		- begin of line
+ * @return	- 0 if the line is well formed
+ * */
+static int checkLineFrame(const char *line)
+{
+	if (line[3] != ':' || line[4] != '\t' || line[HEX_COLUMN + HEX_CHARS] != ' ')
+	{
+		return ERROR;
+	}
+	return 0;
+}
+
+#if !defined(__SSE2__)
+
+/*
+ * Hex digit values, -1 for everything else
+ * */
+static const signed char hexValue[256] =
+{
+	[0 ... 255] = -1,
+	['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4,
+	['5'] = 5, ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+	['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+	['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15
+};
+
+/*
+ * Decode one line byte by byte
+ * @line		- begin of line
+ * @out			- 16 bytes output
+ * @return	- 0 or ERROR on bad hex digits
+ * */
+static int decodeLineScalar(const char *line, u8 *out)
+{
+	const u8 *hex = (const u8 *) line + HEX_COLUMN;
+	int hi, lo, k, p;
+
+	if (checkLineFrame(line) || hex[24] != ' ')
+	{
+		return ERROR;
+	}
+	for (k = 0; k < 16; k++)
+	{
+		p = HEX_POS(k);
+		hi = hexValue[hex[p]];
+		lo = hexValue[hex[p + 1]];
+
+		if (hi < 0 || lo < 0 || hex[p + 2] != ' ')
+		{
+			return ERROR;
+		}
+		out[k] = (hi << 4) | lo;
+	}
+	return 0;
+}
+
+/*
+ * Decode data block byte by byte
+ * @blockPtr	- ptr to "000:" of block
+ * @buf				- BLOCKSIZE output
+ * @return		- 0 or ERROR
+ * */
+static int decodeBlockScalar(const char *blockPtr, u8 *buf)
+{
+	int i;
+
+	for (i = 0; i < LINES_PER_BLOCK; i++, blockPtr += LINE_STRIDE, buf += 16)
+	{
+		if (decodeLineScalar(blockPtr, buf))
+		{
+			return ERROR;
+		}
+	}
+	return 0;
+}
+
+#else
+
+/*
+ * Convert 16 characters to nibbles
+ * @c				- characters
+ * @valid		- 0xff for every hex digit
+ * @return	- nibble values, undefined where not valid
+ * */
+static inline __m128i hexNibbleSSE2(__m128i c, __m128i *valid)
+{
+	__m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+	__m128i a = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)),
+													 _mm_set1_epi8('a'));
+	__m128i isDigit = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+	__m128i isAlpha = _mm_cmpeq_epi8(_mm_min_epu8(a, _mm_set1_epi8(5)), a);
+
+	*valid = _mm_or_si128(isDigit, isAlpha);
+
+	return _mm_or_si128(_mm_and_si128(isDigit, d),
+											_mm_and_si128(isAlpha, _mm_add_epi8(a, _mm_set1_epi8(10))));
+}
+
+/*
+ * Decode one line, digits are converted and checked 16 at once
+ * @line		- begin of line
+ * @out			- 16 bytes output
+ * @return	- 0 or ERROR on bad hex digits
+ * */
+static int decodeLineSSE2(const char *line, u8 *out)
+{
+	const char *hex = line + HEX_COLUMN;
+	__m128i nib[3], valid;
+	u8 pairs[HEX_CHARS];
+	uint64_t digits = 0, spaces = 0;
+	int i, k;
+
+	for (i = 0; i < 3; i++)
+	{
+		__m128i c = _mm_loadu_si128((const __m128i *) (hex + 16 * i));
+
+		nib[i] = hexNibbleSSE2(c, &valid);
+		digits |= (uint64_t) (u16) _mm_movemask_epi8(valid) << (16 * i);
+		spaces |= (uint64_t) (u16) _mm_movemask_epi8(
+								_mm_cmpeq_epi8(c, _mm_set1_epi8(' '))) << (16 * i);
+	}
+	if ((digits & HEX_DIGITS) != HEX_DIGITS
+			|| (spaces & ~HEX_DIGITS & HEX_ALL) != (~HEX_DIGITS & HEX_ALL)
+			|| checkLineFrame(line))
+	{
+		return ERROR;
+	}
+
+	// pairs[p] = nibble[p] << 4 | nibble[p + 1]
+	for (i = 0; i < 3; i++)
+	{
+		__m128i next = i < 2 ? _mm_slli_si128(nib[i + 1], 15) : _mm_setzero_si128();
+		__m128i lo = _mm_or_si128(_mm_srli_si128(nib[i], 1), next);
+
+		_mm_storeu_si128((__m128i *) (pairs + 16 * i),
+										 _mm_or_si128(_mm_slli_epi16(nib[i], 4), lo));
+	}
+	for (k = 0; k < 16; k++)
+	{
+		out[k] = pairs[HEX_POS(k)];
+	}
+	return 0;
+}
+
+/*
+ * Decode data block line by line with SSE2
+ * @blockPtr	- ptr to "000:" of block
+ * @buf				- BLOCKSIZE output
+ * @return		- 0 or ERROR
+ * */
+static int decodeBlockSSE2(const char *blockPtr, u8 *buf)
+{
+	int i;
+
+	for (i = 0; i < LINES_PER_BLOCK; i++, blockPtr += LINE_STRIDE, buf += 16)
+	{
+		if (decodeLineSSE2(blockPtr, buf))
+		{
+			return ERROR;
+		}
+	}
+	return 0;
+}
+
+#endif /* __SSE2__ */
+
+#ifdef HAVE_AVX2
+
+/*
+ * Convert 32 characters to nibbles
+ * @c				- characters
+ * @valid		- 0xff for every hex digit
+ * @return	- nibble values, undefined where not valid
+ * */
+__attribute__((target("avx2")))
+static inline __m256i hexNibbleAVX2(__m256i c, __m256i *valid)
+{
+	__m256i d = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+	__m256i a = _mm256_sub_epi8(_mm256_or_si256(c, _mm256_set1_epi8(0x20)),
+															_mm256_set1_epi8('a'));
+	__m256i isDigit = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+	__m256i isAlpha = _mm256_cmpeq_epi8(_mm256_min_epu8(a, _mm256_set1_epi8(5)), a);
+
+	*valid = _mm256_or_si256(isDigit, isAlpha);
+
+	return _mm256_or_si256(_mm256_and_si256(isDigit, d),
+												 _mm256_and_si256(isAlpha,
+																					_mm256_add_epi8(a, _mm256_set1_epi8(10))));
+}
+
+/*
+ * Decode two lines at once, one line per 128 bit lane
+ * @line		- begin of first line, the second one follows
+ * @out			- 32 bytes output
+ * @return	- 0 or ERROR on bad hex digits
+ * */
+__attribute__((target("avx2")))
+static int decodeLinePairAVX2(const char *line, u8 *out)
+{
+	const char *hexA = line + HEX_COLUMN;
+	const char *hexB = hexA + LINE_STRIDE;
+	__m256i nib[3], pairs[3], valid, res;
+	uint64_t digitsA = 0, digitsB = 0, spacesA = 0, spacesB = 0;
+	u32 bits;
+	int i;
+
+	// Columns of the high nibbles, 0x80 clears the byte
+	const __m256i pick0 = _mm256_setr_epi8(
+			0, 3, 6, 9, 12, 15, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128,
+			0, 3, 6, 9, 12, 15, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128);
+	const __m256i pick1 = _mm256_setr_epi8(
+			-128, -128, -128, -128, -128, -128, 2, 5, 9, 12, 15, -128, -128, -128, -128, -128,
+			-128, -128, -128, -128, -128, -128, 2, 5, 9, 12, 15, -128, -128, -128, -128, -128);
+	const __m256i pick2 = _mm256_setr_epi8(
+			-128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, 2, 5, 8, 11, 14,
+			-128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, 2, 5, 8, 11, 14);
+
+	for (i = 0; i < 3; i++)
+	{
+		__m256i c = _mm256_inserti128_si256(
+									_mm256_castsi128_si256(
+										_mm_loadu_si128((const __m128i *) (hexA + 16 * i))),
+									_mm_loadu_si128((const __m128i *) (hexB + 16 * i)), 1);
+
+		nib[i] = hexNibbleAVX2(c, &valid);
+
+		bits = _mm256_movemask_epi8(valid);
+		digitsA |= (uint64_t) (bits & 0xffff) << (16 * i);
+		digitsB |= (uint64_t) (bits >> 16) << (16 * i);
+
+		bits = _mm256_movemask_epi8(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')));
+		spacesA |= (uint64_t) (bits & 0xffff) << (16 * i);
+		spacesB |= (uint64_t) (bits >> 16) << (16 * i);
+	}
+	if ((digitsA & digitsB & HEX_DIGITS) != HEX_DIGITS
+			|| (spacesA & spacesB & ~HEX_DIGITS & HEX_ALL) != (~HEX_DIGITS & HEX_ALL)
+			|| checkLineFrame(line) || checkLineFrame(line + LINE_STRIDE))
+	{
+		return ERROR;
+	}
+
+	// pairs[p] = nibble[p] << 4 | nibble[p + 1], per lane
+	pairs[0] = _mm256_or_si256(_mm256_slli_epi16(nib[0], 4),
+														 _mm256_alignr_epi8(nib[1], nib[0], 1));
+	pairs[1] = _mm256_or_si256(_mm256_slli_epi16(nib[1], 4),
+														 _mm256_alignr_epi8(nib[2], nib[1], 1));
+	pairs[2] = _mm256_or_si256(_mm256_slli_epi16(nib[2], 4),
+														 _mm256_srli_si256(nib[2], 1));
+
+	res = _mm256_or_si256(_mm256_shuffle_epi8(pairs[0], pick0),
+												_mm256_or_si256(_mm256_shuffle_epi8(pairs[1], pick1),
+																				_mm256_shuffle_epi8(pairs[2], pick2)));
+	_mm256_storeu_si256((__m256i *) out, res);
+
+	return 0;
+}
+
+/*
+ * Decode data block two lines at a time with AVX2
+ * @blockPtr	- ptr to "000:" of block
+ * @buf				- BLOCKSIZE output
+ * @return		- 0 or ERROR
+ * */
+__attribute__((target("avx2")))
+static int decodeBlockAVX2(const char *blockPtr, u8 *buf)
+{
+	int i;
+
+	for (i = 0; i < LINES_PER_BLOCK; i += 2, blockPtr += 2 * LINE_STRIDE, buf += 32)
+	{
+		if (decodeLinePairAVX2(blockPtr, buf))
+		{
+			return ERROR;
+		}
+	}
+	return 0;
+}
+
+#endif /* HAVE_AVX2 */
+
+/*
+ * Choose the fastest decoder of this cpu
+ * @return	- decoder function
+ * */
+static int (*selectDecoder(void))(const char *, u8 *)
+{
+#ifdef HAVE_AVX2
+	if (__builtin_cpu_supports("avx2"))
+	{
+		return decodeBlockAVX2;
+	}
+#endif
+#if defined(__SSE2__)
+	return decodeBlockSSE2;
+#else
+	return decodeBlockScalar;
+#endif
+}
+
+/*
+ * Decode the 32 hex dump lines of a data block
+ * @blockPtr	- ptr to "000:" of block
+ * @buf				- BLOCKSIZE output
+ * @return		- 0 or ERROR if the block holds no valid hex dump
+ * */
+int decodeDataBlock(const char *blockPtr, u8 *buf)
+{
+	static int (*decoder)(const char *, u8 *);
+	// Handles of libtextfs decode in parallel, all threads select the same
+	int (*d)(const char *, u8 *) = __atomic_load_n(&decoder, __ATOMIC_RELAXED);
+
+	if (!d)
+	{
+		d = selectDecoder();
+		__atomic_store_n(&decoder, d, __ATOMIC_RELAXED);
+	}
+	return d(blockPtr, buf);
+}
+
+/**************************************************************************************************
+ * Encoder
+ **************************************************************************************************/
+
+static const char hexDigit[] = "0123456789abcdef";
+
+#if defined(__SSE2__)
+
+/*
+ * Convert 16 nibbles to hex characters
+ * @n				- nibbles
+ * @return	- characters '0'..'9', 'a'..'f'
+ * */
+static inline __m128i hexCharSSE2(__m128i n)
+{
+	__m128i isAlpha = _mm_cmpgt_epi8(n, _mm_set1_epi8(9));
+
+	return _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')),
+											_mm_and_si128(isAlpha, _mm_set1_epi8('a' - '0' - 10)));
+}
+
+/*
+ * Render hex digits and ASCII column of one line
+ * @in		- 16 bytes input
+ * @hex		- 32 hex characters, high nibble first
+ * @ascii	- 16 characters of ASCII column
+ * */
+static inline void encodeLineSSE2(const u8 *in, char *hex, char *ascii)
+{
+	__m128i b = _mm_loadu_si128((const __m128i *) in);
+	__m128i lo = _mm_and_si128(b, _mm_set1_epi8(0x0f));
+	__m128i hi = _mm_and_si128(_mm_srli_epi16(b, 4), _mm_set1_epi8(0x0f));
+	__m128i printable = _mm_and_si128(_mm_cmpgt_epi8(b, _mm_set1_epi8(32)),
+																		_mm_cmpgt_epi8(_mm_set1_epi8(127), b));
+
+	hi = hexCharSSE2(hi);
+	lo = hexCharSSE2(lo);
+	_mm_storeu_si128((__m128i *) hex, _mm_unpacklo_epi8(hi, lo));
+	_mm_storeu_si128((__m128i *) (hex + 16), _mm_unpackhi_epi8(hi, lo));
+	_mm_storeu_si128((__m128i *) ascii,
+									 _mm_or_si128(_mm_and_si128(printable, b),
+																_mm_andnot_si128(printable, _mm_set1_epi8(' '))));
+}
+
+#else
+
+/*
+ * Render hex digits and ASCII column of one line
+ * @in		- 16 bytes input
+ * @hex		- 32 hex characters, high nibble first
+ * @ascii	- 16 characters of ASCII column
+ * */
+static inline void encodeLineScalar(const u8 *in, char *hex, char *ascii)
+{
+	int k;
+
+	for (k = 0; k < 16; k++)
+	{
+		hex[2 * k] = hexDigit[in[k] >> 4];
+		hex[2 * k + 1] = hexDigit[in[k] & 0x0f];
+		ascii[k] = in[k] > 32 && in[k] < 127 ? in[k] : ' ';
+	}
+}
+
+#endif /* __SSE2__ */
+
+/*
+ * Render data lines of a block, same format as the former byte wise
+ * fprintf() output: "NNN:\t", 16 hex bytes, " |", ASCII column, "|\n"
+ * and a blank line at the end.
+ * @buf			- data to render, read in whole lines of 16 bytes
+ * @size		- size of data (at most BLOCKSIZE)
+ * @text		- output, at least DATA_TEXT_SIZE characters, not terminated
+ * @return	- number of characters written
+ * */
+int encodeDataBlock(const u8 *buf, int size, char *text)
+{
+	char hex[32];
+	char *line = text;
+	int i, k, offset;
+
+	for (i = 0; i < UPPER(size, 16); i++, buf += 16, line += LINE_STRIDE)
+	{
+		offset = i * 16;
+		line[0] = hexDigit[offset / 100];
+		line[1] = hexDigit[offset / 10 % 10];
+		line[2] = hexDigit[offset % 10];
+		line[3] = ':';
+		line[4] = '\t';
+
+#if defined(__SSE2__)
+		encodeLineSSE2(buf, hex, line + HEX_COLUMN + HEX_CHARS + 3);
+#else
+		encodeLineScalar(buf, hex, line + HEX_COLUMN + HEX_CHARS + 3);
+#endif
+		for (k = 0; k < 16; k++)
+		{
+			char *p = line + HEX_COLUMN + HEX_POS(k);
+
+			p[0] = hex[2 * k];
+			p[1] = hex[2 * k + 1];
+			p[2] = ' ';
+		}
+		line[HEX_COLUMN + 24] = ' ';
+		line[HEX_COLUMN + HEX_CHARS + 1] = ' ';
+		line[HEX_COLUMN + HEX_CHARS + 2] = '|';
+		line[LINE_STRIDE - 2] = '|';
+		line[LINE_STRIDE - 1] = '\n';
+	}
+	*line++ = '\n';
+
+	return line - text;
+}
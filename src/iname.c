@@ -22,32 +22,6 @@
 #include "protos.h"
 #include "bitops.h"
 
-/*
- * Compare filenames in a directory structure
- * @lname - name to compare
- * @dname - directory name to compare
- * @len		- length of directory structure
- * */
-int cmp_name(const char *lname, const char *dname, int nlen)
-{
-	int i;
-
-	for (i = 0; i < nlen; i++)
-	{
-		if (lname[i] == '/' || lname[i] == 0)
-		{
-			if (!dname[i])
-			{
-				return 0;
-			}
-			return ERROR;
-		}
-		if (lname[i] != dname[i])
-			return 1;
-	}
-	return 0;
-}
-
 /*
  * Find name in a directory
  * Update *blkp and *offp if name is found
@@ -61,40 +35,32 @@ int cmp_name(const char *lname, const char *dname, int nlen)
 int ilookup_name( struct tfs *fs, int inode, const char *lname,
 									u32 *blkp, int *offp)
 {
-	int i, bsz, j;
-	u8 blk[BLOCKSIZE];
-	int fdirsize = (INODE(fs, inode))->i_size;
-	int dentsz = DIRSIZE(fs);
+	struct tfs_dir_entry *entry;
 
-	for (i = 0; i < fdirsize; i += BLOCKSIZE)
+	if (is_btree_dir(fs, inode))
 	{
-		bsz = read_inoblk(fs, inode, i / BLOCKSIZE, blk);
-		for (j = 0; j < bsz; j += dentsz)
-		{
-			u16 fino = *((u16 *) (blk + j));
-			if (!fino)
-			{
-				continue;
-			}
-			if (!cmp_name(lname, (char*)blk + j + 2, dentsz - 2))
-			{
-				if (blkp)
-				{
-					*blkp = i / BLOCKSIZE;
-				}
-				if (offp)
-				{
-					*offp = j;
-				}
-				return fino;
-			}
-		}
+		return btree_lookup(fs, inode, lname, blkp, offp);
+	}
+	entry = dir_index_find(dir_index(fs, inode), lname);
+
+	if (!entry)
+	{
+		return ERROR;
 	}
-	return ERROR;
+	if (blkp)
+	{
+		*blkp = entry->pos / BLOCKSIZE;
+	}
+	if (offp)
+	{
+		*offp = entry->pos % BLOCKSIZE;
+	}
+	return entry->inode;
 }
 
 /*
  * Add file name to a directory.
+ * The first free entry is reused, else the directory grows.
  * @fs 		- file system structure
  * @dir 	- path to directory
  * @name 	- name to add
@@ -102,47 +68,49 @@ int ilookup_name( struct tfs *fs, int inode, const char *lname,
  */
 void dname_add(struct tfs *fs, int dinode, const char *name, int inode)
 {
+	struct tfs_dir_index *index;
 	u8 blk[BLOCKSIZE] = {0};
 	int dentsz = DIRSIZE(fs);
-	int dfsize = INODE(fs,dinode)->i_size;
-	int i, j = 0, nblk = 0, bsz;
+	unsigned long nEntries = INODE(fs,dinode)->i_size / dentsz;
+	unsigned long hole;
+	u32 pos, nblk;
 
-	for (i = 0; i < dfsize; i += BLOCKSIZE)
+	if (is_btree_dir(fs, dinode))
 	{
-		bsz = read_inoblk(fs, dinode, nblk = i / BLOCKSIZE, blk);
+		btree_insert(fs, dinode, name, inode);
+		dentry_forget(fs, dinode, name);
+		return;
+	}
+	index = dir_index(fs, dinode);
+	hole = find_next_bit(index->holes, nEntries, 0, 1);
 
-		for (j = 0; j < bsz; j += dentsz)
-		{
-			u16 fino = *((u16 *) (blk + j));
-			if (!fino)
-			{
-				goto SKIP_ALL;
-			}
-		}
+	if (hole < nEntries)
+	{
+		clrbit((char *) index->holes, hole);
+		pos = hole * dentsz;
 	}
-	SKIP_ALL:
-	if (i >= dfsize)
+	else
 	{
 		//Need to extend directory file
+		pos = INODE(fs,dinode)->i_size;
 		INODE(fs,dinode)->i_size += dentsz;
-
-		if (j == BLOCKSIZE)
-		{
-			nblk++;
-			j = 0;
-			memset(blk, 0, BLOCKSIZE);
-		}
+		grow_dir_holes(index, nEntries + 1);
 	}
-	else
+	nblk = pos / BLOCKSIZE;
+
+	if (pos % BLOCKSIZE || hole < nEntries)
 	{
-		memset(blk + j, 0, dentsz);
+		read_inoblk(fs, dinode, nblk, blk);
 	}
 	// Create directory entry
-	*((u16 *) (blk + j)) = inode;
-	strncpy((char*)blk + j + 2, name, dentsz - 2);
+	memset(blk + pos % BLOCKSIZE, 0, dentsz);
+	*((u16 *) (blk + pos % BLOCKSIZE)) = inode;
+	strncpy((char*)blk + pos % BLOCKSIZE + 2, name, dentsz - 2);
 
 	// Update directory
 	write_block_to_inode(fs, dinode, nblk, blk);
+	dentry_forget(fs, dinode, name);
+	dir_index_insert(index, (char*)blk + pos % BLOCKSIZE + 2, inode, pos);
 }
 
 /*
@@ -154,18 +122,31 @@ void dname_add(struct tfs *fs, int dinode, const char *name, int inode)
  */
 void dname_rem(struct tfs *fs, int dinode, const char *name)
 {
+	struct tfs_dir_index *index;
+	struct tfs_dir_entry *entry;
 	u8 blk[BLOCKSIZE];
 	int dentsz = DIRSIZE(fs);
 	u32 nblk;
 	int off;
 	int i;
 
-	i = ilookup_name(fs, dinode, name, &nblk, &off);
+	if (is_btree_dir(fs, dinode))
+	{
+		btree_remove(fs, dinode, name);
+		dentry_forget(fs, dinode, name);
+		return;
+	}
+	index = dir_index(fs, dinode);
+	entry = dir_index_find(index, name);
 
-	if (i == ERROR)
+	if (!entry)
 	{
 		return;
 	}
+	nblk = entry->pos / BLOCKSIZE;
+	off = entry->pos % BLOCKSIZE;
+	dir_index_remove(index, entry);
+	dentry_forget(fs, dinode, name);
 
 	i = (INODE(fs,dinode)->i_size) - dentsz;
 
@@ -185,6 +166,7 @@ void dname_rem(struct tfs *fs, int dinode, const char *name)
 		read_inoblk(fs, dinode, nblk, blk);
 		memset(blk + off, 0, dentsz);
 		write_block_to_inode(fs, dinode, nblk, blk);
+		setbit((char *) index->holes, (nblk * BLOCKSIZE + off) / dentsz);
 	}
 }
 
@@ -206,15 +188,19 @@ int make_node(struct tfs *fs, char *fpath, int mode,
 							u32 atime, u32 mtime, u32 ctime, int *dinode_p)
 {
 	char *dir = fpath;
-
-	// Copy path to string
-	char dir_string[64];
-	strcpy(dir_string, dir);
+	char dir_string[PATH_SIZE];
 
 	// Get filename
 	char *fname = strrchr(fpath, '/');
 	int dinode, ninode;
 
+	if (strlen(fpath) >= PATH_SIZE)
+	{
+		fatalmsg("%s: path too long", fpath);
+	}
+	// Copy path to string
+	strcpy(dir_string, dir);
+
 	// If file exist in directory, then break
 	if (find_inode(fs, fpath) != ERROR)
 	{
@@ -240,6 +226,10 @@ int make_node(struct tfs *fs, char *fpath, int mode,
 	{
 		fatalmsg("%s: not found\n", dir);
 	}
+	if (!S_ISDIR(INODE(fs, dinode)->i_mode))
+	{
+		fatalmsg("%s: is not a directory", dir);
+	}
 
 	ninode = get_free_inode(fs);
 //	if(ninode > fs->sb->nInodes)
@@ -247,6 +237,7 @@ int make_node(struct tfs *fs, char *fpath, int mode,
 //		printf("\nNo free Inode found\n");
 //		exit(0);
 //	}
+	begin_change(fs);
 	mark_inode(fs, ninode);
 
 	// Initialize inode
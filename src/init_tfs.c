@@ -21,6 +21,8 @@
 #include "protos.h"
 #include "spec_tfs.h"
 
+// The structure new_tfs() or open_fs() is building, see drop_opening_fs()
+__thread struct tfs *opening_fs;
 
 /*
  * Initializes a new file system
@@ -33,7 +35,7 @@
 struct tfs *new_tfs(const char *fn, unsigned long sizeInBlocks,
 										int numberOfInodes)
 {
-	struct tfs *fs = domalloc(sizeof(struct tfs), DEFAULTVALTOBESET);
+	struct tfs *fs = opening_fs = domalloc(sizeof(struct tfs), DEFAULTVALTOBESET);
 	unsigned long rootblkp;
 	char rootblk[BLOCKSIZE];
 
@@ -49,30 +51,54 @@ struct tfs *new_tfs(const char *fn, unsigned long sizeInBlocks,
 
 	writeBootBlock(fs);
 	writeSuperBlock(fs);
-	writeZoneBMap(fs, sizeInBlocks);
+	writeZoneBMap(fs);
 	writeInodeBMap(fs);
 	writeInodes(fs);
 
 	initRootBlock(fs, (char *) &rootblk, rootblkp);
-	writeDataBlock(fs, (u8 *) (&rootblk[0]), BLOCKSIZE);
+	writeDataBlock(fs, rootblkp, "Fragment-Type: index-block\n", (u8 *) rootblk);
 
+	opening_fs = NULL;
 	fclose(fs->fp);
 	free_memory(fs);
 
 	return fs;
 }
 
+/*
+ * Free the structure of a new_tfs() or open_fs() that failed, for
+ * callers that catch fatalmsg()
+ * */
+void drop_opening_fs(void)
+{
+	struct tfs *fs = opening_fs;
+
+	if (!fs)
+	{
+		return;
+	}
+	opening_fs = NULL;
+
+	if (fs->fp)
+	{
+		fclose(fs->fp);
+	}
+	free_memory(fs);
+}
+
 /*
  * Open a file system
  * @fn 		 - file name for new file system
- * @chk 	 - stop if file system is not clean
+ * @mode	 - TFS_READ_WRITE or TFS_READ_ONLY, the latter is never written back,
+ * 					 TFS_ARENA added: decode all blocks at once, see arena.c
  * @return - pointer to a minix_fs_dat structure
  * */
-struct tfs *open_fs(const char *fn)
+struct tfs *open_fs(const char *fn, int mode)
 {
-	struct tfs *fs = domalloc(sizeof(struct tfs), DEFAULTVALTOBESET);
+	struct tfs *fs = opening_fs = domalloc(sizeof(struct tfs), DEFAULTVALTOBESET);
 
-	fs->fp = fopen(fn, "r+b");
+	fs->readOnly = (mode & TFS_READ_ONLY);
+	fs->fp = fopen(fn, fs->readOnly ? "rb" : "r+b");
 
 	if (!fs->fp)
 	{
@@ -81,38 +107,88 @@ struct tfs *open_fs(const char *fn)
 	readVirtualFS(fs, fn);
 	readVirtualBootBlock(fs);
 	readVirtualSuperBlock(fs);
+
+	if (!fs->readOnly)
+	{
+		slotVirtualFS(fs);
+	}
+	if (mode & TFS_ARENA)
+	{
+		decodeArena(fs);
+	}
 	readVirtualZoneBMap(fs);
 	readVirtualInodeBMap(fs);
 	readVirtualInodes(fs);
+	checkFreeCounts(fs);
 
 	// Sanity check
 	if (TFS_VALID != fs->sb->state)
 	{
 		fprintf(stderr, "Warning: %s in an unknown state\n", fn);
 	}
+	opening_fs = NULL;
 
 	return fs;
 }
 
 /*
- * Closes file system
+ * Write a file system back, it stays open
+ * Only blocks that changed are written back into their slots.
  * @fs 		 - pointer to file system structure
- * @return - NULL
  * */
-struct tfs *close_fs(struct tfs *fs)
+void sync_fs(struct tfs *fs)
 {
-	int sizeInBlocks = fs->sb->fs_sizeInBlocks;
-
+	if (fs->arena)
+	{
+		flushArena(fs);
+	}
 	writeBootBlock(fs);
 	writeSuperBlock(fs);
-	writeZoneBMap(fs, sizeInBlocks);
+	writeZoneBMap(fs);
 	writeInodeBMap(fs);
 	writeInodes(fs);
+	writeDirtyBlocks(fs);
+
+	fflush(fs->fp);
+}
+
+/*
+ * Closes file system
+ * @fs 		 - pointer to file system structure
+ * @return - NULL
+ * */
+struct tfs *close_fs(struct tfs *fs)
+{
+	printCacheStats(fs);
+
+	if (fs->readOnly)
+	{
+		fclose(fs->fp);
+		free_memory(fs);
+
+		return 0;
+	}
+	sync_fs(fs);
 
-	fputs(goto_Block(fs->virtualFS, fs->sb->firstdatazone), fs->fp);
 	fclose(fs->fp);
 
 	free_memory(fs);
 
 	return 0;
 }
+
+/*
+ * Throw away the changes since the last write back and read the image again
+ * @fs			- file system structure, freed
+ * @fn			- file name of the image
+ * @return	- new file system structure
+ * */
+struct tfs *reload_fs(struct tfs *fs, const char *fn)
+{
+	int mode = fs->readOnly | (fs->arena ? TFS_ARENA : 0);
+
+	fs->readOnly = TFS_READ_ONLY;
+	close_fs(fs);
+
+	return open_fs(fn, mode);
+}
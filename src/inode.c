@@ -30,46 +30,58 @@
  * @option 		- INDIRECT_BLOCK,
  * 						-	DOUBLE_INDIRECT_BLOCK,
  * 						-	INDEX_OR_DATA_BLOCK,
- * 						-	INDEX_BLOCK
+ * 						-	INDEX_BLOCK,
+ * 						-	DIR_LEAF_BLOCK
  * @inode_cnt	- inode number
  * */
 void build_header(struct tfs *fs, struct tfs_inode *inode, unsigned long zone,
 									int option, int inode_cnt)
 {
-	sprintf(fs->virtualFS, "%sblock-id: %lu\n", fs->virtualFS,
-					(long unsigned int) zone);
+	char text[BLOCKSIZE_BRUTTO];
+	char *ptr = text;
+	char *slot = fs->virtualFS + SLOT_OFFSET(zone);
+
+	ptr += sprintf(ptr, "block-id: %lu\n", (long unsigned int) zone);
 
 	if (option == INDIRECT_BLOCK)
 	{
-		sprintf(fs->virtualFS,
-						"%sFragment-Type: indirect-data-block-from-inode-%d \n",
-						fs->virtualFS, inode_cnt);
+		ptr += sprintf(ptr, "Fragment-Type: indirect-data-block-from-inode-%d \n",
+									 inode_cnt);
 	}
 	else if (option == DOUBLE_INDIRECT_BLOCK)
 	{
-		sprintf(fs->virtualFS,
-						"%sFragment-Type: double-indirect-data-block-from-inode-%d \n",
-						fs->virtualFS, inode_cnt);
+		ptr += sprintf(ptr,
+									 "Fragment-Type: double-indirect-data-block-from-inode-%d \n",
+									 inode_cnt);
 	}
 	else if (option == INDEX_OR_DATA_BLOCK)
 	{
 		if (inode->i_mode == 16877)
 		{
-			sprintf(fs->virtualFS, "%sFragment-Type: index-block-from-inode-%d\n",
-							fs->virtualFS, inode_cnt);
+			ptr += sprintf(ptr, "Fragment-Type: index-block-from-inode-%d\n", inode_cnt);
 		}
 		else if (inode->i_mode == 33204 || inode->i_mode == 33188)
 		{
-			sprintf(fs->virtualFS, "%sFragment-Type: data-block-from-inode-%d\n",
-							fs->virtualFS, inode_cnt);
+			ptr += sprintf(ptr, "Fragment-Type: data-block-from-inode-%d\n", inode_cnt);
 		}
 	}
 	else if (option == INDEX_BLOCK)
 	{
-		sprintf(fs->virtualFS, "%sFragment-Type: index-block-from-inode-%d\n",
-						fs->virtualFS, inode_cnt);
+		ptr += sprintf(ptr, "Fragment-Type: index-block-from-inode-%d\n", inode_cnt);
+	}
+	else if (option == DIR_LEAF_BLOCK)
+	{
+		ptr += sprintf(ptr, "Fragment-Type: directory-leaf-block-from-inode-%d\n",
+									 inode_cnt);
 	}
-	sprintf(fs->virtualFS, "%s000:", fs->virtualFS);
+	ptr += sprintf(ptr, "000:");
+
+	// The data lines follow in writeVirtualDataBlock()
+	frameVirtualSlots(slot, 0, BLOCKSIZE_BRUTTO);
+	memcpy(slot, text, ptr - text);
+	cache_drop(fs, zone);
+	dropArenaBlock(fs, zone);
+	mark_dirty(fs, zone);
 }
 
 /*
@@ -122,54 +134,10 @@ int get_blockID_from_inode( struct tfs *fs, struct tfs_inode *inode,
 		return inode->zones[zoneID];
 	}
 
-	// Indirect block
-	zoneID -= NR_OF_DIREKT_ZONES;
-
-	if (zoneID < ADRESSES_PER_BLOCK)
+	// Indirect and double indirect blocks, from the cached block map
+	if (zoneID < MAX_FILE_BLOCKS)
 	{
-		u16 indir_zone[ADRESSES_PER_BLOCK];
-
-		if (inode->indirZone == 0)
-		{
-			return 0;
-		}
-
-		// Get indirect block with block numbers of data blocks
-		readVirtualDataBlock( goto_dataBlk(fs->virtualFS, inode->indirZone),
-													(unsigned long) indir_zone);
-
-		// Return block number
-		return indir_zone[zoneID];
-	}
-
-	// Double indirect block.
-	zoneID -= ADRESSES_PER_BLOCK;
-
-	if (zoneID < ADRESSES_PER_BLOCK * ADRESSES_PER_BLOCK)
-	{
-		u16 indir_zone[ADRESSES_PER_BLOCK];
-		if (inode->doubleIndirZone == 0)
-		{
-			return 0;
-		}
-
-		// Get indirect zone with block numbers of double indirect blocks
-		readVirtualDataBlock(goto_dataBlk(fs->virtualFS, inode->doubleIndirZone),
-													(unsigned long) indir_zone);
-
-		if (indir_zone[zoneID / ADRESSES_PER_BLOCK] == 0)
-		{
-			return 0;
-		}
-
-		// Get double indirect block with block numbers of data blocks
-		unsigned long search_block = indir_zone[zoneID / ADRESSES_PER_BLOCK];
-
-		readVirtualDataBlock( goto_dataBlk(fs->virtualFS, search_block),
-													(unsigned long) indir_zone);
-
-		// Return data block
-		return indir_zone[zoneID % ADRESSES_PER_BLOCK];
+		return cached_block_map(fs, inode, zoneID)[zoneID];
 	}
 
 	die("file bigger than maximum size");
@@ -187,6 +155,8 @@ int get_blockID_from_inode( struct tfs *fs, struct tfs_inode *inode,
 void write_blockID_to_inode(struct tfs *fs, struct tfs_inode *inode,
 														int zoneID, int blockID, int w_inode)
 {
+	invalidate_block_map(fs, inode);
+
 	// Direct block
 	if (zoneID < NR_OF_DIREKT_ZONES)
 	{
@@ -208,15 +178,13 @@ void write_blockID_to_inode(struct tfs *fs, struct tfs_inode *inode,
 
 		if (inode->indirZone == 0)
 		{
-			inode->indirZone = get_free_block(fs);
-			mark_zone(fs, inode->indirZone);
+			inode->indirZone = alloc_zone(fs, w_inode, INDIRECT_BLOCK, 0);
 			memset(indir_zone, 0, sizeof indir_zone);
 		}
 		else
 		{
 			// Read Data-Block from indirect_data_zone
-			readVirtualDataBlock( goto_dataBlk(fs->virtualFS, inode->indirZone),
-														(unsigned long) indir_zone);
+			readVirtualBlock(fs, inode->indirZone, (u8 *) indir_zone);
 
 			if (indir_zone[zoneID]	&& indir_zone[zoneID] != blockID)
 			{
@@ -227,12 +195,12 @@ void write_blockID_to_inode(struct tfs *fs, struct tfs_inode *inode,
 		indir_zone[zoneID] = blockID;
 
 		// Create a new indirect_data_zone or set new entry
-		if (!goto_dataBlk(fs->virtualFS, inode->indirZone))
+		if (!goto_dataBlk(fs, inode->indirZone))
 		{
 			build_header(fs, inode, inode->indirZone, INDEX_BLOCK, w_inode);
 		}
 
-		writeVirtualDataBlock(fs->virtualFS, inode->indirZone,
+		writeVirtualDataBlock(fs, inode->indirZone,
 													(u8 *) (indir_zone), BLOCKSIZE);
 		return;
 	}
@@ -247,15 +215,13 @@ void write_blockID_to_inode(struct tfs *fs, struct tfs_inode *inode,
 
 		if (inode->doubleIndirZone == 0)
 		{
-			inode->doubleIndirZone = get_free_block(fs);
-			mark_zone(fs, inode->doubleIndirZone);
+			inode->doubleIndirZone = alloc_zone(fs, w_inode, DOUBLE_INDIRECT_BLOCK, 0);
 			memset(indir_zone, 0, sizeof indir_zone);
 		}
 		else
 		{
 			//Read indirect block from double_indirect_zone and write it to indir_zone
-			readVirtualDataBlock( goto_dataBlk(fs->virtualFS, inode->doubleIndirZone),
-														(unsigned long) indir_zone);
+			readVirtualBlock(fs, inode->doubleIndirZone, (u8 *) indir_zone);
 		}
 
 		double_indirect_blockID = zoneID / ADRESSES_PER_BLOCK;
@@ -264,17 +230,15 @@ void write_blockID_to_inode(struct tfs *fs, struct tfs_inode *inode,
 		if (indir_zone[double_indirect_blockID] == 0)
 		{
 			double_indirect_block = indir_zone[double_indirect_blockID]
-														=	get_free_block(fs);
-
-			mark_zone(fs, indir_zone[double_indirect_blockID]);
+														=	alloc_zone(fs, w_inode, INDEX_BLOCK, double_indirect_blockID);
 
 			// Create a new double_indirect_data_zone(block-number)
-			if (!goto_dataBlk(fs->virtualFS, inode->doubleIndirZone))
+			if (!goto_dataBlk(fs, inode->doubleIndirZone))
 			{
 				build_header(fs, inode, inode->doubleIndirZone, INDEX_BLOCK, w_inode);
 			}
 
-			writeVirtualDataBlock(fs->virtualFS, inode->doubleIndirZone,
+			writeVirtualDataBlock(fs, inode->doubleIndirZone,
 														(u8 *) (indir_zone), BLOCKSIZE);
 
 			memset(indir_zone, 0, sizeof indir_zone);
@@ -284,8 +248,7 @@ void write_blockID_to_inode(struct tfs *fs, struct tfs_inode *inode,
 			// Read from double_indirect_block and write it to indir_zone
 			double_indirect_block = indir_zone[double_indirect_blockID];
 
-			readVirtualDataBlock( goto_dataBlk(fs->virtualFS, double_indirect_block),
-														(unsigned long) indir_zone);
+			readVirtualBlock(fs, double_indirect_block, (u8 *) indir_zone);
 
 			if (indir_zone[zoneID]	&& indir_zone[zoneID] != blockID)
 			{
@@ -296,12 +259,12 @@ void write_blockID_to_inode(struct tfs *fs, struct tfs_inode *inode,
 		indir_zone[zoneID] = blockID;
 
 		// Create a new data-block for indir_zone at double_indirect_block or set new entry
-		if (!goto_dataBlk(fs->virtualFS, double_indirect_block))
+		if (!goto_dataBlk(fs, double_indirect_block))
 		{
 			build_header(fs, inode, double_indirect_block, INDEX_BLOCK, w_inode);
 		}
 
-		writeVirtualDataBlock(fs->virtualFS, double_indirect_block,
+		writeVirtualDataBlock(fs, double_indirect_block,
 													(u8 *) (indir_zone), BLOCKSIZE);
 		return;
 	}
@@ -319,6 +282,8 @@ void delete_blockID_from_inode( struct tfs *fs, struct tfs_inode *inode,
 {
 	int i;
 
+	invalidate_block_map(fs, inode);
+
 	// Direct block
 	if (zoneID < NR_OF_DIREKT_ZONES)
 	{
@@ -341,8 +306,7 @@ void delete_blockID_from_inode( struct tfs *fs, struct tfs_inode *inode,
 		}
 
 		// Get indir_zone
-		readVirtualDataBlock( goto_dataBlk(fs->virtualFS, inode->indirZone),
-													(unsigned long) indir_zone);
+		readVirtualBlock(fs, inode->indirZone, (u8 *) indir_zone);
 
 		//Delete blockID from indirect_block
 		if (indir_zone[zoneID])
@@ -356,11 +320,11 @@ void delete_blockID_from_inode( struct tfs *fs, struct tfs_inode *inode,
 		{
 			if (indir_zone[i])
 			{
-				if (!goto_dataBlk(fs->virtualFS, inode->indirZone))
+				if (!goto_dataBlk(fs, inode->indirZone))
 				{
 					build_header(fs, inode, inode->indirZone, INDIRECT_BLOCK, w_inode);
 				}
-				writeVirtualDataBlock(fs->virtualFS, inode->indirZone,
+				writeVirtualDataBlock(fs, inode->indirZone,
 															(u8 *) (indir_zone), BLOCKSIZE);
 				return;
 			}
@@ -385,8 +349,7 @@ void delete_blockID_from_inode( struct tfs *fs, struct tfs_inode *inode,
 			return;
 		}
 		// Get indir_zone
-		readVirtualDataBlock( goto_dataBlk(fs->virtualFS, inode->doubleIndirZone),
-													(unsigned long) indir_zone);
+		readVirtualBlock(fs, inode->doubleIndirZone, (u8 *) indir_zone);
 
 		double_indirect_blockID = zoneID / ADRESSES_PER_BLOCK;
 		zoneID %= ADRESSES_PER_BLOCK;
@@ -397,9 +360,8 @@ void delete_blockID_from_inode( struct tfs *fs, struct tfs_inode *inode,
 		}
 
 		// Get double_indir_zone
-		readVirtualDataBlock(goto_dataBlk(fs->virtualFS,
-												 indir_zone[double_indirect_blockID]),
-												 (unsigned long) double_indir_zone);
+		readVirtualBlock(fs, indir_zone[double_indirect_blockID],
+										 (u8 *) double_indir_zone);
 
 		// Delete blockID from double_indirect_block
 		if (double_indir_zone[zoneID])
@@ -413,12 +375,12 @@ void delete_blockID_from_inode( struct tfs *fs, struct tfs_inode *inode,
 		{
 			if (double_indir_zone[zoneID])
 			{
-				if (!goto_dataBlk(fs->virtualFS, indir_zone[double_indirect_blockID]))
+				if (!goto_dataBlk(fs, indir_zone[double_indirect_blockID]))
 				{
 					build_header( fs, inode, indir_zone[double_indirect_blockID],
 					              DOUBLE_INDIRECT_BLOCK, w_inode);
 				}
-				writeVirtualDataBlock(fs->virtualFS,
+				writeVirtualDataBlock(fs,
 															indir_zone[double_indirect_blockID],
 															(u8 *) (indir_zone), BLOCKSIZE);
 				return;
@@ -434,11 +396,11 @@ void delete_blockID_from_inode( struct tfs *fs, struct tfs_inode *inode,
 		{
 			if (indir_zone[zoneID])
 			{
-				if (!goto_dataBlk(fs->virtualFS, inode->doubleIndirZone))
+				if (!goto_dataBlk(fs, inode->doubleIndirZone))
 				{
 					build_header(fs, inode, inode->doubleIndirZone, DOUBLE_INDIRECT_BLOCK, w_inode);
 				}
-				writeVirtualDataBlock(fs->virtualFS, inode->doubleIndirZone,
+				writeVirtualDataBlock(fs, inode->doubleIndirZone,
 															(u8 *) (indir_zone), BLOCKSIZE);
 				return;
 			}
@@ -482,8 +444,7 @@ int read_inoblk(struct tfs *fs, int r_inode, u32 blk, u8 *buf)
   if (inode->i_size / BLOCKSIZE == blk)
   	bsize = inode->i_size % BLOCKSIZE;
 
-	readVirtualDataBlock( goto_dataBlk(fs->virtualFS, blockID),
-												(unsigned long) buf);
+	readVirtualBlock(fs, blockID, buf);
 	if (bsize < BLOCKSIZE)
 		memset(buf+bsize,0,BLOCKSIZE-bsize);
 
@@ -501,6 +462,22 @@ int read_inoblk(struct tfs *fs, int r_inode, u32 blk, u8 *buf)
  * */
 void write_block_to_inode(struct tfs *fs, int w_inode, u32 zoneID,
 													u8 *buf)
+{
+	write_node_to_inode(fs, w_inode, zoneID, buf, INDEX_OR_DATA_BLOCK);
+}
+
+/*
+ * Write an inode block with a given fragment type
+ * @fs 						- file system structure
+ * @inode 				- inode to write to
+ * @zoneID	- file block to write
+ * @buf 					- buffer pointer (must be BLOCKSIZE)
+ * @option 				- header option for build_header(), blocks of other
+ * 									types than INDEX_OR_DATA_BLOCK get a new header
+ * 									on every write, their type may change
+ * */
+void write_node_to_inode(struct tfs *fs, int w_inode, u32 zoneID, u8 *buf,
+												 int option)
 {
 	unsigned long blockID;
 	struct tfs_inode *inode = INODE(fs, w_inode);
@@ -510,26 +487,509 @@ void write_block_to_inode(struct tfs *fs, int w_inode, u32 zoneID,
 	if (!blockID)
 	{
 		// Allocate block...
-		blockID = get_free_block(fs);
-		mark_zone(fs, blockID);
+		blockID = alloc_zone(fs, w_inode, INDEX_OR_DATA_BLOCK, zoneID);
 
-		if (!goto_dataBlk(fs->virtualFS, blockID))
+		if (!goto_dataBlk(fs, blockID) || option != INDEX_OR_DATA_BLOCK)
 		{
-			build_header(fs, inode, blockID, INDEX_OR_DATA_BLOCK, w_inode);
+			build_header(fs, inode, blockID, option, w_inode);
 		}
 
-		writeVirtualDataBlock(fs->virtualFS, blockID, (u8 *) (buf), BLOCKSIZE);
+		writeVirtualDataBlock(fs, blockID, (u8 *) (buf), BLOCKSIZE);
 		write_blockID_to_inode(fs, inode, zoneID, blockID, w_inode);
 	}
 	else
 	{
-		if (!goto_dataBlk(fs->virtualFS, blockID))
+		if (!goto_dataBlk(fs, blockID) || option != INDEX_OR_DATA_BLOCK)
+		{
+			build_header(fs, inode, blockID, option, w_inode);
+		}
+
+		writeVirtualDataBlock(fs, blockID, (u8 *) (buf), BLOCKSIZE);
+	}
+}
+
+/*
+ * Read the zone pointers of an inode, each index block decoded once
+ * @fs 			- file system structure
+ * @inode		- inode
+ * @nBlocks	- number of file blocks to map, at most MAX_FILE_BLOCKS
+ * @return	- nBlocks block-ids, 0 for holes (free() it)
+ * */
+u32 *read_block_map(struct tfs *fs, struct tfs_inode *inode, u32 nBlocks)
+{
+	return fill_block_map(fs, inode, domalloc(nBlocks * sizeof(u32), 0), nBlocks);
+}
+
+/*
+ * Entries of a block map that write_block_map() reads for nBlocks file
+ * blocks, it stores whole index blocks
+ * @nBlocks	- number of file blocks
+ * @return	- number of entries, at most MAX_FILE_BLOCKS
+ * */
+u32 block_map_size(u32 nBlocks)
+{
+	u32 size = NR_OF_DIREKT_ZONES;
+
+	if (nBlocks > size)
+	{
+		size += ADRESSES_PER_BLOCK;
+	}
+	if (nBlocks > size)
+	{
+		size += UPPER(nBlocks - size, ADRESSES_PER_BLOCK) * ADRESSES_PER_BLOCK;
+	}
+	return size;
+}
+
+/*
+ * Block map of a file that is written, in a buffer of fs that is
+ * reused: an error while writing does not lose it
+ * @fs 			- file system structure
+ * @inode		- inode
+ * @nBlocks	- number of file blocks to write, at most MAX_FILE_BLOCKS
+ * @return	- block-ids for write_block_map(), see block_map_size()
+ * */
+u32 *write_map(struct tfs *fs, struct tfs_inode *inode, u32 nBlocks)
+{
+	u32 size = block_map_size(nBlocks);
+
+	if (fs->writeMapLen < size)
+	{
+		free(fs->writeMap);
+		fs->writeMap = domalloc(size * sizeof(u32), -1);
+		fs->writeMapLen = size;
+	}
+	memset(fs->writeMap, 0, size * sizeof(u32));
+
+	return fill_block_map(fs, inode, fs->writeMap, nBlocks);
+}
+
+/*
+ * Fill a block map, see read_block_map()
+ * @fs 			- file system structure
+ * @inode		- inode
+ * @map			- nBlocks zeroed block-ids
+ * @nBlocks	- number of file blocks to map
+ * @return	- map
+ * */
+u32 *fill_block_map(struct tfs *fs, struct tfs_inode *inode, u32 *map,
+										u32 nBlocks)
+{
+	u16 indir_zone[ADRESSES_PER_BLOCK];
+	u16 double_indir_zone[ADRESSES_PER_BLOCK];
+	u32 zoneID = 0;
+	int i, j;
+
+	for (i = 0; i < NR_OF_DIREKT_ZONES && zoneID < nBlocks; i++)
+	{
+		map[zoneID++] = inode->zones[i];
+	}
+	if (zoneID < nBlocks && inode->indirZone)
+	{
+		readVirtualBlock(fs, inode->indirZone, (u8 *) indir_zone);
+
+		for (i = 0; i < ADRESSES_PER_BLOCK && zoneID + i < nBlocks; i++)
+		{
+			map[zoneID + i] = indir_zone[i];
+		}
+	}
+	zoneID += ADRESSES_PER_BLOCK;
+
+	if (zoneID < nBlocks && inode->doubleIndirZone)
+	{
+		readVirtualBlock(fs, inode->doubleIndirZone, (u8 *) double_indir_zone);
+
+		for (j = 0; j < ADRESSES_PER_BLOCK && zoneID < nBlocks;
+				 j++, zoneID += ADRESSES_PER_BLOCK)
+		{
+			if (!double_indir_zone[j])
+			{
+				continue;
+			}
+			readVirtualBlock(fs, double_indir_zone[j], (u8 *) indir_zone);
+
+			for (i = 0; i < ADRESSES_PER_BLOCK && zoneID + i < nBlocks; i++)
+			{
+				map[zoneID + i] = indir_zone[i];
+			}
+		}
+	}
+	return map;
+}
+
+/*
+ * Cached block map of an inode, read on first use
+ * @fs 			- file system structure
+ * @inode		- inode
+ * @zoneID	- file block that has to be in the map
+ * @return	- block-ids of the inode
+ * */
+u32 *cached_block_map(struct tfs *fs, struct tfs_inode *inode, u32 zoneID)
+{
+	int nr = inode - fs->inode;
+	u32 nBlocks;
+
+	if (!fs->blockMap)
+	{
+		fs->blockMap = domalloc(fs->sb->nInodes * sizeof(u32 *), 0);
+		fs->blockMapLen = domalloc(fs->sb->nInodes * sizeof(u32), 0);
+	}
+	if (fs->blockMap[nr] && zoneID < fs->blockMapLen[nr])
+	{
+		fs->map_hits++;
+		return fs->blockMap[nr];
+	}
+	fs->map_misses++;
+
+	// Map the whole file, blocks behind its end only when asked for
+	nBlocks = UPPER(inode->i_size, BLOCKSIZE);
+
+	if (nBlocks <= zoneID)
+	{
+		nBlocks = zoneID + 1;
+	}
+	free(fs->blockMap[nr]);
+	fs->blockMap[nr] = read_block_map(fs, inode, nBlocks);
+	fs->blockMapLen[nr] = nBlocks;
+
+	return fs->blockMap[nr];
+}
+
+/*
+ * Drop the cached block map of an inode, after its pointers changed
+ * @fs 			- file system structure
+ * @inode		- inode
+ * */
+void invalidate_block_map(struct tfs *fs, struct tfs_inode *inode)
+{
+	int nr = inode - fs->inode;
+
+	if (fs->blockMap && fs->blockMap[nr])
+	{
+		free(fs->blockMap[nr]);
+		fs->blockMap[nr] = NULL;
+		fs->blockMapLen[nr] = 0;
+	}
+}
+
+/*
+ * Free all cached block maps
+ * @fs 			- file system structure
+ * */
+void free_block_maps(struct tfs *fs)
+{
+	int i;
+
+	if (!fs->blockMap)
+	{
+		return;
+	}
+	for (i = 0; i < fs->sb->nInodes; i++)
+	{
+		free(fs->blockMap[i]);
+	}
+	free(fs->blockMap);
+	fs->blockMap = NULL;
+	free(fs->blockMapLen);
+	fs->blockMapLen = NULL;
+}
+
+/*
+ * Write one index block of a block map
+ * @fs 			- file system structure
+ * @w_inode	- inode number
+ * @blockID	- index block, allocated if 0
+ * @option	- see reserved_position()
+ * @nr			- see reserved_position()
+ * @map			- ADRESSES_PER_BLOCK block-ids
+ * @return	- block-id of the index block
+ * */
+u32 write_index_block(struct tfs *fs, int w_inode, u32 blockID, int option,
+											u32 nr, u32 *map)
+{
+	u16 indir_zone[ADRESSES_PER_BLOCK];
+	int i;
+
+	for (i = 0; i < ADRESSES_PER_BLOCK; i++)
+	{
+		indir_zone[i] = map[i];
+	}
+	if (!blockID)
+	{
+		blockID = alloc_zone(fs, w_inode, option, nr);
+	}
+	if (!goto_dataBlk(fs, blockID))
+	{
+		build_header(fs, INODE(fs, w_inode), blockID, INDEX_BLOCK, w_inode);
+	}
+	writeVirtualDataBlock(fs, blockID, (u8 *) indir_zone, BLOCKSIZE);
+
+	return blockID;
+}
+
+/*
+ * Store the zone pointers of file blocks [0, nBlocks) in the inode,
+ * each index block is written once
+ * @fs 			- file system structure
+ * @w_inode	- inode number
+ * @map			- block map from read_block_map()
+ * @nBlocks	- number of file blocks written
+ * */
+void write_block_map(struct tfs *fs, int w_inode, u32 *map, u32 nBlocks)
+{
+	struct tfs_inode *inode = INODE(fs, w_inode);
+	u32 double_indir_zone[ADRESSES_PER_BLOCK];
+	u32 *ptr = map + NR_OF_DIREKT_ZONES + ADRESSES_PER_BLOCK;
+	u32 j, nIndex;
+	int i;
+
+	invalidate_block_map(fs, inode);
+
+	for (i = 0; i < NR_OF_DIREKT_ZONES; i++)
+	{
+		inode->zones[i] = map[i];
+	}
+	if (nBlocks <= NR_OF_DIREKT_ZONES)
+	{
+		return;
+	}
+	inode->indirZone = write_index_block(fs, w_inode, inode->indirZone,
+																			 INDIRECT_BLOCK, 0,
+																			 map + NR_OF_DIREKT_ZONES);
+
+	if (nBlocks <= NR_OF_DIREKT_ZONES + ADRESSES_PER_BLOCK)
+	{
+		return;
+	}
+	nIndex = UPPER(nBlocks - NR_OF_DIREKT_ZONES - ADRESSES_PER_BLOCK,
+								 ADRESSES_PER_BLOCK);
+
+	if (inode->doubleIndirZone)
+	{
+		u16 indir_zone[ADRESSES_PER_BLOCK];
+
+		readVirtualBlock(fs, inode->doubleIndirZone, (u8 *) indir_zone);
+
+		for (i = 0; i < ADRESSES_PER_BLOCK; i++)
+		{
+			double_indir_zone[i] = indir_zone[i];
+		}
+	}
+	else
+	{
+		// Placed in front of its index blocks, see reserved_position()
+		inode->doubleIndirZone = alloc_zone(fs, w_inode, DOUBLE_INDIRECT_BLOCK, 0);
+		memset(double_indir_zone, 0, sizeof double_indir_zone);
+	}
+	for (j = 0; j < nIndex; j++, ptr += ADRESSES_PER_BLOCK)
+	{
+		for (i = 0; i < ADRESSES_PER_BLOCK && !ptr[i]; i++);
+
+		if (i < ADRESSES_PER_BLOCK || double_indir_zone[j])
+		{
+			double_indir_zone[j] = write_index_block(fs, w_inode, double_indir_zone[j],
+																							 INDEX_BLOCK, j, ptr);
+		}
+	}
+	write_index_block(fs, w_inode, inode->doubleIndirZone, DOUBLE_INDIRECT_BLOCK,
+										0, double_indir_zone);
+}
+
+/*
+ * Data block of a file block in a block map, allocated and given its
+ * header if needed
+ * @fs 			- file system structure
+ * @w_inode	- inode number
+ * @map			- block map from read_block_map()
+ * @zoneID	- file block
+ * @return	- block-id
+ * */
+u32 mapped_block(struct tfs *fs, int w_inode, u32 *map, u32 zoneID)
+{
+	if (zoneID >= MAX_FILE_BLOCKS)
+	{
+		die("file bigger than maximum size");
+	}
+	if (!map[zoneID])
+	{
+		map[zoneID] = alloc_zone(fs, w_inode, INDEX_OR_DATA_BLOCK, zoneID);
+	}
+	if (!goto_dataBlk(fs, map[zoneID]))
+	{
+		build_header(fs, INODE(fs, w_inode), map[zoneID], INDEX_OR_DATA_BLOCK,
+								 w_inode);
+	}
+	return map[zoneID];
+}
+
+/*
+ * Write a file block through a block map, the zone pointers are
+ * stored later by write_block_map()
+ * @fs 			- file system structure
+ * @w_inode	- inode number
+ * @map			- block map from read_block_map()
+ * @zoneID	- file block
+ * @buf			- BLOCKSIZE bytes
+ * */
+void write_mapped_block(struct tfs *fs, int w_inode, u32 *map, u32 zoneID,
+												u8 *buf)
+{
+	writeVirtualDataBlock(fs, mapped_block(fs, w_inode, map, zoneID), buf,
+												BLOCKSIZE);
+}
+
+/*
+ * Write a file block that is encoded already, see write_mapped_block()
+ * @fs 			- file system structure
+ * @w_inode	- inode number
+ * @map			- block map from read_block_map()
+ * @zoneID	- file block
+ * @buf			- BLOCKSIZE bytes
+ * @text		- buf encoded by encodeDataBlock()
+ * @len			- length of text
+ * */
+void write_mapped_text(struct tfs *fs, int w_inode, u32 *map, u32 zoneID,
+											 const u8 *buf, const char *text, int len)
+{
+	writeVirtualDataText(fs, mapped_block(fs, w_inode, map, zoneID), buf, text,
+											 len);
+}
+
+/*
+ * Position of a block in a reservation. Each index block is placed in
+ * front of the data blocks it addresses: 7 data, indirect, 256 data,
+ * double indirect, then per 256 data blocks their index block.
+ * @option	- INDEX_OR_DATA_BLOCK, INDIRECT_BLOCK, DOUBLE_INDIRECT_BLOCK
+ * 						- or INDEX_BLOCK below the double indirect block
+ * @nr			- file block for INDEX_OR_DATA_BLOCK, index for INDEX_BLOCK
+ * @return	- position
+ * */
+unsigned long reserved_position(int option, u32 nr)
+{
+	unsigned long doubleIndir = NR_OF_DIREKT_ZONES + 1 + ADRESSES_PER_BLOCK;
+
+	if (option == INDIRECT_BLOCK)
+	{
+		return NR_OF_DIREKT_ZONES;
+	}
+	else if (option == DOUBLE_INDIRECT_BLOCK)
+	{
+		return doubleIndir;
+	}
+	else if (option == INDEX_BLOCK)
+	{
+		return doubleIndir + 1 + nr * (ADRESSES_PER_BLOCK + 1);
+	}
+	if (nr < NR_OF_DIREKT_ZONES)
+	{
+		return nr;
+	}
+	nr -= NR_OF_DIREKT_ZONES;
+
+	if (nr < ADRESSES_PER_BLOCK)
+	{
+		return NR_OF_DIREKT_ZONES + 1 + nr;
+	}
+	nr -= ADRESSES_PER_BLOCK;
+
+	return doubleIndir + 2 + (nr / ADRESSES_PER_BLOCK) * (ADRESSES_PER_BLOCK + 1)
+				 + nr % ADRESSES_PER_BLOCK;
+}
+
+/*
+ * Reserve the data and index blocks of a file of given size,
+ * one contiguous run if possible, else best-fit fragments.
+ * alloc_zone() takes blocks from the reservation.
+ * @fs 			- file system structure
+ * @w_inode	- inode the blocks are reserved for
+ * @size		- file size in bytes
+ * */
+void reserve_blocks(struct tfs *fs, int w_inode, unsigned long size)
+{
+	unsigned long nBlocks = UPPER(size, BLOCKSIZE);
+	unsigned long n, i, first, len;
+
+	// Left over if a command failed between reserve and release
+	release_blocks(fs);
+
+	if (!nBlocks || nBlocks > MAX_FILE_BLOCKS)
+	{
+		return;
+	}
+	n = reserved_position(INDEX_OR_DATA_BLOCK, nBlocks - 1) + 1;
+
+	if (n > fs->free_zones)
+	{
+		return;
+	}
+	fs->resv = domalloc(n * sizeof(unsigned long), -1);
+
+	for (i = 0; i < n; )
+	{
+		first = find_free_bits(fs->zone_bmap, fs->sb->zmap_sizeInBlocks,
+													 &fs->zone_cursor, n - i);
+		len = n - i;
+
+		if (first == ERROR)
+		{
+			first = find_best_fit(fs->zone_bmap, fs->sb->zmap_sizeInBlocks,
+														n - i, &len);
+		}
+		for (; len; len--, i++, first++)
+		{
+			fs->resv[i] = first + fs->sb->firstdatazone;
+			mark_zone(fs, fs->resv[i]);
+		}
+	}
+	fs->resv_inode = w_inode;
+	fs->nResv = n;
+}
+
+/*
+ * Give back reserved blocks that were not used, e.g. for holes
+ * @fs	- file system structure
+ * */
+void release_blocks(struct tfs *fs)
+{
+	unsigned long i;
+
+	for (i = 0; i < fs->nResv; i++)
+	{
+		if (fs->resv[i])
 		{
-			build_header(fs, inode, blockID, INDEX_OR_DATA_BLOCK, w_inode);
+			unmark_zone(fs, fs->resv[i]);
 		}
+	}
+	free(fs->resv);
+	fs->resv = NULL;
+	fs->nResv = 0;
+	fs->resv_inode = 0;
+}
 
-		writeVirtualDataBlock(fs->virtualFS, blockID, (u8 *) (buf), BLOCKSIZE);
+/*
+ * Allocate a block, from the reservation of the inode if there is one
+ * @fs 			- file system structure
+ * @w_inode	- inode the block is for
+ * @option	- see reserved_position()
+ * @nr			- see reserved_position()
+ * @return	- marked block-id
+ * */
+unsigned long alloc_zone(struct tfs *fs, int w_inode, int option, u32 nr)
+{
+	unsigned long blockID, pos;
+
+	if (fs->nResv && w_inode == fs->resv_inode
+			&& (pos = reserved_position(option, nr)) < fs->nResv && fs->resv[pos])
+	{
+		blockID = fs->resv[pos];
+		fs->resv[pos] = 0;
+
+		return blockID;
 	}
+	blockID = get_free_block(fs);
+	mark_zone(fs, blockID);
+
+	return blockID;
 }
 
 /*
@@ -590,8 +1050,13 @@ int find_inode(struct tfs *fs, const char *path)
 
 	while (path)
 	{
-		inode = ilookup_name(fs, inode, path, NULL, NULL);
+		int parent = inode;
 
+		if (!dentry_lookup(fs, parent, path, &inode))
+		{
+			inode = ilookup_name(fs, parent, path, NULL, NULL);
+			dentry_insert(fs, parent, path, inode);
+		}
 		if (inode == ERROR)
 		{
 			return ERROR;
@@ -629,6 +1094,8 @@ void set_inode( struct tfs *fs, int inode, int mode, int nlinks, u32 size,
 
 	if (clr)
 	{
+		invalidate_block_map(fs, ino);
+		drop_dir_index(fs, inode);
 		memset(ino, defaultValToBeSet, sizeof(struct tfs_inode));
 	}
 	ino->i_mode = mode;
@@ -657,6 +1124,9 @@ void set_inode( struct tfs *fs, int inode, int mode, int nlinks, u32 size,
 void clr_inode(struct tfs *fs, int inode)
 {
 	struct tfs_inode *ino = INODE(fs, inode);
+	invalidate_block_map(fs, ino);
+	drop_dir_index(fs, inode);
+	dentry_forget_inode(fs, inode);
 	memset(ino, 0, sizeof(struct tfs_inode));
 	unmark_inode(fs, inode);
 }
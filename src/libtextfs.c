@@ -0,0 +1,497 @@
+/*
+ * Copyright (C) 2016 - Christian Jürgens <christian.textfs@gmail.com>
+ * Copyright (C) 2016 - Dirk Klingenberg <blademountain35@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * */
+
+/*
+ * libtextfs, see textfs.h
+ *
+ * Every call sets fatal_jmp of its thread, so fatalmsg() and die() in
+ * the file system code return to the call instead of exiting. The call
+ * then returns TFS_EFAIL or TFS_ESYS and keeps the message in the
+ * handle. All other state is in struct tfs.
+ * */
+
+#include "protos.h"
+#include "spec_tfs.h"
+#include "textfs.h"
+
+/*
+ * End a call
+ * @fs			- handle, NULL if there is none
+ * @rc			- return code
+ * @return	- rc
+ * */
+int tfs_leave(struct tfs *fs, int rc)
+{
+	fatal_jmp = NULL;
+
+	// A failed tfs_mkfs() or tfs_open() leaves its structure behind
+	drop_opening_fs();
+
+	if (rc != TFS_OK && fs)
+	{
+		strcpy(fs->error, fatal_text);
+		release_blocks(fs);
+	}
+	return rc;
+}
+
+/*
+ * Fail a call with an error code
+ * @rc	- error code
+ * @s		- string format
+ * */
+void tfs_fail(int rc, const char *s, ...)
+{
+	va_list p;
+	va_start(p, s);
+	vsnprintf(fatal_text, sizeof(fatal_text), s, p);
+	va_end(p);
+
+	longjmp(*fatal_jmp, rc);
+}
+
+/*
+ * Fail a call on a read-only handle
+ * @fs	- handle
+ * */
+void tfs_writable(struct tfs *fs)
+{
+	if (fs->readOnly)
+	{
+		tfs_fail(TFS_EINVAL, "image is open read-only");
+	}
+}
+
+/*
+ * Copy a path, make_node() and dounlink() split it in PATH_SIZE bytes
+ * @path	- path
+ * @buf		- PATH_SIZE bytes
+ * */
+void tfs_path(const char *path, char *buf)
+{
+	if (strlen(path) >= PATH_SIZE)
+	{
+		tfs_fail(TFS_EINVAL, "%s: path too long", path);
+	}
+	strcpy(buf, path);
+}
+
+/*
+ * Inode of a path that must exist
+ * @fs			- handle
+ * @path		- path
+ * @return	- inode
+ * */
+int tfs_inode(struct tfs *fs, const char *path)
+{
+	int inode = find_inode(fs, path);
+
+	if (inode == ERROR)
+	{
+		tfs_fail(TFS_ENOENT, "%s: not found", path);
+	}
+	return inode;
+}
+
+/*
+ * Fail a call if a path exists
+ * @fs		- handle
+ * @path	- path
+ * */
+void tfs_absent(struct tfs *fs, const char *path)
+{
+	if (find_inode(fs, path) != ERROR)
+	{
+		tfs_fail(TFS_EEXIST, "%s: already exists", path);
+	}
+}
+
+/*
+ * Create an image
+ * @image		- file name
+ * @blocks	- size in blocks
+ * @inodes	- number of inodes, 0 for the default
+ * @return	- TFS_OK or error code
+ * */
+int tfs_mkfs(const char *image, unsigned long blocks, int inodes)
+{
+	jmp_buf env;
+	int rc;
+
+	if ((rc = setjmp(env)))
+	{
+		return tfs_leave(NULL, rc);
+	}
+	fatal_jmp = &env;
+
+	if (blocks < MINIMUM_BLOCKS || blocks > MAXIMUM_BLOCKS)
+	{
+		tfs_fail(TFS_EINVAL, "%lu blocks: not in %d..%d", blocks, MINIMUM_BLOCKS,
+						 MAXIMUM_BLOCKS);
+	}
+	if (inodes < 0 || inodes > MAXIMUM_INODES)
+	{
+		tfs_fail(TFS_EINVAL, "%d inodes: not in 0..%d", inodes, MAXIMUM_INODES);
+	}
+	new_tfs(image, blocks, inodes);
+
+	return tfs_leave(NULL, TFS_OK);
+}
+
+/*
+ * Open an image
+ * @image		- file name
+ * @flags		- TFS_OPEN_READ_ONLY, TFS_OPEN_ARENA
+ * @err			- set to TFS_OK or the error code, may be NULL
+ * @return	- handle, NULL on error, see tfs_error(NULL)
+ * */
+struct tfs *tfs_open(const char *image, int flags, int *err)
+{
+	struct tfs *fs;
+	jmp_buf env;
+	int rc;
+
+	if ((rc = setjmp(env)))
+	{
+		fs = NULL;
+	}
+	else
+	{
+		fatal_jmp = &env;
+		fs = open_fs(image, (flags & TFS_OPEN_READ_ONLY ? TFS_READ_ONLY : TFS_READ_WRITE)
+												| (flags & TFS_OPEN_ARENA ? TFS_ARENA : 0));
+	}
+	if (err)
+	{
+		*err = rc;
+	}
+	tfs_leave(NULL, rc);
+
+	return fs;
+}
+
+/*
+ * Write an image back, it stays open
+ * @fs			- handle
+ * @return	- TFS_OK or error code
+ * */
+int tfs_sync(struct tfs *fs)
+{
+	jmp_buf env;
+	int rc;
+
+	if ((rc = setjmp(env)))
+	{
+		return tfs_leave(fs, rc);
+	}
+	fatal_jmp = &env;
+	tfs_writable(fs);
+	sync_fs(fs);
+
+	return tfs_leave(fs, TFS_OK);
+}
+
+/*
+ * Close an image
+ * @fs				- handle, invalid afterwards
+ * @writeBack	- write the image back, ignored for read-only handles
+ * @return		- TFS_OK or error code, see tfs_error(NULL)
+ * */
+int tfs_close(struct tfs *fs, int writeBack)
+{
+	jmp_buf env;
+	int rc;
+
+	if ((rc = setjmp(env)))
+	{
+		return tfs_leave(NULL, rc);
+	}
+	fatal_jmp = &env;
+
+	if (!writeBack)
+	{
+		fs->readOnly = TFS_READ_ONLY;
+	}
+	close_fs(fs);
+
+	return tfs_leave(NULL, TFS_OK);
+}
+
+/*
+ * Message of the last error
+ * @fs			- handle, NULL for errors of tfs_mkfs(), tfs_open() and
+ * 						tfs_close() of the calling thread
+ * @return	- message
+ * */
+const char *tfs_error(struct tfs *fs)
+{
+	return fs ? fs->error : fatal_text;
+}
+
+/*
+ * Create a directory
+ * @fs			- handle
+ * @path		- directory to create
+ * @btree		- TRUE for a B-tree directory, see dir_btree.c
+ * @return	- TFS_OK or error code
+ * */
+int tfs_mkdir(struct tfs *fs, const char *path, int btree)
+{
+	char buf[PATH_SIZE];
+	jmp_buf env;
+	int rc;
+
+	if ((rc = setjmp(env)))
+	{
+		return tfs_leave(fs, rc);
+	}
+	fatal_jmp = &env;
+	tfs_writable(fs);
+	tfs_path(path, buf);
+	tfs_absent(fs, buf);
+	domkdir(fs, buf, btree);
+
+	return tfs_leave(fs, TFS_OK);
+}
+
+/*
+ * Remove an empty directory
+ * @fs			- handle
+ * @path		- directory to remove
+ * @return	- TFS_OK or error code
+ * */
+int tfs_rmdir(struct tfs *fs, const char *path)
+{
+	jmp_buf env;
+	int rc;
+
+	if ((rc = setjmp(env)))
+	{
+		return tfs_leave(fs, rc);
+	}
+	fatal_jmp = &env;
+	tfs_writable(fs);
+	tfs_inode(fs, path);
+	dormdir(fs, path);
+
+	return tfs_leave(fs, TFS_OK);
+}
+
+/*
+ * Remove a file
+ * @fs			- handle
+ * @path		- file to remove
+ * @return	- TFS_OK or error code
+ * */
+int tfs_unlink(struct tfs *fs, const char *path)
+{
+	char buf[PATH_SIZE];
+	jmp_buf env;
+	int rc;
+
+	if ((rc = setjmp(env)))
+	{
+		return tfs_leave(fs, rc);
+	}
+	fatal_jmp = &env;
+	tfs_writable(fs);
+	tfs_path(path, buf);
+	tfs_inode(fs, buf);
+	dounlink(fs, buf);
+
+	return tfs_leave(fs, TFS_OK);
+}
+
+/*
+ * Add a regular file
+ * @fs			- handle
+ * @src			- file to add
+ * @dir			- directory to add to, with "/" at the end
+ * @return	- TFS_OK or error code
+ * */
+int tfs_add(struct tfs *fs, const char *src, const char *dir)
+{
+	const char *name = strrchr(src, '/');
+	char buf[PATH_SIZE];
+	jmp_buf env;
+	int len, rc;
+
+	if ((rc = setjmp(env)))
+	{
+		return tfs_leave(fs, rc);
+	}
+	fatal_jmp = &env;
+	tfs_writable(fs);
+	tfs_path(dir, buf);
+
+	// find_inode() takes the directory without "/" at the end
+	if ((len = strlen(buf)) > 1 && buf[len - 1] == '/')
+	{
+		buf[len - 1] = 0;
+	}
+	tfs_inode(fs, buf);
+
+	// The new file, as doadd() names it
+	name = name ? name + 1 : src;
+
+	if (strlen(dir) + strlen(name) >= PATH_SIZE)
+	{
+		tfs_fail(TFS_EINVAL, "%s%s: path too long", dir, name);
+	}
+	sprintf(buf, "%s%s", dir, name);
+	tfs_absent(fs, buf);
+	doadd(fs, src, dir);
+
+	return tfs_leave(fs, TFS_OK);
+}
+
+/*
+ * Extract a regular file, with its mode and time
+ * @fs			- handle
+ * @path		- file to extract
+ * @dst			- file to write
+ * @return	- TFS_OK or error code
+ * */
+int tfs_extract(struct tfs *fs, const char *path, const char *dst)
+{
+	jmp_buf env;
+	int rc;
+
+	if ((rc = setjmp(env)))
+	{
+		return tfs_leave(fs, rc);
+	}
+	fatal_jmp = &env;
+	tfs_inode(fs, path);
+	doextract(fs, path, dst);
+
+	return tfs_leave(fs, TFS_OK);
+}
+
+/*
+ * Create a symlink
+ * @fs			- handle
+ * @target	- target of the link
+ * @path		- link to create
+ * @return	- TFS_OK or error code
+ * */
+int tfs_symlink(struct tfs *fs, const char *target, const char *path)
+{
+	char buf[PATH_SIZE];
+	jmp_buf env;
+	int rc;
+
+	if ((rc = setjmp(env)))
+	{
+		return tfs_leave(fs, rc);
+	}
+	fatal_jmp = &env;
+	tfs_writable(fs);
+	tfs_path(path, buf);
+	tfs_absent(fs, buf);
+	domklnk(fs, (char *) target, buf);
+
+	return tfs_leave(fs, TFS_OK);
+}
+
+/*
+ * Create a hard link to a regular file
+ * @fs			- handle
+ * @target	- file to link to
+ * @path		- link to create
+ * @return	- TFS_OK or error code
+ * */
+int tfs_link(struct tfs *fs, const char *target, const char *path)
+{
+	char buf[PATH_SIZE];
+	jmp_buf env;
+	int rc;
+
+	if ((rc = setjmp(env)))
+	{
+		return tfs_leave(fs, rc);
+	}
+	fatal_jmp = &env;
+	tfs_writable(fs);
+	tfs_path(path, buf);
+	tfs_inode(fs, target);
+	tfs_absent(fs, buf);
+	domkhlnk(fs, (char *) target, buf);
+
+	return tfs_leave(fs, TFS_OK);
+}
+
+/*
+ * Details of an entry
+ * @fs			- handle
+ * @path		- path
+ * @st			- set to the details
+ * @return	- TFS_OK or error code
+ * */
+int tfs_stat(struct tfs *fs, const char *path, struct tfs_stat *st)
+{
+	struct tfs_inode *ino;
+	jmp_buf env;
+	int rc;
+
+	if ((rc = setjmp(env)))
+	{
+		return tfs_leave(fs, rc);
+	}
+	fatal_jmp = &env;
+	st->inode = tfs_inode(fs, path);
+	ino = INODE(fs, st->inode);
+	st->mode = ino->i_mode;
+	st->nlinks = ino->i_nlinks;
+	st->size = ino->i_size;
+	st->atime = ino->i_atime;
+	st->mtime = ino->i_mtime;
+	st->ctime = ino->i_ctime;
+
+	return tfs_leave(fs, TFS_OK);
+}
+
+/*
+ * Call a function for every entry of a directory
+ * @fs			- handle
+ * @path		- directory
+ * @fn			- called with the name, the inode of the entry and arg,
+ * 						a return value other than 0 ends the walk
+ * @arg			- passed to fn
+ * @return	- TFS_OK, the value that ended the walk or error code
+ * */
+int tfs_readdir(struct tfs *fs, const char *path,
+								int (*fn)(const char *name, int inode, void *arg), void *arg)
+{
+	jmp_buf env;
+	int inode, rc;
+
+	if ((rc = setjmp(env)))
+	{
+		return tfs_leave(fs, rc);
+	}
+	fatal_jmp = &env;
+	inode = tfs_inode(fs, path);
+
+	if (!S_ISDIR(INODE(fs, inode)->i_mode))
+	{
+		tfs_fail(TFS_EINVAL, "%s: is not a directory", path);
+	}
+	return tfs_leave(fs, walk_dir(fs, inode, fn, arg));
+}
@@ -25,6 +25,23 @@
  * @name	- TextFS binary
  * */
 void generalUsage(const char* name)
+{
+	printUsage(name);
+
+	if (fatal_jmp)
+	{
+		// The usage is the message
+		*fatal_text = 0;
+		longjmp(*fatal_jmp, TFS_EFAIL);
+	}
+	exit(0);
+}
+
+/*
+ * Print general usage information
+ * @name	- TextFS binary
+ * */
+void printUsage(const char* name)
 {
 	printf("\nUsage: %s --version \t show version of filesystem\n", name);
 	printf("\nUsage: %s --copyright \t show copyright\n", name);
@@ -37,14 +54,16 @@ void generalUsage(const char* name)
 	printf("unlink \t\t removes one or more files\n");
 	printf("rmdir \t\t removes one or more directories\n");
 	printf("stat \t\t show details of file \n");
+	printf("df \t\t show free blocks and inodes \n");
 	printf("symlink \t create a symlink to file\n");
 	printf("hardlink \t create a hardlink to file \n");
 	printf("readlink \t show the target file from symlink \n");
 	printf("cat \t\t show content of file in console \n");
 	printf("extract \t extract a file from file system \n");
-	printf("sfml \t\t open new window and show details of inode structure\n\n");
-
-	exit(0);
+	printf("sfml \t\t open new window and show details of inode structure\n");
+	printf("shell \t\t run commands from the console, the image stays open\n");
+	printf("batch \t\t run commands from a script, the image stays open\n");
+	printf("serve \t\t run commands of clients on a Unix domain socket\n\n");
 }
 
 /*
@@ -95,7 +114,8 @@ void usage(const char* name, const char* opt)
 {
 	if (!strcmp(opt, "mkdir"))
 	{
-		printf("\nUsage: %s [fs-name.txt] %s [directory-name] \n\n", name, opt);
+		printf("\nUsage: %s [fs-name.txt] %s [-b] [directory-name] \n", name, opt);
+		printf("\n-b: B-tree directory, for very large directories\n\n");
 	}
 	else if (!strcmp(opt, "add"))
 	{
@@ -103,7 +123,9 @@ void usage(const char* name, const char* opt)
 		printf("\nAdd to root:");
 		printf("\nExample: %s [fs-name.txt] %s [path/filename] [/] \n", name, opt);
 		printf("\nAdd to directory:");
-		printf("\nExample: %s [fs-name.txt] %s [path/filename] [directory/] \n\n", name, opt);
+		printf("\nExample: %s [fs-name.txt] %s [path/filename] [directory/] \n", name, opt);
+		printf("\nAdd a directory tree:");
+		printf("\nExample: %s [fs-name.txt] %s -r [path/directory] [directory/] \n\n", name, opt);
 	}
 	else if (!strcmp(opt, "dir"))
 	{
@@ -140,19 +162,125 @@ void usage(const char* name, const char* opt)
 	}
 	else if (!strcmp(opt, "extract"))
 	{
-		printf("\nUsage: %s [fs-name.txt] %s [sourcepath] [targetpath] \n\n", name, opt);
+		printf("\nUsage: %s [fs-name.txt] %s [sourcepath] [targetpath] \n", name, opt);
+		printf("\nExtract a directory tree:");
+		printf("\nExample: %s [fs-name.txt] %s -r [/directory] [path/directory] \n\n", name, opt);
 	}
 	else if (!strcmp(opt, "sfml"))
 	{
 		printf("\nUsage: %s [fs-name.txt] %s \n\n", name, opt);
 	}
+	else if (!strcmp(opt, "serve"))
+	{
+		printf("\nUsage: %s [fs-name.txt] %s [socket] {seconds} \n", name, opt);
+		printf("\nWrites the image back every {seconds} (default %d) after changes,\n", SERVE_SYNC_SECS);
+		printf("on \"sync\" and on \"shutdown\", see tfsclient.\n\n");
+	}
+	else if (!strcmp(opt, "shell") || !strcmp(opt, "batch"))
+	{
+		printf("\nUsage: %s [fs-name.txt] shell \n", name);
+		printf("\nUsage: %s [fs-name.txt] batch [script.txt|-] \n", name);
+		printf("\nOne command per line, e.g. \"mkdir /dir\" or \"add file /dir/\".\n");
+		printf("\"sync\" writes the image back, it is also written back at the end.\n");
+		printf("A failing command ends a batch, the image is not written back then.\n\n");
+	}
 	else
 	{
 		generalUsage(name);
 	}
+	if (fatal_jmp)
+	{
+		// The usage is the message
+		*fatal_text = 0;
+		longjmp(*fatal_jmp, TFS_EFAIL);
+	}
 	exit(0);
 }
 
+/*
+ * Commands which only read the file system
+ * @cmd		 - command
+ * @return - TRUE if the image need not be written back
+ * */
+int readonly_cmd(const char *cmd)
+{
+	return !strcmp(cmd, "dir") || !strcmp(cmd, "cat") || !strcmp(cmd, "stat")
+			|| !strcmp(cmd, "readlink") || !strcmp(cmd, "extract")
+			|| !strcmp(cmd, "sfml") || !strcmp(cmd, "df");
+}
+
+/*
+ * Run a command on an open file system
+ * @fs		 - file system structure
+ * @argc	 - from command line
+ * @argv	 -	from command line
+ * @return - FOUND, NOT_FOUND for an unknown command
+ * */
+int fs_cmd(struct tfs *fs, int argc, char **argv)
+{
+	if (!strcmp(argv[2], "dir"))
+	{
+		cmd_dir(fs, argc, argv);
+	}
+	else if (!strcmp(argv[2], "mkdir"))
+	{
+		cmd_mkdir(fs, argc, argv);
+	}
+	else if (!strcmp(argv[2], "rmdir"))
+	{
+		cmd_rmdir(fs,argc,argv);
+	}
+	else if (!strcmp(argv[2], "unlink"))
+	{
+		cmd_unlink(fs, argc, argv);
+	}
+	else if (!strcmp(argv[2], "cat"))
+	{
+		cmd_cat(fs,argc,argv);
+	}
+	else if (!strcmp(argv[2], "extract"))
+	{
+		if(argc < 5 || (argc < 6 && !strcmp(argv[3], "-r")))
+			usage(argv[0], argv[2]);
+		cmd_extract(fs,argc,argv);
+	}
+	else if (!strcmp(argv[2], "readlink"))
+	{
+		cmd_readlink(fs,argc,argv);
+	}
+	else if (!strcmp(argv[2], "symlink"))
+	{
+		if(argc < 5)
+			usage(argv[0], argv[2]);
+		cmd_mklnk(fs,argc,argv);
+	}
+	else if (!strcmp(argv[2], "hardlink"))
+	{
+		if(argc < 5)
+			usage(argv[0], argv[2]);
+		cmd_hardlnk(fs,argc,argv);
+	}
+	else if (!strcmp(argv[2], "stat"))
+	{
+		cmd_stat(fs,argc,argv);
+	}
+	else if (!strcmp(argv[2], "df"))
+	{
+		cmd_df(fs,argc,argv);
+	}
+	else if (!strcmp(argv[2], "add"))
+	{
+		if(argc < 5 || (argc < 6 && !strcmp(argv[3], "-r")))
+			usage(argv[0], argv[2]);
+		cmd_add(fs, argc, argv);
+	}
+	else
+	{
+		return NOT_FOUND;
+	}
+	return FOUND;
+}
+
 /*
  * so command
  * @argc	- from command line
@@ -173,7 +301,7 @@ void do_cmd(int argc, char **argv)
 	}
 	else if (!strcmp(argv[2], "sfml"))
 	{
-		struct tfs *fs = open_fs(argv[1]);
+		struct tfs *fs = open_fs(argv[1], TFS_READ_ONLY);
 		openWindow(fs);
 	}
 	else if (!strcmp(argv[2], "pentest"))
@@ -181,65 +309,28 @@ void do_cmd(int argc, char **argv)
 		printf("pentest\n");
 		TestFS(argc, argv);
 	}
-	else
+	else if (!strcmp(argv[2], "shell") || !strcmp(argv[2], "batch"))
+	{
+		if (argc < 4 && !strcmp(argv[2], "batch"))
+			usage(argv[0], argv[2]);
+		cmd_shell(argc, argv);
+	}
+	else if (!strcmp(argv[2], "serve"))
 	{
 		if (argc < 4)
 			usage(argv[0], argv[2]);
+		cmd_serve(argc, argv);
+	}
+	else
+	{
+		if (argc < 4 && strcmp(argv[2], "df"))
+			usage(argv[0], argv[2]);
 
-		struct tfs *fs = open_fs(argv[1]);
+		struct tfs *fs = open_fs(argv[1], (readonly_cmd(argv[2]) ? TFS_READ_ONLY
+																												  : TFS_READ_WRITE)
+																			| (getenv("TEXTFS_ARENA") ? TFS_ARENA : 0));
 
-		if (!strcmp(argv[2], "dir"))
-		{
-			cmd_dir(fs, argc, argv);
-		}
-		else if (!strcmp(argv[2], "mkdir"))
-		{
-			cmd_mkdir(fs, argc, argv);
-		}
-		else if (!strcmp(argv[2], "rmdir"))
-		{
-			cmd_rmdir(fs,argc,argv);
-		}
-		else if (!strcmp(argv[2], "unlink"))
-		{
-			cmd_unlink(fs, argc, argv);
-		}
-		else if (!strcmp(argv[2], "cat"))
-		{
-			cmd_cat(fs,argc,argv);
-		}
-		else if (!strcmp(argv[2], "extract"))
-		{
-			if(argc < 5)
-				usage(argv[0], argv[2]);
-			cmd_extract(fs,argc,argv);
-		}
-		else if (!strcmp(argv[2], "readlink"))
-		{
-			cmd_readlink(fs,argc,argv);
-		}
-		else if (!strcmp(argv[2], "symlink"))
-		{
-			if(argc < 5)
-				usage(argv[0], argv[2]);
-			cmd_mklnk(fs,argc,argv);
-		}
-		else if (!strcmp(argv[2], "hardlink"))
-		{
-			if(argc < 5)
-				usage(argv[0], argv[2]);
-			cmd_hardlnk(fs,argc,argv);
-		}
-		else if (!strcmp(argv[2], "stat"))
-		{
-			cmd_stat(fs,argc,argv);
-		}
-		else if (!strcmp(argv[2], "add"))
-		{
-			if(argc < 5)
-				usage(argv[0], argv[2]);
-			cmd_add(fs, argc, argv);
-		}
+		fs_cmd(fs, argc, argv);
 		close_fs(fs);
 	}
 }
@@ -23,6 +23,7 @@
 
 //general
 #include "spec_tfs.h"
+#include "textfs.h"
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,18 +33,25 @@
 #include <stdint.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <setjmp.h>
 #include "sfml.h"
 
 //main.c
 int main(int argc, char **argv);
 void do_cmd(int argc, char **argv);
+int fs_cmd(struct tfs *fs, int argc, char **argv);
+int readonly_cmd(const char *cmd);
 void generalUsage(const char* name);
+void printUsage(const char* name);
+void usage(const char* name, const char* opt);
 
 //gen_tfs.c
 void cmd_mkfs(int argc, char **argv);
 void get_size_parameters(int argc, char **argv, unsigned long *nblks_p, int *inodes_p);
 
 //utils.c
+extern __thread jmp_buf *fatal_jmp;
+extern __thread char fatal_text[FATAL_TEXT_SIZE];
 void *domalloc(unsigned long size, int defaultValToBeSet);
 void die(const char *s, ...);
 void *dofread(FILE *fp, void *buff, int cnt);
@@ -51,15 +59,39 @@ void *dofwrite(FILE *fp, void *buff, int cnt);
 void fatalmsg(const char *s, ...);
 void createFile(struct tfs *fs, const char *fn);
 void free_memory(struct tfs* fs);
-void get_free_blocks(u8 *bmap, int bsize, int *free_blocks);
+unsigned long count_free_bits(u8 *bmap, int bsize);
+u64 load_bmap_word(const u8 *bmap, unsigned long word);
+unsigned long find_next_bit(const u8 *bmap, unsigned long nbits, unsigned long nr, int set);
+unsigned long find_free_bits(u8 *bmap, int bsize, unsigned long *cursor, unsigned long n);
+unsigned long find_best_fit(u8 *bmap, int bsize, unsigned long n, unsigned long *len);
+unsigned long get_free_bit(u8 *bmap, int bsize, unsigned long *cursor);
+void printCacheStats(struct tfs *fs);
 
 //inode.c
+unsigned long reserved_position(int option, u32 nr);
+void reserve_blocks(struct tfs *fs, int w_inode, unsigned long size);
+void release_blocks(struct tfs *fs);
+unsigned long alloc_zone(struct tfs *fs, int w_inode, int option, u32 nr);
+u32 *read_block_map(struct tfs *fs, struct tfs_inode *inode, u32 nBlocks);
+u32 block_map_size(u32 nBlocks);
+u32 *write_map(struct tfs *fs, struct tfs_inode *inode, u32 nBlocks);
+u32 *fill_block_map(struct tfs *fs, struct tfs_inode *inode, u32 *map,
+										u32 nBlocks);
+u32 *cached_block_map(struct tfs *fs, struct tfs_inode *inode, u32 zoneID);
+void invalidate_block_map(struct tfs *fs, struct tfs_inode *inode);
+void free_block_maps(struct tfs *fs);
+u32 write_index_block(struct tfs *fs, int w_inode, u32 blockID, int option, u32 nr, u32 *map);
+void write_block_map(struct tfs *fs, int w_inode, u32 *map, u32 nBlocks);
+u32 mapped_block(struct tfs *fs, int w_inode, u32 *map, u32 zoneID);
+void write_mapped_block(struct tfs *fs, int w_inode, u32 *map, u32 zoneID, u8 *buf);
+void write_mapped_text(struct tfs *fs, int w_inode, u32 *map, u32 zoneID, const u8 *buf, const char *text, int len);
 void delete_blockID_from_inode(struct tfs *fs, struct tfs_inode *inode, int blk, int w_inode);
 int get_blockID_from_inode(struct tfs *fs, struct tfs_inode *inode, int blk);
 void set_inode( struct tfs *fs, int inode, int mode, int nlinks, u32 size,
 								u32 atime, u32 mtime, u32 ctime, int clr,	int defaultValToBeSet);
 void manage_inodes(struct tfs *fs, int *numberOfInodes,	unsigned long *sizeInBlocks);
 void write_block_to_inode(struct tfs *fs, int inode, u32 blk, u8 *buf);
+void write_node_to_inode(struct tfs *fs, int inode, u32 blk, u8 *buf, int option);
 void trunc_inode(struct tfs *fs, int t_inode, u32 sz);
 int find_inode(struct tfs *fs, const char *path);
 int read_inoblk(struct tfs *fs, int r_inode, u32 blk, u8 *buf);
@@ -73,52 +105,135 @@ int make_node(struct tfs *fs, char *fpath, int mode,int uid, int gid, u32 size,
 void dname_add(struct tfs *fs, int dinode, const char *name, int inode);
 void dname_rem(struct tfs *fs, int dinode, const char *name);
 
+//arena.c
+void *decodeArenaJob(void *arg);
+void *encodeArenaJob(void *arg);
+void runArenaJobs(struct arena_job *jobs, int nJobs, void *(*fn)(void *));
+int arenaThreads(unsigned long n);
+void decodeArena(struct tfs *fs);
+void flushArena(struct tfs *fs);
+void freeArena(struct tfs *fs);
+void dropArenaBlock(struct tfs *fs, unsigned long blk);
+
+//block_cache.c
+struct tfs_block_cache *init_block_cache(struct tfs *fs);
+void unlink_cached_block(struct tfs_block_cache *cache, int e);
+void push_cached_block(struct tfs_block_cache *cache, int e);
+int cache_lookup(struct tfs *fs, unsigned long blk, u8 *buf);
+void cache_store(struct tfs *fs, unsigned long blk, const u8 *buf);
+void cache_update(struct tfs *fs, unsigned long blk, const u8 *buf);
+void cache_drop(struct tfs *fs, unsigned long blk);
+void free_block_cache(struct tfs *fs);
+
+//dcache.c
+unsigned long dentry_slot(int parent, const char *name, u32 *hash, int *len);
+int dentry_lookup(struct tfs *fs, int parent, const char *name, int *inode);
+void dentry_insert(struct tfs *fs, int parent, const char *name, int inode);
+void dentry_forget(struct tfs *fs, int parent, const char *name);
+void dentry_forget_inode(struct tfs *fs, int inode);
+
+//dir_scan.c
+u32 dir_live_mask_scalar(const u8 *blk, int nEntries);
+u32 dir_live_mask_avx2(const u8 *blk, int nEntries);
+u32 dir_live_mask(const u8 *blk, int bsz);
+
+//dir_index.c
+u32 hash_dir_name(const char *name, int *len);
+void grow_dir_holes(struct tfs_dir_index *index, unsigned long n);
+void dir_index_insert(struct tfs_dir_index *index, const char *name, int inode, u32 pos);
+struct tfs_dir_entry *dir_index_find(struct tfs_dir_index *index, const char *lname);
+void dir_index_remove(struct tfs_dir_index *index, struct tfs_dir_entry *entry);
+struct tfs_dir_index *dir_index(struct tfs *fs, int dinode);
+void drop_dir_index(struct tfs *fs, int dinode);
+void free_dir_indexes(struct tfs *fs);
+
+//dir_btree.c
+int is_btree_dir(struct tfs *fs, int dinode);
+void btree_key(char *key, const char *name);
+int btree_upper(const u8 *blk, const char *key);
+int btree_find_leaf(struct tfs *fs, int dinode, const char *key, u32 *path, int *slot, u8 *blk);
+int btree_lookup(struct tfs *fs, int dinode, const char *lname, u32 *blkp, int *offp);
+void btree_write(struct tfs *fs, int dinode, u32 nblk, u8 *blk);
+u32 btree_new_node(struct tfs *fs, int dinode);
+void btree_create(struct tfs *fs, int dinode);
+void btree_insert(struct tfs *fs, int dinode, const char *name, int inode);
+int btree_remove(struct tfs *fs, int dinode, const char *name);
+void btree_first_leaf(struct tfs *fs, int dinode, u8 *blk);
+
 //init_tfs.c
-unsigned long get_free_bit(u8 *bmap, int bsize);
-struct tfs *open_fs(const char *fn);
+extern __thread struct tfs *opening_fs;
+void drop_opening_fs(void);
+struct tfs *open_fs(const char *fn, int mode);
+void sync_fs(struct tfs *fs);
 struct tfs *close_fs(struct tfs *fs);
+struct tfs *reload_fs(struct tfs *fs, const char *fn);
 struct tfs *new_tfs(const char *fn, unsigned long sizeInBlocks, int numberOfInodes);
 
 //write_to_fs.c
-void writeDataBlock(struct tfs *fs, u8 *startAddress, u16 size);
-void writeASCIILine(struct tfs *fs, u8** currentAddress);
+void writeSlots(struct tfs *fs, const char *slots, unsigned long blk, unsigned long n);
+void writeSlot(struct tfs *fs, unsigned long blk, const char *text, int len);
+void writeDataBlock(struct tfs *fs, unsigned long blk, const char *header, u8 *startAddress);
 void writeBootBlock(struct tfs* fs);
 void writeSuperBlock(struct tfs* fs);
-void writeZoneBMap(struct tfs* fs, int sizeInBlocks);
+void writeZoneBMap(struct tfs* fs);
 void writeInodeBMap(struct tfs* fs);
 void writeInodes(struct tfs* fs);
-void newline(struct tfs *fs);
-void writeVirtualDataBlock(char *virtualFS, unsigned long zone,	u8 *startAddress, u16 size);
+void writeDirtyBlocks(struct tfs *fs);
+void fseekCur(struct tfs *fs, int val);
+void writeVirtualDataBlock(struct tfs *fs, unsigned long zone,	u8 *startAddress, u16 size);
+void writeVirtualDataText(struct tfs *fs, unsigned long zone, const u8 *buf, const char *text, int len);
 void writefile(struct tfs *fs, FILE *fp, int inode);
 void writedata(struct tfs *fs, u8 *blk, u32 cnt, int inode);
+int doadd(struct tfs *fs, const char *src, const char *target);
 void cmd_add(struct tfs *fs, int argc, char **argv);
+void domklnk(struct tfs *fs, char *target, char *lnknam);
+void domkhlnk(struct tfs *fs, char *target, char *lnknam);
 void cmd_mklnk(struct tfs *fs,int argc,char **argv);
 void cmd_hardlnk(struct tfs *fs,int argc,char **argv);
 
 //read_from_fs.c
+int nextHeaderField(char **line, char **value);
+int isHeaderKey(const char *field, int len, const char *key);
+void copyHeaderValue(const char *value, char *retVal);
 void printHeader(struct tfs *fs, unsigned long blockID);
 void printBlock(struct tfs *fs, unsigned long blockID);
 void print_bitmaps(struct tfs *fs);
-void newline(struct tfs *fs);
 void readZeroBlock(struct tfs *fs);
 void readSuperBlock(struct tfs *fs);
 void readFreeList(struct tfs *fs);
 void readInodeList(struct tfs *fs);
 void readInodes(struct tfs *fs);
-void readVirtualDataBlock(char* BlockPtr, unsigned long address);
+int readVirtualDataBlock(char* BlockPtr, unsigned long address);
+void readVirtualBlock(struct tfs *fs, unsigned long blk, u8 *buf);
 void readVirtualZoneBMap(struct tfs *fs);
 void readVirtualInodeBMap(struct tfs *fs);
 void readVirtualInodes(struct tfs* fs);
 void readVirtualBootBlock(struct tfs *fs);
 void readVirtualSuperBlock(struct tfs *fs);
+void checkFreeCounts(struct tfs *fs);
 void readHeaderWithDataBlock(struct tfs* fs, u8 *buf);
-char *goto_dataBlk(char *virtualFS, unsigned long blk);
-char *goto_Block(char *virtualFS, unsigned long blk);
+char *goto_dataBlk(struct tfs *fs, unsigned long blk);
+char *goto_Block(struct tfs *fs, unsigned long blk);
+void setVirtualBlockOffset(struct tfs *fs, unsigned long blk,
+													 unsigned long blockOff, unsigned long dataOff);
+void indexVirtualFS(struct tfs *fs);
 void readVirtualFS(struct tfs *fs, const char *fn);
+int mapVirtualFS(struct tfs *fs, unsigned long size);
+void releaseVirtualFS(struct tfs *fs);
+unsigned long getSlotSize(const char *virtualFS);
+void frameVirtualSlots(char *virtualFS, unsigned long from, unsigned long to);
+void slotVirtualFS(struct tfs *fs);
 void cmd_readlink(struct tfs *fs,int argc,char **argv);
 void cmd_cat(struct tfs *fs,int argc,char **argv);
+int readfile(struct tfs *fs, FILE *fp, const char *path, int type, int ispipe);
+void restore_attrs(const char *dst, int mode, time_t atime);
+int doextract(struct tfs *fs, const char *path, const char *dst);
 void cmd_extract(struct tfs *fs,int argc,char **argv);
 
+//hex_tfs.c
+int decodeDataBlock(const char *blockPtr, u8 *buf);
+int encodeDataBlock(const u8 *buf, int size, char *text);
+
 //spec_tfs.c
 void initDefaultBlock(struct tfs *fs, unsigned long sizeInBlocks);
 void initBootBlock(struct tfs *fs, unsigned long sizeInBlocks);
@@ -128,11 +243,59 @@ void initInodeTables(struct tfs *fs, unsigned long *rootblk);
 void initRootBlock(struct tfs *fs, char *rootblk, unsigned long rootblkp);
 
 //dir.c
+void outent(FILE *fp, const char *dirPtr, int namlen);
+int walk_dir(struct tfs *fs, int inode, int (*fn)(const char *name, int inode, void *arg), void *arg);
+int print_dirent(const char *name, int inode, void *arg);
+void dodir(struct tfs *fs, const char *path);
+int domkdir(struct tfs *fs, char *newdir, int btree);
+void dostat(struct tfs *fs, const char *path);
+void dormdir(struct tfs *fs, const char *dir);
+void dounlink(struct tfs *fs, char *fpath);
 void cmd_mkdir(struct tfs *fs, int argc, char **argv);
 void cmd_dir(struct tfs *fs, int argc, char **argv);
 void cmd_unlink(struct tfs *fs, int argc, char **argv);
 void cmd_rmdir(struct tfs *fs, int argc, char **argv);
 void cmd_stat(struct tfs *fs, int argc, char **argv);
+void cmd_df(struct tfs *fs, int argc, char **argv);
+
+//shell.c
+int split_cmdline(char *line, char **args, int max);
+void shell_prompt(FILE *in);
+void shell_cmd(struct tfs *fs, int argc, char **args);
+void cmd_shell(int argc, char **argv);
+
+//serve.c
+void serve_signal(int sig);
+int serve_receive(struct serve_client *c, int fd);
+int write_full(int fd, const void *buf, size_t n);
+int send_frame(int fd, u32 type, const void *data, u32 len);
+int send_output(int fd, u32 type, int tmpFd);
+int run_request(struct tfs *fs, int argc, char **args, int outFd, int errFd);
+int serve_request(struct tfs **fs, int fd, struct serve_client *c, char **argv,
+									int *changed);
+int serve_socket(const char *path);
+void cmd_serve(int argc, char **argv);
+
+//add_tree.c
+int add_hole(const u8 *blk);
+struct add_entry *add_push(struct add_tree *tree, const char *src, const char *path);
+void add_walk(struct add_tree *tree, const char *src, const char *path);
+void add_read(struct add_entry *e, int encode);
+void *add_worker(void *arg);
+void add_wait(struct add_tree *tree, unsigned long i);
+void add_commit(struct tfs *fs, struct add_entry *e);
+void add_end(struct add_tree *tree);
+void doadd_tree(struct tfs *fs, const char *src, const char *target);
+
+//extract_tree.c
+struct extract_entry *extract_push(struct extract_tree *tree, const char *dst, int inode);
+int extract_name(const char *name, int inode, void *arg);
+void extract_walk(struct extract_tree *tree, unsigned long i);
+int extract_block(struct tfs *fs, unsigned long blk, u8 *buf);
+void extract_write(struct tfs *fs, struct extract_entry *e);
+void *extract_worker(void *arg);
+void extract_end(struct extract_tree *tree);
+void doextract_tree(struct tfs *fs, const char *path, const char *dst);
 
 //pentest.c
 void TestFS(int argc, char **argv);
@@ -20,46 +20,70 @@
 #include "spec_tfs.h"
 #include "protos.h"
 #include <utime.h>
+#include <sys/mman.h>
 
 /**************************************************************************************************
  * Functions for virtualFS
  **************************************************************************************************/
 
 /*
- * get key value pair
- * @virtualFS	- file system as string
- * @retVal		-	0 return value as integer
- *							1 return value as string
- * @key				- key to find value
+ * Step to the next "key: value" line of a block header
+ * @line		- current line, set to the following line
+ * @value	- set to the value behind ": "
+ * @return	- length of the key, 0 at the end of the header
  * */
-int getHeaderValue(char* virtualFS, char *retVal, const char* key)
+int nextHeaderField(char **line, char **value)
 {
-	char *ptr;
-	char *ptr2;
-	int i;
+	char *ptr = *line;
+	char *colon;
 
-	if ((ptr = strstr(virtualFS, key)))
+	// The header ends with an empty line or the first data line
+	if (!ptr || !*ptr || *ptr == '\n' || !strncmp(ptr, "000:", 4))
 	{
-		ptr2 = strstr(ptr, "\n");
-		char value[ptr2 - ptr - strlen(key) + 1];
+		return 0;
+	}
+	colon = ptr + strcspn(ptr, ":\n");
+	*value = *colon == ':' ? colon + 1 + (colon[1] == ' ') : colon;
+	*line = strchr(colon, '\n');
 
-		for (i = 0; i < ptr2 - ptr - strlen(key); i++)
-		{
-			value[i] = ptr[i + strlen(key)];
-		}
-		value[i] = '\0';
+	if (*line)
+	{
+		(*line)++;
+	}
+	return *colon == ':' ? colon - ptr : nextHeaderField(line, value);
+}
 
-		if (retVal)
-		{
-			strcpy(retVal, value);
-		}
-		return atoi(value);
+/*
+ * Compare a header key
+ * @field	- key returned by nextHeaderField()
+ * @len		- length of field
+ * @key		- key to compare with
+ * @return	- true if the key matches
+ * */
+int isHeaderKey(const char *field, int len, const char *key)
+{
+	return len == strlen(key) && !strncmp(field, key, len);
+}
+
+/*
+ * Copy a string header value
+ * @value	- value returned by nextHeaderField()
+ * @retVal	- store value to retVal (VALUE_SIZE)
+ * */
+void copyHeaderValue(const char *value, char *retVal)
+{
+	int i;
+
+	for (i = 0; i < VALUE_SIZE - 1 && value[i] && value[i] != '\n'; i++)
+	{
+		retVal[i] = value[i];
 	}
-	return 0;
+	retVal[i] = '\0';
 }
 
 /*
  * Read only content of file system, and write it to virtualFS
+ * A slotted image is mapped, a packed one read into a buffer.
  * @fs	- file system structure
  * @fn	-	file system name
  * */
@@ -69,22 +93,43 @@ void readVirtualFS(struct tfs *fs, const char *fn)
 
 	if (fs->fp && !stat(fn, &fdstat))
 	{
-		fs->virtualFS = malloc(fdstat.st_size + 1);
+		unsigned long size = fdstat.st_size;
+
+		if (!mapVirtualFS(fs, size))
+		{
+			return;
+		}
+
+		// Room for a last slot, that is shorter in the file
+		fs->virtualFS = malloc(size + BLOCKSIZE_BRUTTO + 1);
 	  size_t nread = fread(fs->virtualFS, 1, fdstat.st_size, fs->fp);
 
 	  // Terminate the buffer as a string
 	  fs->virtualFS[nread] = '\0';
+	  fs->virtualLength = nread;
+	  fs->slotSize = getSlotSize(fs->virtualFS);
+
+	  if (fs->slotSize)
+	  {
+	  	fs->virtualLength = UPPER(nread, fs->slotSize) * fs->slotSize;
+	  	frameVirtualSlots(fs->virtualFS, nread, fs->virtualLength);
+	  	fs->virtualFS[fs->virtualLength] = '\0';
+	  	return;
+	  }
 
 	  // Truncate the string after the end-of-data:
 	  char *endOfData = strstr(fs->virtualFS, "\n ");
 	  if (endOfData)
 	  {
 	  	endOfData[1] = '\0';
+	  	fs->virtualLength = endOfData + 1 - fs->virtualFS;
 	  }
 	  else
 	  {
-	  	fs->sb->state = ERROR;
+	  	// The superblock is not read yet
+	  	fatalmsg("%s: no end of data, not a TextFS image", fn);
 	  }
+	  indexVirtualFS(fs);
 	}
 	else
 	{
@@ -92,12 +137,262 @@ void readVirtualFS(struct tfs *fs, const char *fn)
 	}
 }
 
+/*
+ * Map a slotted image as virtualFS. Pages are only read when a block is
+ * used, changes stay private until close_fs writes the dirty slots.
+ * An anonymous page behind the image terminates virtualFS as a string.
+ * @fs			- file system structure
+ * @size		- file size
+ * @return	- 0 or ERROR to read the image into a buffer instead
+ * */
+int mapVirtualFS(struct tfs *fs, unsigned long size)
+{
+	unsigned long page = sysconf(_SC_PAGESIZE);
+	unsigned long length = (size / page + 1) * page;
+	char *map;
+
+	if (!size || size % BLOCKSIZE_BRUTTO)
+	{
+		return ERROR;
+	}
+	map = mmap(NULL, length, PROT_READ | PROT_WRITE,
+						 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (map == MAP_FAILED)
+	{
+		return ERROR;
+	}
+	if (mmap(map, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+					 fileno(fs->fp), 0) == MAP_FAILED || !getSlotSize(map))
+	{
+		munmap(map, length);
+		return ERROR;
+	}
+	fs->virtualFS = map;
+	fs->virtualLength = size;
+	fs->mappedLength = length;
+	fs->slotSize = BLOCKSIZE_BRUTTO;
+
+	return 0;
+}
+
+/*
+ * Release virtualFS, mapped or allocated
+ * @fs	- file system structure
+ * */
+void releaseVirtualFS(struct tfs *fs)
+{
+	if (fs->mappedLength)
+	{
+		munmap(fs->virtualFS, fs->mappedLength);
+		fs->mappedLength = 0;
+	}
+	else
+	{
+		free(fs->virtualFS);
+	}
+	fs->virtualFS = NULL;
+}
+
+/*
+ * Get the slot size from the boot block
+ * @virtualFS	- file system as string
+ * @return		- BLOCKSIZE_BRUTTO or 0 for a packed image
+ * */
+unsigned long getSlotSize(const char *virtualFS)
+{
+	const char *line = virtualFS;
+
+	// The boot block ends with the first empty line
+	while (line && *line && *line != '\n')
+	{
+		if (!strncmp(line, "slot-size: ", 11))
+		{
+			if (strtoul(line + 11, NULL, 10) != BLOCKSIZE_BRUTTO)
+			{
+				fatalmsg("slot-size: %lu: not supported", strtoul(line + 11, NULL, 10));
+			}
+			return BLOCKSIZE_BRUTTO;
+		}
+		if ((line = strchr(line, '\n')))
+		{
+			line++;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Fill empty slots with spaces, each slot ends with a newline
+ * @virtualFS	- file system as string
+ * @from			- first offset to fill
+ * @to				- end of the last slot to fill
+ * */
+void frameVirtualSlots(char *virtualFS, unsigned long from, unsigned long to)
+{
+	unsigned long i;
+
+	memset(virtualFS + from, ' ', to - from);
+
+	for (i = from / BLOCKSIZE_BRUTTO * BLOCKSIZE_BRUTTO + BLOCKSIZE_BRUTTO - 1;
+			 i < to; i += BLOCKSIZE_BRUTTO)
+	{
+		virtualFS[i] = '\n';
+	}
+}
+
+/*
+ * Move every block of virtualFS to its slot, so blocks can be written
+ * back one by one. A packed image is rewritten completely on close.
+ * @fs	- file system structure
+ * */
+void slotVirtualFS(struct tfs *fs)
+{
+	unsigned long nBlocks = fs->sb->fs_sizeInBlocks;
+	unsigned long length = nBlocks * BLOCKSIZE_BRUTTO;
+	unsigned long blk;
+	char *slots;
+
+	fs->dirty_bmap = domalloc(UPPER(nBlocks, 8), 0);
+
+	if (fs->slotSize && fs->virtualLength >= length)
+	{
+		return;
+	}
+	slots = domalloc(length + 1, -1);
+	frameVirtualSlots(slots, 0, length);
+	slots[length] = '\0';
+
+	if (fs->slotSize)
+	{
+		memcpy(slots, fs->virtualFS, fs->virtualLength);
+	}
+	else
+	{
+		for (blk = 0; blk < nBlocks; blk++)
+		{
+			char *start = goto_Block(fs, blk);
+			char *end;
+
+			if (!start)
+			{
+				continue;
+			}
+			end = strstr(start, "\n\n");
+			end = end ? end + 2 : start + strlen(start);
+
+			if (end - start >= BLOCKSIZE_BRUTTO)
+			{
+				fatalmsg("block-id: %lu: block does not fit into a slot", blk);
+			}
+			memcpy(slots + SLOT_OFFSET(blk), start, end - start);
+		}
+		memset(fs->dirty_bmap, 0xff, UPPER(nBlocks, 8));
+
+		free(fs->blockOffset);
+		fs->blockOffset = NULL;
+		free(fs->dataOffset);
+		fs->dataOffset = NULL;
+		fs->nBlockOffsets = 0;
+	}
+	releaseVirtualFS(fs);
+	fs->virtualFS = slots;
+	fs->virtualLength = length;
+	fs->slotSize = BLOCKSIZE_BRUTTO;
+}
+
+/*
+ * Remember where a block is stored in virtualFS
+ * @fs				- file system structure
+ * @blk				- block-id
+ * @blockOff	- offset of the "block-id: " line
+ * @dataOff		- offset of the "000:" line, NO_OFFSET for header only blocks
+ * */
+void setVirtualBlockOffset(struct tfs *fs, unsigned long blk,
+													 unsigned long blockOff, unsigned long dataOff)
+{
+	if (blk >= fs->nBlockOffsets)
+	{
+		unsigned long i, n = fs->nBlockOffsets ? fs->nBlockOffsets : 64;
+
+		while (n <= blk)
+		{
+			n <<= 1;
+		}
+		fs->blockOffset = realloc(fs->blockOffset, n * sizeof(unsigned long));
+		fs->dataOffset = realloc(fs->dataOffset, n * sizeof(unsigned long));
+
+		if (!fs->blockOffset || !fs->dataOffset)
+		{
+			die("realloc");
+		}
+		for (i = fs->nBlockOffsets; i < n; i++)
+		{
+			fs->blockOffset[i] = fs->dataOffset[i] = NO_OFFSET;
+		}
+		fs->nBlockOffsets = n;
+	}
+	fs->blockOffset[blk] = blockOff;
+	fs->dataOffset[blk] = dataOff;
+}
+
+/*
+ * Build block-id -> offset index of virtualFS in one pass.
+ * Only "block-id: " at the beginning of a line starts a block, so
+ * neither longer ids nor ASCII columns of data lines can match.
+ * @fs	- file system structure
+ * */
+void indexVirtualFS(struct tfs *fs)
+{
+	char *line = fs->virtualFS;
+	char *end = fs->virtualFS + fs->virtualLength;
+	unsigned long blk = NO_OFFSET;
+	unsigned long i;
+
+	for (i = 0; i < fs->nBlockOffsets; i++)
+	{
+		fs->blockOffset[i] = fs->dataOffset[i] = NO_OFFSET;
+	}
+
+	while (line && line < end)
+	{
+		if (!strncmp(line, "block-id: ", 10))
+		{
+			blk = strtoul(line + 10, NULL, 10);
+
+			// The first occurrence wins, as the former strstr() did
+			if (blk >= fs->nBlockOffsets || fs->blockOffset[blk] == NO_OFFSET)
+			{
+				setVirtualBlockOffset(fs, blk, line - fs->virtualFS, NO_OFFSET);
+			}
+			else
+			{
+				blk = NO_OFFSET;
+			}
+		}
+		else if (blk != NO_OFFSET && !strncmp(line, "000:", 4))
+		{
+			fs->dataOffset[blk] = line - fs->virtualFS;
+			blk = NO_OFFSET;
+		}
+
+		if ((line = memchr(line, '\n', end - line)))
+		{
+			line++;
+		}
+	}
+}
+
 /*
  * Read Boot block from virtualFS
  * @fs	- file system structure
  * */
 void readVirtualBootBlock(struct tfs *fs)
 {
+	char *line = fs->virtualFS;
+	char *field, *value;
+	int len;
+
 	fflush(fs->fp);
 
 	if (fseek(fs->fp, 0, SEEK_SET))
@@ -105,9 +400,22 @@ void readVirtualBootBlock(struct tfs *fs)
 		die("fseek");
 	}
 	fs->bb = domalloc(BLOCKSIZE, DEFAULTVALTOBESET);
-	fs->bb->blockID = getHeaderValue(fs->virtualFS, NULL, "block-id: ");
-	getHeaderValue(fs->virtualFS, fs->bb->fragment_type, "Fragment-Type: ");
-	getHeaderValue(fs->virtualFS, fs->bb->encoding, "encoding: ");
+
+	while ((field = line, len = nextHeaderField(&line, &value)))
+	{
+		if (isHeaderKey(field, len, "block-id"))
+		{
+			fs->bb->blockID = atoi(value);
+		}
+		else if (isHeaderKey(field, len, "Fragment-Type"))
+		{
+			copyHeaderValue(value, fs->bb->fragment_type);
+		}
+		else if (isHeaderKey(field, len, "encoding"))
+		{
+			copyHeaderValue(value, fs->bb->encoding);
+		}
+	}
 }
 
 /*
@@ -116,31 +424,76 @@ void readVirtualBootBlock(struct tfs *fs)
  * */
 void readVirtualSuperBlock(struct tfs *fs)
 {
-	fs->sb = domalloc(BLOCKSIZE, DEFAULTVALTOBESET);
-
-	fs->sb->blockID = getHeaderValue(goto_Block(fs->virtualFS, SB_POSITION),
-																	 NULL, "block-id: ");
-
-	getHeaderValue( goto_Block(fs->virtualFS, SB_POSITION), fs->sb->fragment_type,
-									"Fragment-Type: ");
-
-	fs->sb->state = getHeaderValue( goto_Block(fs->virtualFS, SB_POSITION), NULL,
-																	"file system-state: ");
-
-	fs->sb->zmap_sizeInBlocks = getHeaderValue(goto_Block(fs->virtualFS, SB_POSITION),
-																						 NULL, "zone-bitmap-size_blocks: ");
+	char *line = goto_Block(fs, SB_POSITION);
+	char *field, *value;
+	int len;
 
-	fs->sb->imap_sizeInBlocks = getHeaderValue(goto_Block(fs->virtualFS, SB_POSITION),
-																						 NULL, "inode-bitmap-size_blocks: ");
+	fs->sb = domalloc(BLOCKSIZE, DEFAULTVALTOBESET);
+	fs->free_zones = fs->free_inodes = NO_COUNT;
 
-	fs->sb->nInodes = getHeaderValue(goto_Block(fs->virtualFS, SB_POSITION),
-																		 NULL,"number-of-inodes: ");
+	while ((field = line, len = nextHeaderField(&line, &value)))
+	{
+		if (isHeaderKey(field, len, "block-id"))
+		{
+			fs->sb->blockID = atoi(value);
+		}
+		else if (isHeaderKey(field, len, "Fragment-Type"))
+		{
+			copyHeaderValue(value, fs->sb->fragment_type);
+		}
+		else if (isHeaderKey(field, len, "file system-state"))
+		{
+			fs->sb->state = atoi(value);
+		}
+		else if (isHeaderKey(field, len, "zone-bitmap-size_blocks"))
+		{
+			fs->sb->zmap_sizeInBlocks = atoi(value);
+		}
+		else if (isHeaderKey(field, len, "inode-bitmap-size_blocks"))
+		{
+			fs->sb->imap_sizeInBlocks = atoi(value);
+		}
+		else if (isHeaderKey(field, len, "number-of-inodes"))
+		{
+			fs->sb->nInodes = atoi(value);
+		}
+		else if (isHeaderKey(field, len, "number-of-blocks"))
+		{
+			fs->sb->fs_sizeInBlocks = atoi(value);
+		}
+		else if (isHeaderKey(field, len, "first-data-block"))
+		{
+			fs->sb->firstdatazone = atoi(value);
+		}
+		else if (isHeaderKey(field, len, "free-blocks"))
+		{
+			fs->free_zones = strtoul(value, NULL, 10);
+		}
+		else if (isHeaderKey(field, len, "free-inodes"))
+		{
+			fs->free_inodes = strtoul(value, NULL, 10);
+		}
+	}
+}
 
-	fs->sb->fs_sizeInBlocks = getHeaderValue(goto_Block(fs->virtualFS, SB_POSITION),
-																	 NULL,"number-of-blocks: ");
+/*
+ * Check the free counters of the superblock against the bitmaps,
+ * the bitmaps win. Older images have no counters.
+ * @fs	- file system structure
+ * */
+void checkFreeCounts(struct tfs *fs)
+{
+	unsigned long zones = count_free_bits(fs->zone_bmap, fs->sb->zmap_sizeInBlocks);
+	unsigned long inodes = count_free_bits(fs->inode_bmap, fs->sb->imap_sizeInBlocks);
 
-	fs->sb->firstdatazone = getHeaderValue(goto_Block(fs->virtualFS, SB_POSITION),
-																					 NULL, "first-data-block: ");
+	if ((fs->free_zones != NO_COUNT && fs->free_zones != zones)
+			|| (fs->free_inodes != NO_COUNT && fs->free_inodes != inodes))
+	{
+		fprintf(stderr, "Warning: free counts %lu/%lu in superblock, %lu/%lu in bitmaps\n",
+						fs->free_zones, fs->free_inodes, zones, inodes);
+	}
+	fs->free_zones = zones;
+	fs->free_inodes = inodes;
 }
 
 /*
@@ -155,8 +508,7 @@ void readVirtualZoneBMap(struct tfs *fs)
 
 	for (i = 0; i < fs->sb->zmap_sizeInBlocks; i++)
 	{
-		readVirtualDataBlock(goto_dataBlk(fs->virtualFS, SB_POSITION + 1 + i),
-												(unsigned long) fs->zone_bmap + i * BLOCKSIZE);
+		readVirtualBlock(fs, SB_POSITION + 1 + i, fs->zone_bmap + i * BLOCKSIZE);
 	}
 }
 
@@ -172,9 +524,8 @@ void readVirtualInodeBMap(struct tfs *fs)
 
 	for (i = 0; i < fs->sb->imap_sizeInBlocks; i++)
 	{
-		readVirtualDataBlock( goto_dataBlk(fs->virtualFS,
-													SB_POSITION + 1 + ((fs)->sb->zmap_sizeInBlocks) + i),
-													(unsigned long) fs->inode_bmap + i * BLOCKSIZE);
+		readVirtualBlock(fs, SB_POSITION + 1 + ((fs)->sb->zmap_sizeInBlocks) + i,
+										 fs->inode_bmap + i * BLOCKSIZE);
 	}
 }
 
@@ -184,114 +535,115 @@ void readVirtualInodeBMap(struct tfs *fs)
  * */
 void readVirtualInodes(struct tfs* fs)
 {
-	int i, j, j_to_c;
+	unsigned long blockID = SB_POSITION + fs->sb->zmap_sizeInBlocks
+													+ fs->sb->imap_sizeInBlocks;
+	struct tfs_inode *ino;
+	char *line, *field, *value;
+	int i, j, len;
 
-	fs->inode = domalloc(INODE_BUFFER_SIZE(fs), -1);
+	fs->inode = domalloc(INODE_BUFFER_SIZE(fs), 0);
 
 	for (i = 1; i <= fs->sb->nInodes; i++)
 	{
-		INODE(fs,i)->i_mode =
-								getHeaderValue(goto_Block( fs->virtualFS,
-																   				 SB_POSITION
-																					 + ((fs)->sb->zmap_sizeInBlocks)
-																					 + (fs->sb->imap_sizeInBlocks)
-																					 + i),
-																				 	 NULL, "file-type: ");
-
-		INODE(fs,i)->i_nlinks =
-								getHeaderValue(goto_Block( fs->virtualFS,
-																     			 SB_POSITION
-																					 + ((fs)->sb->zmap_sizeInBlocks)
-																					 + (fs->sb->imap_sizeInBlocks)
-																					 + i),
-																					 NULL, "links-to-file: ");
-		for(j = 0; j < 7; j++)
+		ino = INODE(fs,i);
+		line = goto_Block(fs, blockID + i);
+
+		while ((field = line, len = nextHeaderField(&line, &value)))
 		{
-			char data_zone[14] = "data-zone[j]: ";
-			j_to_c = j + 0x30;
-			data_zone[10] = j_to_c;
-
-			INODE(fs,i)->zones[j] =
-								getHeaderValue(goto_Block( fs->virtualFS,
-																					 SB_POSITION
-																					 + ((fs)->sb->zmap_sizeInBlocks)
-																					 + (fs->sb->imap_sizeInBlocks)
-																					 + i),
-															 	 	 	 	 	 	 NULL, data_zone);
+			if (isHeaderKey(field, len, "file-type"))
+			{
+				ino->i_mode = atoi(value);
+			}
+			else if (isHeaderKey(field, len, "links-to-file"))
+			{
+				ino->i_nlinks = atoi(value);
+			}
+			else if (len == 12 && !strncmp(field, "data-zone[", 10)
+							 && field[11] == ']')
+			{
+				j = field[10] - '0';
+
+				if (j >= 0 && j < NR_OF_DIREKT_ZONES)
+				{
+					ino->zones[j] = atoi(value);
+				}
+			}
+			else if (isHeaderKey(field, len, "indirect-data-zone"))
+			{
+				ino->indirZone = atoi(value);
+			}
+			else if (isHeaderKey(field, len, "double-indirect-data-zone"))
+			{
+				ino->doubleIndirZone = atoi(value);
+			}
+			else if (isHeaderKey(field, len, "file-size-in-bytes"))
+			{
+				ino->i_size = atoi(value);
+			}
+			else if (isHeaderKey(field, len, "atime"))
+			{
+				ino->i_atime = atoi(value);
+			}
 		}
-		INODE(fs,i)->indirZone =
-								getHeaderValue(goto_Block( fs->virtualFS,
-																					 SB_POSITION
-																					 + ((fs)->sb->zmap_sizeInBlocks)
-																					 + (fs->sb->imap_sizeInBlocks)
-																					 + i),
-															 	 	 	 	 	 	 NULL, "indirect-data-zone: ");
-
-		INODE(fs,i)->doubleIndirZone =
-								getHeaderValue(goto_Block( fs->virtualFS,
-																					 SB_POSITION
-																					 + ((fs)->sb->zmap_sizeInBlocks)
-																					 + (fs->sb->imap_sizeInBlocks)
-																					 + i),
-															 	 	 	 	 	 	 NULL, "double-indirect-data-zone: ");
-
-		INODE(fs,i)->i_size =
-								getHeaderValue(goto_Block( fs->virtualFS,
-																					 SB_POSITION
-																					 + ((fs)->sb->zmap_sizeInBlocks)
-																					 + (fs->sb->imap_sizeInBlocks)
-																					 + i),
-															 	 	 	 	 	 	 NULL, "file-size-in-bytes: ");
-
-		INODE(fs,i)->i_atime =
-								getHeaderValue(goto_Block( fs->virtualFS,
-																					 SB_POSITION
-																					 + ((fs)->sb->zmap_sizeInBlocks)
-																					 + (fs->sb->imap_sizeInBlocks)
-																					 + i),
-															 	 	 	 	 	 	 NULL, "atime: ");
 	}
 }
 
 /*
- * Seek file to the specified block
- * @virtualFS	- file system as string
- * @blk 			- block to go to
- * @return		- ptr to block or NULL
+ * Go to the data lines of a block
+ * @fs			- file system structure
+ * @blk 		- block to go to
+ * @return	- ptr to "000:" of block or NULL
  * */
-char *goto_dataBlk(char *virtualFS, unsigned long blk)
+char *goto_dataBlk(struct tfs *fs, unsigned long blk)
 {
-	char blockID[2 * MAX_SZ_IN_BLOCKS_LENGTH] =	{ 0 };
-	char *ptr;
-
-	// Seek "blockID: xx", then begin of datablock and return
+	if (fs->slotSize)
+	{
+		char *line = goto_Block(fs, blk);
+		char *end = fs->virtualFS + (blk + 1) * fs->slotSize;
 
-	sprintf(blockID, "block-id: %lu", blk);
-	if ((ptr = strstr(virtualFS, blockID)))
+		// Header lines end with "000:" or an empty line
+		while (line && line < end && *line != '\n')
+		{
+			if (!strncmp(line, "000:", 4))
+			{
+				return line;
+			}
+			if ((line = memchr(line, '\n', end - line)))
+			{
+				line++;
+			}
+		}
+		return NULL;
+	}
+	if (blk < fs->nBlockOffsets && fs->dataOffset[blk] != NO_OFFSET)
 	{
-		return (strstr(ptr, "000:"));
+		return fs->virtualFS + fs->dataOffset[blk];
 	}
 	return NULL;
 }
 
 /*
  * Go to needed block
- * @virtualFS	- file system as string
- * @blk 			- block to go to
- * @return		- ptr to block or NULL
+ * @fs			- file system structure
+ * @blk 		- block to go to
+ * @return	- ptr to "block-id: " of block or NULL
  * */
-char *goto_Block(char *virtualFS, unsigned long blk)
+char *goto_Block(struct tfs *fs, unsigned long blk)
 {
+	if (fs->slotSize)
+	{
+		char *slot = fs->virtualFS + blk * fs->slotSize;
 
-	char blockID[2 * MAX_SZ_IN_BLOCKS_LENGTH] =	{ 0 };
-	char *ptr;
-
-	// Seek "blockID: xx" and return
-	sprintf(blockID, "block-id: %lu", blk);
-
-	if ((ptr = strstr(virtualFS, blockID)))
+		if (blk < fs->virtualLength / fs->slotSize && !strncmp(slot, "block-id: ", 10)
+				&& strtoul(slot + 10, NULL, 10) == blk)
+		{
+			return slot;
+		}
+		return NULL;
+	}
+	if (blk < fs->nBlockOffsets && fs->blockOffset[blk] != NO_OFFSET)
 	{
-		return (strstr(ptr, "block-id:"));
+		return fs->virtualFS + fs->blockOffset[blk];
 	}
 	return NULL;
 }
@@ -300,29 +652,40 @@ char *goto_Block(char *virtualFS, unsigned long blk)
  * read data block from virtualFS
  * @BlockPtr	- ptr to block to read from
  * @address 	- store block to address
+ * @return		- 0 or ERROR if BlockPtr is no valid data block
  * */
-void readVirtualDataBlock(char* BlockPtr, unsigned long address)
+int readVirtualDataBlock(char* BlockPtr, unsigned long address)
 {
-	char dataBlock[3];
-	int hex, i;
-	int k;
-	u16 m = 0;
-
-	for (i = 0; i < BLOCKSIZE / 16; i++)
+	if (!BlockPtr)
 	{
-		for (k = 5; k < 54; k = k + 3, m++)
-		{
-			if (k == 29)
-			{
-				k++;
-			}
-			sprintf(dataBlock, "%c%c", BlockPtr[k], BlockPtr[k + 1]);
-			hex = (unsigned char) strtol(dataBlock, NULL, 16);
-			memset((unsigned char*) address + m, hex, 1);
-		}
-		BlockPtr = BlockPtr + DATA_LINE_WIDTH - 1;
+		return ERROR;
 	}
+	return decodeDataBlock(BlockPtr, (u8 *) address);
+}
 
+/*
+ * read data block by block-id, stop on a damaged block
+ * Decoded blocks are kept in the block cache.
+ * @fs	- file system structure
+ * @blk	- block-id
+ * @buf	- store block to buf (BLOCKSIZE)
+ * */
+void readVirtualBlock(struct tfs *fs, unsigned long blk, u8 *buf)
+{
+	if (fs->arena && blk < fs->sb->fs_sizeInBlocks && fs->arenaValid[blk])
+	{
+		memcpy(buf, ARENA_BLOCK(fs, blk), BLOCKSIZE);
+		return;
+	}
+	if (cache_lookup(fs, blk, buf))
+	{
+		return;
+	}
+	if (readVirtualDataBlock(goto_dataBlk(fs, blk), (unsigned long) buf) == ERROR)
+	{
+		fatalmsg("block-id: %lu: no valid data block", blk);
+	}
+	cache_store(fs, blk, buf);
 }
 
 /*
@@ -436,7 +799,7 @@ void print_bitmaps(struct tfs *fs)
 int readfile(struct tfs *fs,FILE *fp,const char *path,int type,int ispipe)
 {
   int inode = find_inode(fs,path);
-  int i,bsz,j, blk_size;
+  int i,bsz,j;
   u8 blk[BLOCKSIZE];
   int fdirsize;
 
@@ -458,23 +821,15 @@ int readfile(struct tfs *fs,FILE *fp,const char *path,int type,int ispipe)
 
   for (i = 0; i < fdirsize; i += BLOCKSIZE)
   {
-    bsz = read_inoblk(fs,inode,i / BLOCKSIZE,blk);
+    // The size tells how much of the last block is data, it may hold \0
+    bsz = fdirsize - i > BLOCKSIZE ? BLOCKSIZE : fdirsize - i;
 
-    if (bsz)
+    if (read_inoblk(fs,inode,i / BLOCKSIZE,blk))
     {
-    	// Search for \0
-    	for(blk_size = 0; blk[blk_size] != '\0'; blk_size++);
-
-    	if(blk_size != 0)
-    	{
-    		bsz = blk_size - 2;
-    	}
       dofwrite(fp,blk,bsz);
     }
     else
     {
-      bsz = fdirsize - i > BLOCKSIZE ? BLOCKSIZE : fdirsize % BLOCKSIZE;
-
       if (ispipe)
       {
       	for (j=0;j<bsz;j++) putc(0,fp);
@@ -506,34 +861,70 @@ void cmd_cat(struct tfs *fs,int argc,char **argv)
 }
 
 /*
- * Extract image files to a normal file
+ * Give an extracted file the mode and time of its inode
+ * @dst		- extracted file
+ * @mode	- i_mode of the inode
+ * @atime	- i_atime of the inode, also used as modification time
+ * */
+void restore_attrs(const char *dst, int mode, time_t atime)
+{
+	struct utimbuf tb;
+
+	tb.modtime = tb.actime = atime;
+
+	chmod(dst, mode & 07777);
+	utime(dst, &tb);
+}
+
+/*
+ * Extract a file to a normal file, with its mode and time
  * @fs 		- file system structure
- * @argc	- from command line
- * @argv 	- from command line
+ * @path	- file to extract
+ * @dst 	- file to write
+ * @return	- inode of the file
  * */
-void cmd_extract(struct tfs *fs,int argc,char **argv)
+int doextract(struct tfs *fs,const char *path,const char *dst)
 {
   FILE *fp;
-  struct utimbuf tb;
-  int mode,inode;
+  int inode;
 
-  fp = fopen(argv[4],"wb");
+  fp = fopen(dst,"wb");
 
   if (!fp)
   {
-  	die(argv[4]);
+  	die(dst);
+  }
+  inode = readfile(fs,fp,path,S_IFREG,0);
+
+  // A hole at the end has no bytes written
+  if (fflush(fp) || ftruncate(fileno(fp),INODE(fs,inode)->i_size))
+  {
+  	die(dst);
   }
-  inode = readfile(fs,fp,argv[3],S_IFREG,0);
+  fclose(fp);
 
   // We want to copy also the modes ...
-	struct tfs_inode *ino = INODE(fs,inode);
-	tb.modtime = tb.actime = ino->i_atime;
-	mode = ino->i_mode & 07777;
+  restore_attrs(dst, INODE(fs,inode)->i_mode, INODE(fs,inode)->i_atime);
 
-  fclose(fp);
+  return inode;
+}
 
-  chmod(argv[4],mode);
-  utime(argv[4],&tb);
+/*
+ * Extract image files to a normal file, with -r a directory tree
+ * @fs 		- file system structure
+ * @argc	- from command line
+ * @argv 	- from command line
+ * */
+void cmd_extract(struct tfs *fs,int argc,char **argv)
+{
+  if (!strcmp(argv[3], "-r"))
+  {
+  	doextract_tree(fs, argv[4], argv[5]);
+  }
+  else
+  {
+  	doextract(fs,argv[3],argv[4]);
+  }
 }
 
 /*
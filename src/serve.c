@@ -0,0 +1,425 @@
+/*
+ * Copyright (C) 2016 - Christian Jürgens <christian.textfs@gmail.com>
+ * Copyright (C) 2016 - Dirk Klingenberg <blademountain35@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * */
+
+/*
+ * Server mode
+ *
+ * "TextFS img serve /path/sock [seconds]" keeps the image open and runs
+ * the commands of clients (see client.c) that connect to a Unix domain
+ * socket. A request is a struct tfs_frame of type FRAME_REQUEST and the
+ * words of a shell command, each nul terminated. The answer is the
+ * output of the command (FRAME_OUT, FRAME_ERR) and its exit status
+ * (FRAME_STATUS).
+ *
+ * Every client has its own receive buffer, a request runs once its
+ * frame is complete: a client that stalls halfway holds up nobody.
+ * Requests run one after another, like the lines of a shell. Changes
+ * are written back by "sync", every [seconds] (default SERVE_SYNC_SECS)
+ * and at the end, after "shutdown", SIGINT or SIGTERM. Host paths of
+ * add and extract are relative to the server. A request that failed
+ * after its checks (begin_change()) is never written back, the image is
+ * read again as by the shell.
+ * */
+
+#include "protos.h"
+#include "spec_tfs.h"
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+volatile sig_atomic_t serve_stop;
+
+/*
+ * SIGINT and SIGTERM end the server
+ * @sig	- signal number
+ * */
+void serve_signal(int sig)
+{
+	serve_stop = sig;
+}
+
+/*
+ * Read what a client sent so far, one read() that does not block
+ * after poll(). It stops at the end of the frame.
+ * @c			- client
+ * @fd			- socket
+ * @return	- 0, ERROR at end of file, on error or for an invalid frame
+ * */
+int serve_receive(struct serve_client *c, int fd)
+{
+	struct tfs_frame *frame = (struct tfs_frame *) c->buf;
+	size_t want = sizeof(struct tfs_frame);
+	ssize_t r;
+
+	if (c->len >= want)
+	{
+		want += frame->len;
+	}
+	r = read(fd, c->buf + c->len, want - c->len);
+
+	if (r < 0 && errno == EINTR)
+	{
+		return 0;
+	}
+	if (r <= 0)
+	{
+		return ERROR;
+	}
+	c->len += r;
+
+	// The header tells how much follows
+	if (c->len == sizeof(struct tfs_frame)
+			&& (frame->type != FRAME_REQUEST || frame->len > SERVE_FRAME_MAX))
+	{
+		return ERROR;
+	}
+	return 0;
+}
+
+/*
+ * Write exactly n bytes
+ * @fd			- socket
+ * @buf			- buffer
+ * @n				- number of bytes
+ * @return	- 0, ERROR on error
+ * */
+int write_full(int fd, const void *buf, size_t n)
+{
+	while (n)
+	{
+		ssize_t w = write(fd, buf, n);
+
+		if (w < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (w <= 0)
+		{
+			return ERROR;
+		}
+		buf = (const char *) buf + w;
+		n -= w;
+	}
+	return 0;
+}
+
+/*
+ * Send a frame
+ * @fd			- socket
+ * @type		- frame type
+ * @data		- bytes that follow the frame header
+ * @len			- number of bytes, the exit status for FRAME_STATUS
+ * @return	- 0, ERROR on error
+ * */
+int send_frame(int fd, u32 type, const void *data, u32 len)
+{
+	struct tfs_frame frame = {type, len};
+
+	if (write_full(fd, &frame, sizeof(frame)))
+	{
+		return ERROR;
+	}
+	return type == FRAME_STATUS ? 0 : write_full(fd, data, len);
+}
+
+/*
+ * Send what a command wrote to a temporary file and empty the file
+ * @fd			- socket
+ * @type		- FRAME_OUT or FRAME_ERR
+ * @tmpFd		- temporary file
+ * @return	- 0, ERROR on error
+ * */
+int send_output(int fd, u32 type, int tmpFd)
+{
+	char buf[SERVE_FRAME_MAX];
+	off_t size = lseek(tmpFd, 0, SEEK_CUR);
+	off_t pos;
+	int rc = 0;
+
+	for (pos = 0; pos < size && !rc; pos += SERVE_FRAME_MAX)
+	{
+		ssize_t n = pread(tmpFd, buf, SERVE_FRAME_MAX, pos);
+
+		if (n <= 0)
+		{
+			die("pread");
+		}
+		rc = send_frame(fd, type, buf, n);
+	}
+	if (ftruncate(tmpFd, 0) || lseek(tmpFd, 0, SEEK_SET))
+	{
+		die("ftruncate");
+	}
+	return rc;
+}
+
+/*
+ * Run a command with stdout and stderr in temporary files
+ * @fs			- file system structure
+ * @argc		- number of words, with program and image name in front
+ * @args		- words
+ * @outFd		- temporary file for stdout
+ * @errFd		- temporary file for stderr
+ * @return	- exit status
+ * */
+int run_request(struct tfs *fs, int argc, char **args, int outFd, int errFd)
+{
+	int savedOut = dup(1), savedErr = dup(2);
+	volatile int status = EXIT_SUCCESS;
+	jmp_buf env;
+
+	fflush(stdout);
+	fflush(stderr);
+	dup2(outFd, 1);
+	dup2(errFd, 2);
+
+	if (setjmp(env))
+	{
+		release_blocks(fs);
+
+		if (*fatal_text)
+		{
+			fprintf(stderr, "%s\n", fatal_text);
+		}
+		status = EXIT_FAILURE;
+	}
+	else
+	{
+		fatal_jmp = &env;
+		fs->changing = 0;
+		shell_cmd(fs, argc, args);
+	}
+	fatal_jmp = NULL;
+
+	fflush(stdout);
+	fflush(stderr);
+	dup2(savedOut, 1);
+	dup2(savedErr, 2);
+	close(savedOut);
+	close(savedErr);
+
+	return status;
+}
+
+/*
+ * Receive a request of a client and answer it once it is complete
+ * @fs			- file system structure, replaced when the image is reloaded
+ * @fd			- socket of the client
+ * @c				- receive buffer of the client
+ * @argv		- from command line
+ * @changed	- set if the image changed since the last write back
+ * @return	- 0, ERROR if the client is gone, FINISH for "shutdown"
+ * */
+int serve_request(struct tfs **fs, int fd, struct serve_client *c, char **argv,
+									int *changed)
+{
+	static FILE *out, *err;
+	struct tfs_frame *frame = (struct tfs_frame *) c->buf;
+	char *payload = c->buf + sizeof(struct tfs_frame);
+	char *args[SHELL_MAX_ARGS];
+	int n = 2, status;
+	u32 i;
+
+	if (!out && (!(out = tmpfile()) || !(err = tmpfile())))
+	{
+		die("tmpfile");
+	}
+	if (serve_receive(c, fd))
+	{
+		return ERROR;
+	}
+	if (c->len < sizeof(struct tfs_frame)
+			|| c->len < sizeof(struct tfs_frame) + frame->len)
+	{
+		return 0;
+	}
+	// The next request starts over
+	c->len = 0;
+	payload[frame->len] = 0;
+
+	for (i = 0; i < frame->len && n < SHELL_MAX_ARGS; i += strlen(payload + i) + 1)
+	{
+		args[n++] = payload + i;
+	}
+	if (n == 2)
+	{
+		return send_frame(fd, FRAME_STATUS, NULL, EXIT_SUCCESS);
+	}
+	args[0] = argv[0];
+	args[1] = argv[1];
+
+	if (!strcmp(args[2], "shutdown"))
+	{
+		send_frame(fd, FRAME_STATUS, NULL, EXIT_SUCCESS);
+		return FINISH;
+	}
+	*changed = strcmp(args[2], "sync") && (*changed || !readonly_cmd(args[2]));
+	status = run_request(*fs, n, args, fileno(out), fileno(err));
+
+	if (status && (*fs)->changing)
+	{
+		// The changes of the other clients since the last write back go too
+		*fs = reload_fs(*fs, argv[1]);
+		*changed = 0;
+		dprintf(fileno(err), "%s: image reloaded, changes since the last sync are lost\n",
+						argv[1]);
+	}
+
+	// Both files are emptied for the next request
+	if (send_output(fd, FRAME_OUT, fileno(out)) | send_output(fd, FRAME_ERR, fileno(err)))
+	{
+		return ERROR;
+	}
+	return send_frame(fd, FRAME_STATUS, NULL, status);
+}
+
+/*
+ * Listen on a Unix domain socket
+ * @path		- socket path, an old socket is removed
+ * @return	- socket
+ * */
+int serve_socket(const char *path)
+{
+	struct sockaddr_un addr = {0};
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (fd < 0)
+	{
+		die("socket");
+	}
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		fatalmsg("%s: socket path too long", path);
+	}
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) || listen(fd, SERVE_MAX_CLIENTS))
+	{
+		die(path);
+	}
+	return fd;
+}
+
+/*
+ * Command to serve an image on a Unix domain socket
+ * @argc	- from command line
+ * @argv	- from command line, argv[3] is the socket, argv[4] the seconds
+ * 					between write backs
+ * */
+void cmd_serve(int argc, char **argv)
+{
+	struct pollfd fds[SERVE_MAX_CLIENTS + 1];
+	struct serve_client *clients[SERVE_MAX_CLIENTS + 1];
+	struct timeval sendTimeout = {SERVE_SEND_SECS, 0};
+	struct sigaction sa = {0};
+	int secs = argc > 4 ? atoi(argv[4]) : SERVE_SYNC_SECS;
+	int nfds = 1, changed = 0, i;
+	time_t synced = time(NULL);
+	struct tfs *fs;
+
+	if (secs <= 0)
+	{
+		fatalmsg("%s: invalid seconds", argv[4]);
+	}
+	fs = open_fs(argv[1], TFS_READ_WRITE
+												| (getenv("TEXTFS_ARENA") ? TFS_ARENA : 0));
+
+	sa.sa_handler = serve_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	fds[0].fd = serve_socket(argv[3]);
+	fds[0].events = POLLIN;
+
+	while (!serve_stop)
+	{
+		int ready = poll(fds, nfds, secs * 1000);
+
+		if (ready < 0 && errno != EINTR)
+		{
+			die("poll");
+		}
+		// At most every secs seconds, and at most secs after a change
+		if (changed && time(NULL) - synced >= secs)
+		{
+			sync_fs(fs);
+			changed = 0;
+			synced = time(NULL);
+		}
+		if (ready <= 0)
+		{
+			continue;
+		}
+		for (i = nfds - 1; i > 0 && !serve_stop; i--)
+		{
+			int rc;
+
+			if (!fds[i].revents)
+			{
+				continue;
+			}
+			rc = serve_request(&fs, fds[i].fd, clients[i], argv, &changed);
+
+			if (rc == FINISH)
+			{
+				serve_stop = SIGTERM;
+			}
+			if (rc)
+			{
+				// The last client takes the place of a closed one
+				close(fds[i].fd);
+				free(clients[i]);
+				clients[i] = clients[--nfds];
+				fds[i] = fds[nfds];
+			}
+		}
+		if (fds[0].revents & POLLIN)
+		{
+			int fd = accept(fds[0].fd, NULL, NULL);
+
+			if (fd >= 0 && nfds == SERVE_MAX_CLIENTS + 1)
+			{
+				close(fd);
+			}
+			else if (fd >= 0)
+			{
+				setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+				clients[nfds] = domalloc(sizeof(struct serve_client), -1);
+				clients[nfds]->len = 0;
+				fds[nfds].fd = fd;
+				fds[nfds++].events = POLLIN;
+			}
+		}
+	}
+	for (i = 0; i < nfds; i++)
+	{
+		close(fds[i].fd);
+
+		if (i)
+		{
+			free(clients[i]);
+		}
+	}
+	unlink(argv[3]);
+	close_fs(fs);
+}
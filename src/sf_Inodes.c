@@ -31,7 +31,7 @@ int get_block_size(struct tfs *fs, int blockID)
 	{
 		char *ptr, *ptr2;
 
-		ptr = goto_Block(fs->virtualFS,	blockID);
+		ptr = goto_Block(fs,	blockID);
 		ptr2 = strstr(ptr, "\n\n");
 
 		return ptr2 - ptr;
@@ -53,7 +53,7 @@ int get_block(char *block, struct tfs *fs, int blockID, int size)
 	{
 		char *ptr;
 
-		ptr = goto_Block(fs->virtualFS,	blockID);
+		ptr = goto_Block(fs,	blockID);
 
 		int i;
 		for (i = 0; i < size; i++)
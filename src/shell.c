@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2016 - Christian Jürgens <christian.textfs@gmail.com>
+ * Copyright (C) 2016 - Dirk Klingenberg <blademountain35@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * */
+
+/*
+ * Shell and batch mode
+ *
+ * The image is opened once, then every line is a command with the
+ * arguments it takes on the command line, e.g. "mkdir /dir" or
+ * "add file /dir/". All commands work on the same struct tfs, the
+ * image is written back by "sync" and at the end.
+ *
+ * fatalmsg() returns to the loop: the shell goes on with the next
+ * line, a batch stops and leaves the image as of the last "sync". A
+ * command that failed after its checks (begin_change()) may have left
+ * the structure half changed, the shell then reads the image again.
+ * */
+
+#include "protos.h"
+#include "spec_tfs.h"
+
+/*
+ * Split a command line into words, "..." quotes blanks
+ * @line		- command line, changed in place
+ * @args		- set to the words
+ * @max			- size of args
+ * @return	- number of words
+ * */
+int split_cmdline(char *line, char **args, int max)
+{
+	int n = 0;
+
+	while (n < max)
+	{
+		char *word;
+
+		while (*line == ' ' || *line == '\t' || *line == '\n' || *line == '\r')
+		{
+			line++;
+		}
+		if (!*line || *line == '#')
+		{
+			break;
+		}
+		if (*line == '"')
+		{
+			word = ++line;
+
+			while (*line && *line != '"')
+			{
+				line++;
+			}
+		}
+		else
+		{
+			word = line;
+
+			while (*line && !strchr(" \t\n\r", *line))
+			{
+				line++;
+			}
+		}
+		args[n++] = word;
+
+		if (*line)
+		{
+			*line++ = 0;
+		}
+	}
+	return n;
+}
+
+/*
+ * Print the prompt when the commands come from a terminal
+ * @in	- command input
+ * */
+void shell_prompt(FILE *in)
+{
+	if (isatty(fileno(in)))
+	{
+		printf("tfs> ");
+		fflush(stdout);
+	}
+}
+
+/*
+ * Run one command of a shell, a batch or a client of the server
+ * @fs		- file system structure
+ * @argc	- number of words, with program and image name in front
+ * @args	- words
+ * */
+void shell_cmd(struct tfs *fs, int argc, char **args)
+{
+	if (!strcmp(args[2], "sync"))
+	{
+		sync_fs(fs);
+	}
+	else if (!strcmp(args[2], "help"))
+	{
+		printUsage(args[0]);
+	}
+	else if (!strcmp(args[2], "mkfs") || !strcmp(args[2], "shell")
+					 || !strcmp(args[2], "batch") || !strcmp(args[2], "serve")
+					 || !strcmp(args[2], "sfml") || !strcmp(args[2], "pentest"))
+	{
+		fatalmsg("%s: not possible on an open image", args[2]);
+	}
+	else if (argc < 4 && strcmp(args[2], "df"))
+	{
+		usage(args[0], args[2]);
+	}
+	else if (!fs_cmd(fs, argc, args))
+	{
+		fatalmsg("%s: unknown command", args[2]);
+	}
+}
+
+/*
+ * Command to run many commands on one open image
+ * @argc	- from command line
+ * @argv	- from command line, argv[3] is the script for batch, "-" for stdin
+ * */
+void cmd_shell(int argc, char **argv)
+{
+	int batch = !strcmp(argv[2], "batch");
+	FILE *in = stdin;
+	char line[SHELL_LINE_SIZE];
+	char *args[SHELL_MAX_ARGS];
+	volatile int lineNr = 0;
+	jmp_buf env;
+	struct tfs *volatile fs;
+	int n;
+
+	if (batch && strcmp(argv[3], "-") && !(in = fopen(argv[3], "r")))
+	{
+		die(argv[3]);
+	}
+	fs = open_fs(argv[1], TFS_READ_WRITE
+												| (getenv("TEXTFS_ARENA") ? TFS_ARENA : 0));
+
+	if (setjmp(env))
+	{
+		release_blocks(fs);
+
+		if (*fatal_text)
+		{
+			fprintf(stderr, "%s\n", fatal_text);
+		}
+		if (batch)
+		{
+			fprintf(stderr, "%s:%d: command failed, image not written back\n",
+							argv[3], lineNr);
+			exit(ERROR);
+		}
+		if (fs->changing)
+		{
+			// An error here is not caught
+			fatal_jmp = NULL;
+			fs = reload_fs(fs, argv[1]);
+			fprintf(stderr, "%s: image reloaded, changes since the last sync are lost\n",
+							argv[1]);
+		}
+	}
+	fatal_jmp = &env;
+
+	for (shell_prompt(in); fgets(line, sizeof(line), in); shell_prompt(in))
+	{
+		lineNr++;
+
+		if (!strchr(line, '\n') && !feof(in))
+		{
+			int c;
+
+			// The rest of the line is no command
+			while ((c = getc(in)) != EOF && c != '\n');
+
+			fatalmsg("line %d: too long", lineNr);
+		}
+		n = split_cmdline(line, args + 2, SHELL_MAX_ARGS - 2) + 2;
+
+		if (n == 2)
+		{
+			continue;
+		}
+		args[0] = argv[0];
+		args[1] = argv[1];
+
+		if (!strcmp(args[2], "quit") || !strcmp(args[2], "exit"))
+		{
+			break;
+		}
+		shell_cmd(fs, n, args);
+		fs->changing = 0;
+		fflush(stdout);
+	}
+	fatal_jmp = NULL;
+
+	if (in != stdin)
+	{
+		fclose(in);
+	}
+	close_fs(fs);
+}
@@ -111,7 +111,4 @@ void initRootBlock(struct tfs *fs, char *rootblk, unsigned long rootblkp)
 		strcpy(rootblk + 2, ".");
 		*((short *) (rootblk + DIRSIZE(fs))) = TFS_ROOT_INO;
 		strcpy(rootblk + 2 + DIRSIZE(fs), "..");
-
-		fprintf(fs->fp, "block-id: %lu\n", rootblkp);
-		fprintf(fs->fp, "Fragment-Type: index-block\n");
 }
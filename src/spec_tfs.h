@@ -28,10 +28,13 @@
 #include <stdio.h>
 #include "bitops.h"
 #include <string.h>
+#include <sys/types.h>
+#include <pthread.h>
 
 typedef unsigned char u8;
 typedef unsigned short u16;
 typedef unsigned int u32;
+typedef unsigned long long u64;
 
 #define VERSION "1.0, 2016"
 #define ZB_POSITION 0
@@ -57,9 +60,11 @@ typedef unsigned int u32;
 #define DOUBLE_INDIRECT_BLOCK 2
 #define INDEX_OR_DATA_BLOCK 3
 #define INDEX_BLOCK 4
+#define DIR_LEAF_BLOCK 5
 #define KEY_SIZE 32
 #define VALUE_SIZE 32
 #define DATA_LINE_WIDTH 75
+#define DATA_TEXT_SIZE ((BLOCKSIZE / 16) * (DATA_LINE_WIDTH - 1) + 1)
 #define FINISH 1
 #define ENDLINE 1
 #define DATABEGIN	2
@@ -74,25 +79,66 @@ typedef unsigned int u32;
 #define BITS_PER_BLOCK	(BLOCKSIZE << 3) // BLOCKSIZE * 8
 #define INODES_PER_BLOCK 1
 #define TFS_VALID 0x0001
+#define TFS_READ_WRITE 0
+#define TFS_READ_ONLY 1
+#define TFS_ARENA 2										// open_fs() flag, see arena.c
 
 #define ADRESSES_PER_BLOCK	(BLOCKSIZE/sizeof(u16))
+#define MAX_FILE_BLOCKS (NR_OF_DIREKT_ZONES + ADRESSES_PER_BLOCK + ADRESSES_PER_BLOCK * ADRESSES_PER_BLOCK)
 
 // round off, only whole inodes..
 #define UPPER(size,bitsPerBlock) ( ( size + bitsPerBlock - 1 ) / bitsPerBlock )
 #define INODE_BLOCKS(fs) UPPER((fs)->sb->nInodes, INODES_PER_BLOCK)
 #define INODE_BUFFER_SIZE(fs) (INODE_BLOCKS(fs) * BLOCKSIZE)
 #define NORM_FIRSTZONE(fs) (2+ ((fs)->sb->imap_sizeInBlocks) + ((fs)->sb->zmap_sizeInBlocks) + INODE_BLOCKS(fs))
-#define DIRSIZE(fs) 32
+#define DIRENT_SIZE 32
+#define DIRSIZE(fs) DIRENT_SIZE
+#define DIRNAME_SIZE 30											// name bytes of a directory entry
+#define DIR_INDEX_BUCKETS 1024							// hash buckets per directory index
+#define DENTRY_SLOTS 4096										// entries in the dentry cache
+#define BTREE_MAGIC 0x7442									// "Bt" in a B-tree directory node
+#define BTREE_LEAF 1
+#define BTREE_NODE 2
+#define BTREE_ENTRIES (BLOCKSIZE / DIRENT_SIZE - 1)	// entries after the node header
+#define BTREE_MAX_DEPTH 16
+#define FATAL_TEXT_SIZE 1024								// error message of fatalmsg() and die()
+#define PATH_SIZE 64												// paths split by make_node() and dounlink()
+#define SHELL_LINE_SIZE 1024								// command line in shell and batch mode
+#define SHELL_MAX_ARGS 64
+#define SERVE_MAX_CLIENTS 16
+#define SERVE_FRAME_MAX 65536								// bytes after a frame header
+#define SERVE_SYNC_SECS 5
+#define SERVE_SEND_SECS 10									// a client that does not read its answer is dropped
+#define FRAME_REQUEST 1
+#define FRAME_OUT 2
+#define FRAME_ERR 3
+#define FRAME_STATUS 4
+#define BTREE_HEADER(blk) ((struct tfs_btree_header *) (blk))
+#define BTREE_ENTRY(blk,i) ((blk) + ((i) + 1) * DIRENT_SIZE)
 #define INODE(fs,inodep) ((fs)->inode + ((inodep)-1))
-#define mark_inode(fs,blockID) (setbit((char*)(fs)->inode_bmap,(blockID - 1)))
-#define unmark_inode(fs,blockID) (clrbit((char*)(fs)->inode_bmap,(blockID - 1)))
-#define mark_zone(fs,datazone) (setbit((char*)(fs)->zone_bmap,(datazone)-((fs)->sb->firstdatazone)))
-#define mark_zone_new(fs,datazone) (setbit((char*)(fs)->zone_bmap,(datazone)))
-#define unmark_zone(fs,x) (clrbit((char*)(fs)->zone_bmap,(x)-((fs)->sb->firstdatazone)))
-#define unmark_zone_new(fs,datazone) (clrbit((char*)(fs)->zone_bmap,(datazone)))
-#define get_free_inode(fs) get_free_bit((fs)->inode_bmap,(fs)->sb->imap_sizeInBlocks) + 1
-#define get_free_block(fs) ( get_free_bit( (fs)->zone_bmap, (fs)->sb->zmap_sizeInBlocks )	+ ((fs)->sb->firstdatazone) )
+#define mark_inode(fs,blockID) ((fs)->free_inodes -= !setbit((char*)(fs)->inode_bmap,(blockID - 1)))
+#define unmark_inode(fs,blockID) ((fs)->free_inodes += clrbit((char*)(fs)->inode_bmap,(blockID - 1)))
+#define mark_zone(fs,datazone) ((fs)->free_zones -= !setbit((char*)(fs)->zone_bmap,(datazone)-((fs)->sb->firstdatazone)))
+#define mark_zone_new(fs,datazone) ((fs)->free_zones -= !setbit((char*)(fs)->zone_bmap,(datazone)))
+#define unmark_zone(fs,x) ((fs)->free_zones += clrbit((char*)(fs)->zone_bmap,(x)-((fs)->sb->firstdatazone)))
+#define unmark_zone_new(fs,datazone) ((fs)->free_zones += clrbit((char*)(fs)->zone_bmap,(datazone)))
+#define get_free_inode(fs) get_free_bit((fs)->inode_bmap,(fs)->sb->imap_sizeInBlocks,&(fs)->inode_cursor) + 1
+#define get_free_block(fs) ( get_free_bit( (fs)->zone_bmap, (fs)->sb->zmap_sizeInBlocks, &(fs)->zone_cursor )	+ ((fs)->sb->firstdatazone) )
 #define NOW ((u32)-1)
+#define NO_OFFSET ((unsigned long)-1)
+#define NO_COUNT ((unsigned long)-1)
+#define CREATE_SLOTS 512						// empty slots written at once by createFile
+#define SLOT_OFFSET(blk) ((off_t) (blk) * BLOCKSIZE_BRUTTO)
+#define mark_dirty(fs,blk) (setbit((char*)(fs)->dirty_bmap,(blk)))
+// A mutator calls it after its checks, a later error leaves the image half changed
+#define begin_change(fs) ((fs)->changing = 1)
+#define DEFAULT_CACHE_KB 1024				// decoded block cache, see block_cache.c
+#define ARENA_THREADS 8							// most threads decoding the arena
+#define ARENA_MIN_BLOCKS 256				// fewest blocks per arena thread
+#define ARENA_BLOCK(fs,blk) ((fs)->arena + (unsigned long) (blk) * BLOCKSIZE)
+#define ADD_THREADS 8								// most threads reading files for "add -r"
+#define ADD_WINDOW 64								// entries read ahead of the committer
+#define EXTRACT_THREADS 8						// most threads writing files for "extract -r"
 
 /*
  * Bootblock configuration
@@ -146,6 +192,184 @@ struct tfs_inode
 	u32 _unused;
 };
 
+/*
+ * Decoded data block in the block cache
+ * */
+struct tfs_cached_block
+{
+	unsigned long blk;
+	int prev;											// more recently used entry
+	int next;											// less recently used entry
+	u8 data[BLOCKSIZE];
+};
+
+/*
+ * LRU cache of decoded data blocks
+ * */
+struct tfs_block_cache
+{
+	struct tfs_cached_block *entry;
+	unsigned long nEntries;				// budget in blocks
+	unsigned long used;						// entries in use
+	int *slot;										// block-id -> entry, ERROR if not cached
+	unsigned long nSlots;
+	int head;											// most recently used
+	int tail;											// least recently used
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+};
+
+/*
+ * Name in a directory index
+ * */
+struct tfs_dir_entry
+{
+	char name[DIRNAME_SIZE + 1];
+	u16 inode;
+	u32 hash;
+	u32 pos;											// byte position in the directory
+	int next;											// next entry in the bucket or free list
+};
+
+/*
+ * Hash index of a directory, see dir_index.c
+ * */
+struct tfs_dir_index
+{
+	int bucket[DIR_INDEX_BUCKETS];				// first entry, ERROR if empty
+	struct tfs_dir_entry *entry;
+	unsigned long nEntries;
+	unsigned long maxEntries;
+	int freeEntry;								// removed entries for reuse
+	u8 *holes;										// free entry positions
+	unsigned long holeBytes;
+};
+
+/*
+ * Path component in the dentry cache, see dcache.c
+ * */
+struct tfs_dentry
+{
+	int parent;										// directory inode, 0: slot unused
+	int inode;										// ERROR: name does not exist
+	u32 hash;
+	char name[DIRNAME_SIZE + 1];
+};
+
+/*
+ * Header of a B-tree directory node, takes the place of the first entry
+ * */
+struct tfs_btree_header
+{
+	u16 zero;											// inode field of an entry, always 0
+	u16 magic;										// BTREE_MAGIC
+	u16 type;											// BTREE_LEAF or BTREE_NODE
+	u16 count;										// entries in use
+	u16 next;											// leaves: file block of the next leaf, 0: last
+	u8 unused[DIRENT_SIZE - 10];
+};
+
+/*
+ * Header of a message between server and client, see serve.c
+ * */
+struct tfs_frame
+{
+	u32 type;											// FRAME_REQUEST, FRAME_OUT, FRAME_ERR or FRAME_STATUS
+	u32 len;											// bytes that follow, FRAME_STATUS: exit status
+};
+
+/*
+ * Request of a client as far as it is received, see serve_receive()
+ * */
+struct serve_client
+{
+	u32 len;											// bytes in buf
+	char buf[sizeof(struct tfs_frame) + SERVE_FRAME_MAX + 1];
+};
+
+/*
+ * Blocks handled by one arena thread
+ * */
+struct arena_job
+{
+	struct tfs *fs;
+	unsigned long *blocks;				// block-ids, NULL: all blocks from first
+	unsigned long first;
+	unsigned long n;
+	unsigned long done;
+};
+
+/*
+ * Host file, directory or symlink of "add -r", see add_tree.c
+ * */
+struct add_entry
+{
+	char *src;										// host path
+	char path[PATH_SIZE];					// path in the image
+	mode_t mode;
+	unsigned long size;						// from lstat, the bytes read once ready
+	time_t atime;
+	time_t mtime;
+	time_t ctime;
+	u8 *data;											// file blocks, read by a worker
+	char *text;										// hex lines of the blocks, NULL with TFS_ARENA
+	int textLen;									// characters per block in text
+	int err;											// errno of the worker
+	int ready;
+};
+
+/*
+ * Entries of "add -r", shared by the workers and the committer
+ * */
+struct add_tree
+{
+	struct tfs *fs;
+	struct add_entry *entries;
+	unsigned long n;
+	unsigned long size;						// allocated entries
+	unsigned long next;						// next entry for a worker
+	unsigned long committed;			// entries in the image
+	unsigned long files;					// regular files
+	int stop;											// the committer failed
+	pthread_mutex_t lock;
+	pthread_cond_t cond;					// an entry is ready or committed
+	pthread_t threads[ADD_THREADS];
+	int nThreads;									// workers started
+};
+
+/*
+ * Image file, directory or symlink of "extract -r", see extract_tree.c
+ * */
+struct extract_entry
+{
+	char *dst;										// host path
+	int inode;
+	mode_t mode;
+	time_t atime;									// also the modification time, as in doextract()
+	unsigned long size;
+	u32 *map;											// block-ids of a regular file, 0 for holes
+	int err;											// errno of the worker
+	unsigned long badBlock;				// block-id that did not decode
+};
+
+/*
+ * Entries of "extract -r", shared by the workers
+ * */
+struct extract_tree
+{
+	struct tfs *fs;
+	struct extract_entry *entries;
+	unsigned long n;
+	unsigned long size;						// allocated entries
+	unsigned long next;						// next entry for a worker
+	unsigned long files;					// regular files
+	const char *parent;						// host directory of the entries being listed
+	pthread_mutex_t lock;
+	pthread_t threads[EXTRACT_THREADS];
+	int nThreads;									// workers started
+};
+
 /*
  * Text file system configuration
  * */
@@ -153,11 +377,44 @@ struct tfs
 {
 	FILE *fp;
 	char *virtualFS;
+	unsigned long virtualLength;				// strlen(virtualFS)
+	unsigned long mappedLength;					// bytes mapped at virtualFS, 0: malloc()ed
+	unsigned long *blockOffset;					// block-id -> offset of "block-id: " line
+	unsigned long *dataOffset;					// block-id -> offset of "000:" line
+	unsigned long nBlockOffsets;				// entries in blockOffset/dataOffset
+	unsigned long slotSize;							// BLOCKSIZE_BRUTTO: block N at N * slotSize, 0: packed
+	u8 *dirty_bmap;											// blocks to write back on close_fs
 	struct tfs_bootblock *bb;
 	struct tfs_superblock *sb;
 	struct tfs_inode *inode;
 	u8 *inode_bmap;
 	u8 *zone_bmap;								// Free Blocks in Bitmap
+	unsigned long inode_cursor;		// next-fit start in inode_bmap
+	unsigned long zone_cursor;		// next-fit start in zone_bmap
+	unsigned long free_inodes;		// clear bits in inode_bmap
+	unsigned long free_zones;			// clear bits in zone_bmap
+	unsigned long *resv;					// blocks reserved for resv_inode, see alloc_zone()
+	unsigned long nResv;
+	int resv_inode;
+	u32 **blockMap;								// inode -> cached block-ids, see cached_block_map()
+	u32 *blockMapLen;							// entries in blockMap[inode]
+	u32 *writeMap;								// block map of the file being written, see write_map()
+	u32 writeMapLen;
+	unsigned long map_hits;
+	unsigned long map_misses;
+	struct tfs_block_cache *cache;				// decoded blocks, see block_cache.c
+	u8 *arena;										// all decoded blocks with TFS_ARENA
+	u8 *arenaValid;								// block-id -> block is in the arena
+	unsigned long arenaBlocks;				// blocks decoded by open_fs()
+	struct tfs_dir_index **dirIndex;		// inode -> directory index, see dir_index.c
+	struct tfs_dentry *dcache;					// DENTRY_SLOTS path components, see dcache.c
+	unsigned long dcache_hits;
+	unsigned long dcache_negative;			// hits on names that do not exist
+	unsigned long dcache_misses;
+	unsigned long dcache_invalidations;
+	int readOnly;									// TFS_READ_ONLY: never written back
+	int changing;									// a command passed its checks, see begin_change()
+	char error[FATAL_TEXT_SIZE];				// message of the last failed libtextfs call
 
 };
 
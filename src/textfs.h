@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2016 - Christian Jürgens <christian.textfs@gmail.com>
+ * Copyright (C) 2016 - Dirk Klingenberg <blademountain35@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * */
+
+/*
+ * libtextfs: interface for programs that link the file system code
+ * (make libtextfs.a or make libtextfs.so)
+ *
+ * An image is opened as a handle. The calls return TFS_OK or an error
+ * code, tfs_error() gives the message. A handle must only be used by
+ * one thread at a time, different handles work in parallel. After an
+ * error of a call that changes the image, close the handle without
+ * writing it back.
+ * */
+
+#ifndef TEXTFS_H_
+#define TEXTFS_H_
+
+#define TFS_OK 0
+#define TFS_EFAIL -1										// operation failed, see tfs_error()
+#define TFS_ESYS -2											// system call failed, see tfs_error()
+#define TFS_ENOENT -3										// path not found
+#define TFS_EEXIST -4										// path exists already
+#define TFS_EINVAL -5										// invalid argument or read-only handle
+
+// Flags of tfs_open()
+#define TFS_OPEN_READ_ONLY 1						// never written back
+#define TFS_OPEN_ARENA 2								// decode all blocks at once
+
+struct tfs;
+
+/*
+ * Entry of tfs_stat()
+ * */
+struct tfs_stat
+{
+	int inode;
+	int mode;												// type and permissions, as st_mode
+	int nlinks;
+	unsigned long size;
+	unsigned long atime;
+	unsigned long mtime;
+	unsigned long ctime;
+};
+
+int tfs_mkfs(const char *image, unsigned long blocks, int inodes);
+struct tfs *tfs_open(const char *image, int flags, int *err);
+int tfs_sync(struct tfs *fs);
+int tfs_close(struct tfs *fs, int writeBack);
+const char *tfs_error(struct tfs *fs);
+int tfs_mkdir(struct tfs *fs, const char *path, int btree);
+int tfs_rmdir(struct tfs *fs, const char *path);
+int tfs_unlink(struct tfs *fs, const char *path);
+int tfs_add(struct tfs *fs, const char *src, const char *dir);
+int tfs_extract(struct tfs *fs, const char *path, const char *dst);
+int tfs_symlink(struct tfs *fs, const char *target, const char *path);
+int tfs_link(struct tfs *fs, const char *target, const char *path);
+int tfs_stat(struct tfs *fs, const char *path, struct tfs_stat *st);
+int tfs_readdir(struct tfs *fs, const char *path,
+								int (*fn)(const char *name, int inode, void *arg), void *arg);
+
+#endif /* TEXTFS_H_ */
@@ -22,35 +22,157 @@
 #include "protos.h"
 #include "spec_tfs.h"
 
+// Set by shell, server and libtextfs calls: fatalmsg() and die() return there
+__thread jmp_buf *fatal_jmp;
+
+// Message of the last fatalmsg() or die()
+__thread char fatal_text[FATAL_TEXT_SIZE];
+
 /*
- * Find a free bit in map
+ * Load 64 bits of a bitmap, bit 0 is bit 0 of the first byte
+ * @bmap		- bitmap
+ * @word		- word number
+ * @return	- bits of the word
+ * */
+u64 load_bmap_word(const u8 *bmap, unsigned long word)
+{
+	const u8 *ptr = bmap + (word << 3);
+	u64 val = 0;
+	int i;
+
+	for (i = 7; i >= 0; i--)
+	{
+		val = (val << 8) | ptr[i];
+	}
+	return val;
+}
+
+/*
+ * Find the next set or clear bit in map
+ * @bmap 		- bitmap to scan, a multiple of 64 bits long
+ * @nbits		- bits in bitmap
+ * @nr			- first bit to look at
+ * @set			- 1 to find a set bit, 0 to find a clear bit
+ * @return	- bit number or nbits if there is none
+ * */
+unsigned long find_next_bit(const u8 *bmap, unsigned long nbits,
+														unsigned long nr, int set)
+{
+	u64 word;
+
+	while (nr < nbits)
+	{
+		word = load_bmap_word(bmap, nr >> 6);
+
+		if (!set)
+		{
+			word = ~word;
+		}
+		word &= ~0ULL << (nr & 63);
+
+		if (word)
+		{
+			nr = (nr & ~63UL) + __builtin_ctzll(word);
+			return nr < nbits ? nr : nbits;
+		}
+		nr = (nr | 63) + 1;
+	}
+	return nbits;
+}
+
+/*
+ * Find n consecutive free bits in map, next-fit from cursor
  * @bmap 		- bitmap to scan
  * @bsize 	- bitmap size in blocks
- * @return	- the bit number of the found block
- */
-unsigned long get_free_bit(u8 *bmap, int bsize)
+ * @cursor	- where the last search stopped, moved behind the found bits
+ * @n				- number of bits
+ * @return	- the first bit number of the found bits or ERROR
+ * */
+unsigned long find_free_bits(u8 *bmap, int bsize, unsigned long *cursor,
+														 unsigned long n)
 {
-	int i;
-	int j;
+	unsigned long nbits = (unsigned long) bsize * BITS_PER_BLOCK;
+	unsigned long start = *cursor < nbits ? *cursor : 0;
+	unsigned long from = start, limit = nbits;
+	unsigned long first, last;
+	int pass;
 
-	for (i = 0; i < bsize * BLOCKSIZE; i++)
+	// From the cursor to the end, then wrap around
+	for (pass = 0; pass < 2; pass++, from = 0, limit = start)
 	{
-		if (bmap[i] != 0xff)
+		while ((first = find_next_bit(bmap, nbits, from, 0)) < limit)
 		{
-			for (j = 0; j < 8; j++)
+			// Only look as far as the run has to reach
+			last = find_next_bit(bmap, first + n < nbits ? first + n : nbits, first, 1);
+
+			if (last - first >= n)
 			{
-				if ((bmap[i] & (1 << j)) == 0)
-				{
-					return (i << 3) + j;
-				}
+				*cursor = first + n;
+				return first;
 			}
-			die("Internal error!");
+			from = last;
 		}
 	}
-	fatalmsg("No free slots in bitmap found");
 	return ERROR;
 }
 
+/*
+ * Find the best fitting free run in map: the shortest run of at least
+ * n bits, else the longest run
+ * @bmap 		- bitmap to scan
+ * @bsize 	- bitmap size in blocks
+ * @n				- wanted number of bits
+ * @len			- set to the usable length of the run, at most n
+ * @return	- the first bit number of the run
+ * */
+unsigned long find_best_fit(u8 *bmap, int bsize, unsigned long n,
+														unsigned long *len)
+{
+	unsigned long nbits = (unsigned long) bsize * BITS_PER_BLOCK;
+	unsigned long first, last, runLen, from = 0;
+	unsigned long best = ERROR, bestLen = 0;
+
+	while ((first = find_next_bit(bmap, nbits, from, 0)) < nbits)
+	{
+		last = find_next_bit(bmap, nbits, first, 1);
+		runLen = last - first;
+
+		// Prefer the shortest run that fits, else the longest one
+		if ((runLen >= n && (bestLen < n || runLen < bestLen))
+				|| (runLen < n && runLen > bestLen))
+		{
+			best = first;
+			bestLen = runLen;
+		}
+		from = last;
+	}
+	if (best == ERROR)
+	{
+		fatalmsg("No free slots in bitmap found");
+	}
+	*len = bestLen < n ? bestLen : n;
+
+	return best;
+}
+
+/*
+ * Find a free bit in map
+ * @bmap 		- bitmap to scan
+ * @bsize 	- bitmap size in blocks
+ * @cursor	- next-fit cursor of the bitmap
+ * @return	- the bit number of the found block
+ */
+unsigned long get_free_bit(u8 *bmap, int bsize, unsigned long *cursor)
+{
+	unsigned long nr = find_free_bits(bmap, bsize, cursor, 1);
+
+	if (nr == ERROR)
+	{
+		fatalmsg("No free slots in bitmap found");
+	}
+	return nr;
+}
+
 /*
  * Allocate memory (w/error handling) and memory clearing.
  * @size 		- number of bytes to allocate
@@ -75,15 +197,21 @@ void *domalloc(unsigned long size, int defaultValToBeSet)
 
 /*
  * Print an error message and die.
+ * With fatal_jmp set the message is only kept in fatal_text.
  * @s - string format
  * */
 void fatalmsg(const char *s, ...)
 {
 	va_list p;
 	va_start(p, s);
-	vfprintf(stderr, s, p);
+	vsnprintf(fatal_text, sizeof(fatal_text), s, p);
 	va_end(p);
-	putc('\n', stderr);
+
+	if (fatal_jmp)
+	{
+		longjmp(*fatal_jmp, TFS_EFAIL);
+	}
+	fprintf(stderr, "%s\n", fatal_text);
 	exit(ERROR);
 }
 
@@ -93,29 +221,39 @@ void fatalmsg(const char *s, ...)
  * */
 void die(const char *s, ...)
 {
+	int err = errno;
+	int len;
 	va_list p;
 	va_start(p, s);
-	vfprintf(stderr, s, p);
+	len = vsnprintf(fatal_text, sizeof(fatal_text), s, p);
 	va_end(p);
-	putc(':', stderr);
-	putc(' ', stderr);
-	perror(NULL);
-	putc('\n', stderr);
-	exit(errno);
+
+	if (len < sizeof(fatal_text))
+	{
+		snprintf(fatal_text + len, sizeof(fatal_text) - len, ": %s", strerror(err));
+	}
+	if (fatal_jmp)
+	{
+		longjmp(*fatal_jmp, TFS_ESYS);
+	}
+	fprintf(stderr, "%s\n\n", fatal_text);
+	exit(err);
 }
 
 /*
  * Create file with specified size
  * - Open file
  * - check for opening failure
- * - set file pointer on right position
- * - put 0 on the last position
+ * - fill every block slot with spaces and a newline,
+ *   CREATE_SLOTS slots with one write
  * @fs	-	file system structure
  * @fn	- file system name
  */
 void createFile(struct tfs *fs, const char *fn)
 {
-	unsigned long i;
+	unsigned long blk, n;
+	unsigned long nBlocks = fs->sb->fs_sizeInBlocks;
+	char *slots;
 
 	fs->fp = fopen(fn, "w+b");
 
@@ -123,15 +261,16 @@ void createFile(struct tfs *fs, const char *fn)
 	{
 		die(fn);
 	}
-	for (i = 0; i < fs->sb->fs_sizeInBlocks * BLOCKSIZE_BRUTTO - 1; i++)
-	{
-		putc(' ', fs->fp);
-	}
-	if (fseek(fs->fp, fs->sb->fs_sizeInBlocks * BLOCKSIZE_BRUTTO - 1, SEEK_SET))
+	// Kept as virtualFS, free_memory() frees it after a write error
+	slots = fs->virtualFS = domalloc(CREATE_SLOTS * BLOCKSIZE_BRUTTO, -1);
+	frameVirtualSlots(slots, 0, CREATE_SLOTS * BLOCKSIZE_BRUTTO);
+
+	for (blk = 0; blk < nBlocks; blk += n)
 	{
-		die("fseek");
+		n = nBlocks - blk < CREATE_SLOTS ? nBlocks - blk : CREATE_SLOTS;
+		writeSlots(fs, slots, blk, n);
 	}
-	fflush(fs->fp);
+	releaseVirtualFS(fs);
 }
 
 /*
@@ -147,7 +286,6 @@ void *dofwrite(FILE *fp, void *buff, int cnt)
 	{
 		die("fwrite");
 	}
-	fflush(fp);
 	return buff;
 }
 
@@ -173,6 +311,12 @@ void *dofread(FILE *fp, void *buff, int cnt)
  * */
 void free_memory(struct tfs* fs)
 {
+	free_block_maps(fs);
+	free_dir_indexes(fs);
+	free(fs->dcache);
+	fs->dcache = NULL;
+	free_block_cache(fs);
+	freeArena(fs);
 	free(fs->bb);
 	fs->bb = NULL;
 	free(fs->sb);
@@ -183,36 +327,63 @@ void free_memory(struct tfs* fs)
 	fs->zone_bmap = NULL;
 	free(fs->inode);
 	fs->inode = NULL;
-	free(fs->virtualFS);
-	fs->virtualFS = NULL;
+	releaseVirtualFS(fs);
+	free(fs->blockOffset);
+	fs->blockOffset = NULL;
+	free(fs->dataOffset);
+	fs->dataOffset = NULL;
+	free(fs->dirty_bmap);
+	fs->dirty_bmap = NULL;
+	free(fs->resv);
+	fs->resv = NULL;
+	free(fs->writeMap);
+	fs->writeMap = NULL;
 	free(fs);
 	fs = NULL;
 }
 
 /*
- * get free blocks
- * @bmap				- bitmap
- * @bsize				- bitmap size
- * @free_blocks	- free blocks
+ * Count free bits in map
+ * @bmap		- bitmap
+ * @bsize		- bitmap size in blocks
+ * @return	- number of clear bits
  * */
-void get_free_blocks(u8 *bmap, int bsize, int *free_blocks)
+unsigned long count_free_bits(u8 *bmap, int bsize)
 {
-	int i;
-	int j;
+	unsigned long nwords = (unsigned long) bsize * BITS_PER_BLOCK / 64;
+	unsigned long i, used = 0;
+
+	for (i = 0; i < nwords; i++)
+	{
+		used += __builtin_popcountll(load_bmap_word(bmap, i));
+	}
+	return nwords * 64 - used;
+}
+
+/*
+ * Print the cache counters to stderr if TEXTFS_STATS is set
+ * @fs	- file system structure
+ * */
+void printCacheStats(struct tfs *fs)
+{
+	if (!getenv("TEXTFS_STATS"))
+	{
+		return;
+	}
+	fprintf(stderr, "block-map: %lu hits, %lu misses\n", fs->map_hits,
+					fs->map_misses);
 
-	*free_blocks = 0;
+	fprintf(stderr, "dentry-cache: %lu hits (%lu negative), %lu misses, "
+					"%lu invalidations\n", fs->dcache_hits, fs->dcache_negative,
+					fs->dcache_misses, fs->dcache_invalidations);
 
-	for (i = 0; i < bsize/8 ; i++)
+	if (fs->arena)
 	{
-		if (bmap[i] != 0xff)
-		{
-			for (j = 0; j < 8; j++)
-			{
-				if ((bmap[i] & (1 << j)) == 0)
-				{
-					*free_blocks += 1;
-				}
-			}
-		}
+		fprintf(stderr, "arena: %lu blocks decoded\n", fs->arenaBlocks);
+	}
+	if (fs->cache)
+	{
+		fprintf(stderr, "block-cache: %lu hits, %lu misses, %lu evictions\n",
+						fs->cache->hits, fs->cache->misses, fs->cache->evictions);
 	}
 }
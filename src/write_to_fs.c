@@ -28,106 +28,102 @@
  **************************************************************************************************/
 
 /*
- * Write Block to file system-image (Current: Zeroblock)
- * @fs					 - file system structure
- * @startAddress - first address
- * @size				 - size
+ * Write slots to file system-image at their file offset
+ * @fs		- file system structure
+ * @slots	- text of n slots
+ * @blk		- block-id of the first slot
+ * @n			- number of slots
  * */
-void writeDataBlock(struct tfs *fs, u8 *startAddress, u16 size)
+void writeSlots(struct tfs *fs, const char *slots, unsigned long blk,
+								unsigned long n)
 {
-	u8 currentByte = 0;					//0-16 Each Byte per Line and |
-	u16 currentLine = 16;				//Every Line contains 15 Byte + |...
-	u8 *currentAddress;					//iterates addresses
-
-	dofwrite(fs->fp, "000:\t", 5);
+	size_t size = n * BLOCKSIZE_BRUTTO;
+	off_t offset = SLOT_OFFSET(blk);
 
-	for (currentAddress = startAddress;
-			 currentAddress != (u8 *) startAddress + size; currentAddress++)
+	while (size)
 	{
-		if (currentAddress == (u8 *) startAddress + size - 1)
-		{
-			while (currentByte < 16)
-			{
-				if (currentByte == 7)
-				{
-					fprintf(fs->fp, "%02x  ", (u8) *currentAddress);
-					currentByte++;
-					currentAddress++;
-					size++;
-				}
-				fprintf(fs->fp, "%02x ", (u8) *currentAddress);
-				currentByte++;
-				currentAddress++;
-				size++;
-			}
-			writeASCIILine(fs, (u8**) currentAddress);
-			dofwrite(fs->fp, "\n\n", 2);
-		}
-		else
-		{
-			if (currentByte == 7)
-			{
-				fprintf(fs->fp, "%02x  ", (u8) *currentAddress);
-				currentByte++;
-			}
-			else if (currentByte == 16)
-			{
-				writeASCIILine(fs, (u8**) currentAddress);
+		ssize_t nwritten = pwrite(fileno(fs->fp), slots, size, offset);
 
-				fprintf(fs->fp, "\n%03d:\t", currentLine);
-				currentLine += 16;
-				fprintf(fs->fp, "%02x ", (u8) *currentAddress);
-				currentByte = 1;
-			}
-			else
+		if (nwritten < 0)
+		{
+			if (errno == EINTR)
 			{
-				fprintf(fs->fp, "%02x ", (u8) *currentAddress);
-				currentByte++;
+				continue;
 			}
+			die("pwrite");
 		}
+		slots += nwritten;
+		offset += nwritten;
+		size -= nwritten;
 	}
 }
 
 /*
- * Write an ASCII-Line to file system-image
- * @fs							- file system structure
- * @currentAddress	- current Address to iterate again
+ * Write block text to its slot, if virtualFS does not hold it yet
+ * @fs		- file system structure
+ * @blk	- block-id
+ * @text	- block text
+ * @len	- length of text
  * */
-void writeASCIILine(struct tfs *fs, u8** currentAddress)
+void writeSlot(struct tfs *fs, unsigned long blk, const char *text, int len)
 {
-	u8 *repeatAddress;
+	char slot[BLOCKSIZE_BRUTTO];
 
-	dofwrite(fs->fp, " |", 2);
-	for (repeatAddress = (u8 *) currentAddress - 16;
-			repeatAddress != (u8 *) currentAddress; repeatAddress++)
-		if (*repeatAddress > 32 && *repeatAddress < 127)
-		{
-			fprintf(fs->fp, "%c", *repeatAddress);
-		}
-		else
+	if (len >= BLOCKSIZE_BRUTTO)
+	{
+		fatalmsg("block-id: %lu: block does not fit into a slot", blk);
+	}
+	memcpy(slot, text, len);
+	frameVirtualSlots(slot, len, BLOCKSIZE_BRUTTO);
+
+	if (fs->virtualFS)
+	{
+		char *virtualSlot = fs->virtualFS + SLOT_OFFSET(blk);
+
+		if (!clrbit((char *) fs->dirty_bmap, blk)
+				&& !memcmp(virtualSlot, slot, BLOCKSIZE_BRUTTO))
 		{
-			fprintf(fs->fp, " ");
+			return;
 		}
-	fprintf(fs->fp, "|");
+		memcpy(virtualSlot, slot, BLOCKSIZE_BRUTTO);
+	}
+	cache_drop(fs, blk);
+	dropArenaBlock(fs, blk);
+	writeSlots(fs, slot, blk, 1);
+}
+
+/*
+ * Write data block with its header to file system-image
+ * @fs					 - file system structure
+ * @blk					 - block-id
+ * @header			 - header lines after "block-id: "
+ * @startAddress - BLOCKSIZE bytes of data
+ * */
+void writeDataBlock(struct tfs *fs, unsigned long blk, const char *header,
+										u8 *startAddress)
+{
+	char text[BLOCKSIZE_BRUTTO];
+	int len = sprintf(text, "block-id: %lu\n%s", blk, header);
+
+	len += encodeDataBlock(startAddress, BLOCKSIZE, text + len);
+	writeSlot(fs, blk, text, len);
 }
 
 /*
  * Write bootblock to file system-image
- * @fs							- file system structure
- * @currentAddress	- current Address to iterate again
+ * @fs	- file system structure
  * */
 void writeBootBlock(struct tfs* fs)
 {
-	fflush(fs->fp);
+	char text[BLOCKSIZE_BRUTTO];
+	char *ptr = text;
 
-	if (fseek(fs->fp, 0, SEEK_SET))
-	{
-		die("fseek");
-	}
-	fprintf(fs->fp, "block-id: %lu\n", fs->bb->blockID);
-	fprintf(fs->fp, "Fragment-Type: %s\n", fs->bb->fragment_type);
-	fprintf(fs->fp, "encoding: %s\n", fs->bb->encoding);
-	newline(fs);
+	ptr += sprintf(ptr, "block-id: %lu\n", fs->bb->blockID);
+	ptr += sprintf(ptr, "Fragment-Type: %s\n", fs->bb->fragment_type);
+	ptr += sprintf(ptr, "encoding: %s\n", fs->bb->encoding);
+	ptr += sprintf(ptr, "slot-size: %d\n\n", BLOCKSIZE_BRUTTO);
+
+	writeSlot(fs, fs->bb->blockID, text, ptr - text);
 }
 
 /*
@@ -136,38 +132,40 @@ void writeBootBlock(struct tfs* fs)
  * */
 void writeSuperBlock(struct tfs* fs)
 {
-	fprintf(fs->fp, "block-id: %lu\n", fs->sb->blockID);
-	fprintf(fs->fp, "Fragment-Type: %s\n", fs->sb->fragment_type);
-	fprintf(fs->fp, "file system-state: %d\n", fs->sb->state);
-	fprintf(fs->fp, "zone-bitmap-size_blocks: %d\n", fs->sb->zmap_sizeInBlocks);
-	fprintf(fs->fp, "inode-bitmap-size_blocks: %d\n", fs->sb->imap_sizeInBlocks);
-	fprintf(fs->fp, "number-of-inodes: %d\n", fs->sb->nInodes);
-	fprintf(fs->fp, "number-of-blocks: %d\n", fs->sb->fs_sizeInBlocks);
-	fprintf(fs->fp, "first-data-block: %d\n", fs->sb->firstdatazone);
-
-	newline(fs);
+	char text[BLOCKSIZE_BRUTTO];
+	char *ptr = text;
+
+	ptr += sprintf(ptr, "block-id: %lu\n", fs->sb->blockID);
+	ptr += sprintf(ptr, "Fragment-Type: %s\n", fs->sb->fragment_type);
+	ptr += sprintf(ptr, "file system-state: %d\n", fs->sb->state);
+	ptr += sprintf(ptr, "zone-bitmap-size_blocks: %d\n", fs->sb->zmap_sizeInBlocks);
+	ptr += sprintf(ptr, "inode-bitmap-size_blocks: %d\n", fs->sb->imap_sizeInBlocks);
+	ptr += sprintf(ptr, "number-of-inodes: %d\n", fs->sb->nInodes);
+	ptr += sprintf(ptr, "number-of-blocks: %d\n", fs->sb->fs_sizeInBlocks);
+	ptr += sprintf(ptr, "first-data-block: %d\n", fs->sb->firstdatazone);
+	ptr += sprintf(ptr, "free-blocks: %lu\n", fs->free_zones);
+	ptr += sprintf(ptr, "free-inodes: %lu\n\n", fs->free_inodes);
+
+	writeSlot(fs, fs->sb->blockID, text, ptr - text);
 }
 
 /*
  * Write freelist to file system-image
- * @fs						- file system structure
- * @sizeInBlocks	- size in blocks
+ * @fs	- file system structure
  * */
-void writeZoneBMap(struct tfs* fs, int sizeInBlocks)
+void writeZoneBMap(struct tfs* fs)
 {
-	int free_blocks = 0;
 	int i;
 	unsigned long blockID;
+	char header[64];
 
-	get_free_blocks(fs->zone_bmap, sizeInBlocks, &free_blocks);
+	sprintf(header, "Fragment-Type: zone-bitmap\nfree-blocks-in-file system: %lu\n",
+					fs->free_zones);
 
 	for (i = 0, blockID = ZONE_BITMAP_POS; i < fs->sb->zmap_sizeInBlocks;
 			 i++, blockID++)
 	{
-		fprintf(fs->fp, "block-id: %lu\n", blockID);
-		fprintf(fs->fp, "Fragment-Type: zone-bitmap\n");
-		fprintf(fs->fp, "free-blocks-in-file system: %d\n", free_blocks);
-		writeDataBlock(fs, (u8 *) fs->zone_bmap + i * BLOCKSIZE, BLOCKSIZE);
+		writeDataBlock(fs, blockID, header, fs->zone_bmap + i * BLOCKSIZE);
 	}
 }
 
@@ -182,9 +180,8 @@ void writeInodeBMap(struct tfs* fs)
 
 	for (i = 0; i < fs->sb->imap_sizeInBlocks; i++, blockID++)
 	{
-		fprintf(fs->fp, "block-id: %lu\n", blockID);
-		fprintf(fs->fp, "Fragment-Type: inode-bitmap\n");
-		writeDataBlock(fs, (u8 *) *(&fs->inode_bmap + i * BLOCKSIZE), BLOCKSIZE);
+		writeDataBlock(fs, blockID, "Fragment-Type: inode-bitmap\n",
+									 fs->inode_bmap + i * BLOCKSIZE);
 	}
 }
 
@@ -196,172 +193,157 @@ void writeInodes(struct tfs* fs)
 {
 	int i, j;
 	unsigned long blockID= ZONE_BITMAP_POS + fs->sb->zmap_sizeInBlocks + fs->sb->imap_sizeInBlocks;
+	char text[BLOCKSIZE_BRUTTO];
+	char *ptr;
 
 	for (i = 1; i <= INODE_BUFFER_SIZE(fs) / BLOCKSIZE; i++, blockID++)
 	{
-		fprintf(fs->fp, "block-id: %lu\n", blockID);
-		fprintf(fs->fp, "Fragment-Type: inode-%d\n", i);
-		fprintf(fs->fp, "file-type: %06d\n", INODE(fs,i)->i_mode);
-		fprintf(fs->fp, "links-to-file: %d\n", INODE(fs,i)->i_nlinks);
+		ptr = text;
+		ptr += sprintf(ptr, "block-id: %lu\n", blockID);
+		ptr += sprintf(ptr, "Fragment-Type: inode-%d\n", i);
+		ptr += sprintf(ptr, "file-type: %06d\n", INODE(fs,i)->i_mode);
+		ptr += sprintf(ptr, "links-to-file: %d\n", INODE(fs,i)->i_nlinks);
 
 		for(j = 0; j < 7; j++)
 		{
-			fprintf(fs->fp, "data-zone[%d]: %d\n", j, INODE(fs,i)->zones[j]);
+			ptr += sprintf(ptr, "data-zone[%d]: %d\n", j, INODE(fs,i)->zones[j]);
 		}
-		fprintf(fs->fp, "indirect-data-zone: %d\n", INODE(fs,i)->indirZone);
-		fprintf(fs->fp, "double-indirect-data-zone: %d\n", INODE(fs,i)->doubleIndirZone);
-		fprintf(fs->fp, "file-size-in-bytes: %03d\n", INODE(fs,i)->i_size);
-		fprintf(fs->fp, "atime: %d\n\n",INODE(fs,i)->i_atime);
+		ptr += sprintf(ptr, "indirect-data-zone: %d\n", INODE(fs,i)->indirZone);
+		ptr += sprintf(ptr, "double-indirect-data-zone: %d\n", INODE(fs,i)->doubleIndirZone);
+		ptr += sprintf(ptr, "file-size-in-bytes: %03d\n", INODE(fs,i)->i_size);
+		ptr += sprintf(ptr, "atime: %d\n\n",INODE(fs,i)->i_atime);
+
+		writeSlot(fs, blockID, text, ptr - text);
 	}
 }
 
 /*
- * Seek from current position
+ * Write data blocks changed in virtualFS to file system-image,
+ * consecutive dirty slots with one call
  * @fs	- file system structure
- * @val	-	seek steps
  * */
-void fseekCur(struct tfs *fs, int val)
+void writeDirtyBlocks(struct tfs *fs)
 {
-	fflush(fs->fp);
+	unsigned long blk = fs->sb->firstdatazone;
+	unsigned long nBlocks = fs->sb->fs_sizeInBlocks;
+	unsigned long first;
 
-	if (fseek(fs->fp, val, SEEK_CUR))
+	while (blk < nBlocks)
 	{
-		die("fseek");
+		if (!bit((char *) fs->dirty_bmap, blk))
+		{
+			blk++;
+			continue;
+		}
+		for (first = blk; blk < nBlocks && clrbit((char *) fs->dirty_bmap, blk); blk++);
+
+		writeSlots(fs, fs->virtualFS + SLOT_OFFSET(first), first, blk - first);
 	}
 }
 
 /*
- * print newline
+ * Seek from current position
  * @fs	- file system structure
+ * @val	-	seek steps
  * */
-void newline(struct tfs *fs)
+void fseekCur(struct tfs *fs, int val)
 {
-	dofwrite(fs->fp, "\n", 1);
+	fflush(fs->fp);
+
+	if (fseek(fs->fp, val, SEEK_CUR))
+	{
+		die("fseek");
+	}
 }
 
 /**************************************************************************************************
  * functions for virtualFS
  **************************************************************************************************/
 
-/*
- * write ASCII line to virtualFS
- * @virtualFS				- file system string
- * @currentAddress	- write address
- * */
-void writeVirtualASCIILine(char* virtualFS, u8** currentAddress)
-{
-	u8 *repeatAddress;
-
-	sprintf(virtualFS, "%s |", virtualFS);
-
-	for (repeatAddress = (u8 *) currentAddress - 16;
-			repeatAddress != (u8 *) currentAddress; repeatAddress++)
-		if (*repeatAddress > 32 && *repeatAddress < 127)
-		{
-			sprintf(virtualFS, "%s%c", virtualFS, *repeatAddress);
-		}
-		else
-		{
-			sprintf(virtualFS, "%s ", virtualFS);
-		}
-	sprintf(virtualFS, "%s|", virtualFS);
-}
-
 /*
  * write block line to virtualFS
- * @virtualFS				- file system string
+ * The text of a data block has a fixed length, so the block is
+ * overwritten in place and marked for writeback.
+ * @fs							- file system structure
  * @zone						- zone
  * @currentAddress	- write address
  * @size						- size
  * */
-void writeVirtualDataBlock(char *virtualFS, unsigned long zone,
+void writeVirtualDataBlock(struct tfs *fs, unsigned long zone,
 													 u8 *startAddress, u16 size)
 {
-	u8 currentByte = 0;					//0-16 Each Byte per Line and |
-	u16 currentLine = 16;				//Every Line contains 15 Byte + |...
-	u8 *currentAddress;					//iterates addresses
-char *storeFS;// = (char *)malloc(strlen(virtualFS), sizeof(char));
-	// store old content
-	virtualFS = goto_Block(virtualFS, zone);
-	storeFS = (char *)malloc(strlen(virtualFS) + 1);
-//	char storeFS[strlen(virtualFS)];
-
-	if(virtualFS)
+	char *virtualFS = goto_dataBlk(fs, zone);
+	u8 block[BLOCKSIZE];
+
+	if (!virtualFS)
 	{
-		strcpy(storeFS, virtualFS);
+		fatalmsg("block-id: %lu: no data block to write", zone);
 	}
-	// add new content
-	virtualFS = goto_dataBlk(virtualFS, zone);
-	sprintf(virtualFS, "000:\t");
-
-	for (currentAddress = startAddress;
-			 currentAddress != (u8 *) startAddress + size; currentAddress++)
+	if (size < BLOCKSIZE)
 	{
-		if (currentAddress == (u8 *) startAddress + size - 1)
-		{
-			while (currentByte < 16)
-			{
-				if (currentByte == 7)
-				{
-					sprintf(virtualFS, "%s%02x  ", virtualFS, (u8) *currentAddress);
-					currentByte++;
-					currentAddress++;
-					size++;
-				}
-				sprintf(virtualFS, "%s%02x ", virtualFS, (u8) *currentAddress);
-				currentByte++;
-				currentAddress++;
-				size++;
-			}
-			writeVirtualASCIILine(virtualFS, (u8**) currentAddress);
-			sprintf(virtualFS, "%s\n\n", virtualFS);
-		}
-		else
-		{
-			if (currentByte == 7)
-			{
-				sprintf(virtualFS, "%s%02x  ", virtualFS, (u8) *currentAddress);
-				currentByte++;
-			}
-			else if (currentByte == 16)
-			{
-				writeVirtualASCIILine(virtualFS, (u8**) currentAddress);
-
-				sprintf(virtualFS, "%s\n%03d:\t", virtualFS, currentLine);
-				currentLine += 16;
-				sprintf(virtualFS, "%s%02x ", virtualFS, (u8) *currentAddress);
-				currentByte = 1;
-			}
-			else
-			{
-				sprintf(virtualFS, "%s%02x ", virtualFS, (u8) *currentAddress);
-				currentByte++;
-			}
-		}
+		memcpy(block, startAddress, size);
+		memset(block + size, 0, BLOCKSIZE - size);
+		startAddress = block;
 	}
+	// The arena is encoded by flushArena()
+	if (fs->arena)
+	{
+		memcpy(ARENA_BLOCK(fs, zone), startAddress, BLOCKSIZE);
+		fs->arenaValid[zone] = 1;
+		mark_dirty(fs, zone);
+		return;
+	}
+	encodeDataBlock(startAddress, BLOCKSIZE, virtualFS);
+	cache_update(fs, zone, startAddress);
+	mark_dirty(fs, zone);
+}
 
-	// restore old content
-	if (goto_Block(storeFS, zone + 1))
+/*
+ * Write a data block that is encoded already, e.g. by the workers of
+ * "add -r". Not for TFS_ARENA, the arena takes binary blocks.
+ * @fs		- file system structure
+ * @zone	- zone
+ * @buf		- BLOCKSIZE bytes
+ * @text	- buf encoded by encodeDataBlock()
+ * @len		- length of text
+ * */
+void writeVirtualDataText(struct tfs *fs, unsigned long zone, const u8 *buf,
+													const char *text, int len)
+{
+	char *virtualFS = goto_dataBlk(fs, zone);
+
+	if (!virtualFS)
 	{
-		sprintf(virtualFS, "%s%s", virtualFS, goto_Block(storeFS, zone + 1));
-		free(storeFS);
+		fatalmsg("block-id: %lu: no data block to write", zone);
 	}
+	memcpy(virtualFS, text, len);
+	cache_update(fs, zone, buf);
+	mark_dirty(fs, zone);
 }
 
 /*
  * Write to a file/inode.  It makes holes along the way...
+ * The index blocks are written once, after all data blocks.
+ * At most the size given to make_node() is written.
  * @fs 		- file system structure
  * @fp 		- input file
  * @inode - inode to write to
  * */
 void writefile(struct tfs *fs,FILE *fp,int inode)
 {
-  int j,block_size,block_count = 0;
+  int j,block_size;
   u8 block[BLOCKSIZE];
-  u32 count = 0;
+  u32 count = 0,block_count = 0;
+  u32 nBlocks = UPPER(INODE(fs,inode)->i_size,BLOCKSIZE);
+  u32 *map = write_map(fs,INODE(fs,inode),nBlocks);
 
   do
   {
+  	// The map ends with the size, a file that grew is cut there
+  	if (block_count == nBlocks)
+  	{
+  		break;
+  	}
   	block_size = fread(block,1,BLOCKSIZE,fp);
 
     for (j=0; j<block_size; j++)
@@ -378,11 +360,17 @@ void writefile(struct tfs *fs,FILE *fp,int inode)
       {
       	memset(block+block_size,0,BLOCKSIZE-block_size);
       }
-      write_block_to_inode(fs,inode,block_count++,block);
+      write_mapped_block(fs,inode,map,block_count,block);
+    }
+    if (block_size)
+    {
+    	block_count++;
     }
     count += block_size;
   } while (block_size == BLOCKSIZE);
 
+  write_block_map(fs,inode,map,block_count);
+
   trunc_inode(fs,inode,count);
 }
 
@@ -396,21 +384,24 @@ void writefile(struct tfs *fs,FILE *fp,int inode)
 void writedata(struct tfs *fs,u8 *blk,u32 cnt,int inode)
 {
   int i,block_count;
+  u32 *map = write_map(fs,INODE(fs,inode),UPPER(cnt,BLOCKSIZE));
 
-  for (block_count=i=0; i < cnt; i+= BLOCKSIZE)
+  for (block_count=i=0; i < cnt; i+= BLOCKSIZE, block_count++)
   {
     if (i+BLOCKSIZE < cnt)
     {
-    	write_block_to_inode(fs,inode,block_count++,blk+i);
+    	write_mapped_block(fs,inode,map,block_count,blk+i);
     }
     else
     {
       u8 blk2[BLOCKSIZE];
       memcpy(blk2,blk+i,cnt-i);
       memset(blk2+cnt-i,0,BLOCKSIZE-cnt+i);
-      write_block_to_inode(fs,inode,block_count,blk2);
+      write_mapped_block(fs,inode,map,block_count,blk2);
     }
   }
+  write_block_map(fs,inode,map,block_count);
+
   trunc_inode(fs,inode,cnt);
 }
 
@@ -423,7 +414,13 @@ void writedata(struct tfs *fs,u8 *blk,u32 cnt,int inode)
 void domklnk(struct tfs *fs,char *target,char *lnknam)
 {
   int len = strlen(target);
-  int inode = make_node(fs,lnknam,0777|S_IFLNK,0,0,len,NOW,NOW,NOW,NULL);
+  int inode;
+
+  if (UPPER(len,BLOCKSIZE) > fs->free_zones)
+  {
+  	fatalmsg("%s: no space left for the link",lnknam);
+  }
+  inode = make_node(fs,lnknam,0777|S_IFLNK,0,0,len,NOW,NOW,NOW,NULL);
 
   writedata(fs,(u8 *)target,len,inode);
 }
@@ -449,18 +446,23 @@ void domkhlnk(struct tfs *fs,char *target,char *lnknam)
 {
   char *dir = lnknam;
   char *lname = strrchr(lnknam,'/');
+  char dir_string[PATH_SIZE];
   int dinode;
   int tinode = find_inode(fs,target);
-	char dir_string[64];
-	strcpy(dir_string, dir);
-	struct tfs_inode *ino =INODE(fs,tinode);
 
-	if (!S_ISREG(ino->i_mode))
+  // All checks before the link count changes
+  if (strlen(lnknam) >= PATH_SIZE)
+  {
+  	fatalmsg("%s: path too long",lnknam);
+  }
+  if (tinode == ERROR)
+  {
+  	fatalmsg("%s: not found",target);
+  }
+	if (!S_ISREG(INODE(fs,tinode)->i_mode))
 	{
-		fatalmsg("%s: can only link regular files");
+		fatalmsg("%s: can only link regular files",target);
 	}
-	ino->i_nlinks++;
-
   if (find_inode(fs,lnknam) != ERROR)
   {
   	fatalmsg("%s: already exists",lnknam);
@@ -468,7 +470,8 @@ void domkhlnk(struct tfs *fs,char *target,char *lnknam)
   if (lname)
   {
 		lname++;
-		strtok(dir_string, "/");
+		strcpy(dir_string, lnknam);
+		*strrchr(dir_string,'/') = '\0';
 		dir = dir_string;
   }
   else
@@ -482,6 +485,12 @@ void domkhlnk(struct tfs *fs,char *target,char *lnknam)
   {
   	fatalmsg("%s: not found\n",dir);
   }
+	if (!S_ISDIR(INODE(fs,dinode)->i_mode))
+	{
+		fatalmsg("%s: is not a directory",dir);
+	}
+	begin_change(fs);
+	INODE(fs,tinode)->i_nlinks++;
   dname_add(fs,dinode,lname,tinode);
 }
 
@@ -497,90 +506,121 @@ void cmd_hardlnk(struct tfs *fs,int argc,char **argv)
 }
 
 /*
- * Add files to a image file
- * @fs	 - file system structure
- * @argc - from command line
- * @argv - from command line
+ * Add a file to the file system
+ * @fs		 - file system structure
+ * @src		 - file to add
+ * @target - directory to add to, with "/" at the end
+ * @return - inode of the new file
  * */
-void cmd_add(struct tfs *fs, int argc, char **argv)
+int doadd(struct tfs *fs, const char *src, const char *target)
 {
   FILE *fp;
   struct stat sb;
-  int inode, free_blocks;
+  jmp_buf env, *saved = fatal_jmp;
+  int inode, rc;
+  unsigned long free_blocks = fs->free_zones;
   float file_blocks;
 
-  if (stat(argv[3],&sb))
+  if (stat(src,&sb))
   {
-  	die("stat(%s)",argv[3]);
+  	die("stat(%s)",src);
   }
   //Check file size
-  get_free_blocks(fs->zone_bmap, fs->sb->fs_sizeInBlocks, &free_blocks);
   file_blocks =(float) sb.st_size/(float) 512;
   if(file_blocks > free_blocks)
   {
-  	printf("\nThe file %s is too big for filesystem\n", argv[3]);
-  	printf("Filesize is %f Bytes\n",file_blocks * 512);
-  	printf("Free space of Filesystem is %d Bytes\n\n",free_blocks * 512);
-  	exit(0);
+  	fatalmsg("\nThe file %s is too big for filesystem\n"
+  					 "Filesize is %f Bytes\n"
+  					 "Free space of Filesystem is %lu Bytes\n",
+  					 src, file_blocks * 512, free_blocks * 512);
   }
   if (!S_ISREG(sb.st_mode))
   {
-  	fatalmsg("%s: not a regular file\n",argv[3]);
+  	fatalmsg("%s: not a regular file\n",src);
   }
-	if(!strcmp(argv[1], argv[3]))
-	{
-		printf("\nAdding the file system isn't a valid operation\n\n" );
-		exit(0);
-	}
-  fp = fopen(argv[3],"rb");
-
-  if (!fp)
-  {
-  	die(argv[3]);
-  }
-  int length = strlen(argv[4]) - 1;
-  char *length_ptr = argv[4];
-  length_ptr += length;
+  int length = strlen(target) - 1;
 
-  if(*length_ptr != '/')
+  if(length < 0 || target[length] != '/')
   {
-  	printf("For the root path use [Sourcepath] [/] \n" );
-  	printf("For another path use [Sourcepath] [directory/] \n" );
-  	exit(0);
+  	fatalmsg("For the root path use [Sourcepath] [/] \n"
+  					 "For another path use [Sourcepath] [directory/] ");
   }
 
 	// Get filename
-  char *filename = strrchr(argv[3], '/');
+  const char *filename = strrchr(src, '/');
 	char targetpath[BLOCKSIZE] = { 0 };
 
 	if(!filename)
 	{
-		filename = argv[3];
+		filename = src;
 	}
 	else
 	{
 		filename++;
 	}
 	// Put filename to targetpath
-	if(argv[4])
-	{
-		//Check the maximum path length
-		if((strlen(argv[4]) + strlen(argv[3])) > BLOCKSIZE)
-		{
-			printf("The path %s is too long\n",argv[3]);
-			exit(0);
-		}
-		strcpy(targetpath, argv[4]);
-	  strcat(targetpath, filename);
-	}
-	else
+	//Check the maximum path length, make_node() splits it in PATH_SIZE bytes
+	if(strlen(target) + strlen(filename) >= PATH_SIZE)
 	{
-		strcpy(targetpath, filename);
+		fatalmsg("%s%s: path too long",target,filename);
 	}
+	strcpy(targetpath, target);
+  strcat(targetpath, filename);
+
+  fp = fopen(src,"rb");
+
+  if (!fp)
+  {
+  	die(src);
+  }
+  // The host file is closed before the error goes on
+  if ((rc = setjmp(env)))
+  {
+  	fclose(fp);
+  	fatal_jmp = saved;
+
+  	if (saved)
+  	{
+  		longjmp(*saved, rc);
+  	}
+  	fprintf(stderr, "%s\n", fatal_text);
+  	exit(ERROR);
+  }
+  fatal_jmp = &env;
 
   inode = make_node(fs, &targetpath[0], sb.st_mode,	0,0, sb.st_size,sb.st_atime,
 																				sb.st_mtime,sb.st_ctime,NULL);
 
+  reserve_blocks(fs, inode, sb.st_size);
   writefile(fs,fp,inode);
+  release_blocks(fs);
+
+  fatal_jmp = saved;
   fclose(fp);
+
+  return inode;
+}
+
+/*
+ * Add files to a image file, with -r a host directory tree
+ * @fs	 - file system structure
+ * @argc - from command line
+ * @argv - from command line
+ * */
+void cmd_add(struct tfs *fs, int argc, char **argv)
+{
+	int recursive = !strcmp(argv[3], "-r");
+
+	if(!strcmp(argv[1], argv[3 + recursive]))
+	{
+		fatalmsg("\nAdding the file system isn't a valid operation\n");
+	}
+	if (recursive)
+	{
+		doadd_tree(fs, argv[4], argv[5]);
+	}
+	else
+	{
+		doadd(fs, argv[3], argv[4]);
+	}
 }
@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2016 - Christian Jürgens <christian.textfs@gmail.com>
+ * Copyright (C) 2016 - Dirk Klingenberg <blademountain35@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * */
+
+/*
+ * Read back test (make check)
+ *
+ * Adds host files of sizes around BLOCKSIZE to a new image, extracts
+ * them and compares the bytes, also after the image is written back.
+ * The data holds \0 bytes, neither a full block nor the end of a file
+ * may be cut. Opening a file that is no image must fail cleanly.
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../src/spec_tfs.h"
+#include "../src/textfs.h"
+
+#define IMAGE "readback.tfs"
+#define HOST_FILE "readback.in"
+#define OUT_FILE "readback.out"
+#define NSIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+int failures;
+
+/*
+ * Report a failed check
+ * @what	- description
+ * @size	- file size of the check
+ * @msg		- error message or NULL
+ * */
+void fail(const char *what, unsigned long size, const char *msg)
+{
+	fprintf(stderr, "FAIL %s, %lu bytes%s%s\n", what, size, msg ? ": " : "",
+					msg ? msg : "");
+	failures++;
+}
+
+/*
+ * Fill a buffer with the bytes of a test file, every byte value occurs
+ * @buf		- size bytes
+ * @size	- file size
+ * */
+void fill(unsigned char *buf, unsigned long size)
+{
+	unsigned long i;
+
+	for (i = 0; i < size; i++)
+	{
+		buf[i] = (unsigned char) (i * 7 + i / 256);
+	}
+}
+
+/*
+ * Add a test file of the given size as /d<size>/readback.in
+ * @fs		- handle
+ * @size	- file size
+ * */
+void add_file(struct tfs *fs, unsigned long size)
+{
+	unsigned char *buf = malloc(size);
+	FILE *fp = fopen(HOST_FILE, "wb");
+	char dir[64];
+
+	fill(buf, size);
+
+	if (!fp || fwrite(buf, 1, size, fp) != size || fclose(fp))
+	{
+		perror(HOST_FILE);
+		exit(EXIT_FAILURE);
+	}
+	sprintf(dir, "/d%lu", size);
+
+	// tfs_add() wants the directory with a slash
+	if (tfs_mkdir(fs, dir, 0) || tfs_add(fs, HOST_FILE, strcat(dir, "/")))
+	{
+		fail("add", size, tfs_error(fs));
+	}
+	unlink(HOST_FILE);
+	free(buf);
+}
+
+/*
+ * Extract a test file and compare it
+ * @fs		- handle
+ * @size	- file size
+ * */
+void check_file(struct tfs *fs, unsigned long size)
+{
+	unsigned char *in = malloc(size), *out = malloc(size + 1);
+	char path[64];
+	unsigned long n;
+	FILE *fp;
+
+	fill(in, size);
+	sprintf(path, "/d%lu/" HOST_FILE, size);
+
+	if (tfs_extract(fs, path, OUT_FILE))
+	{
+		fail("extract", size, tfs_error(fs));
+	}
+	else if (!(fp = fopen(OUT_FILE, "rb")))
+	{
+		fail("open of the extracted file", size, NULL);
+	}
+	else
+	{
+		n = fread(out, 1, size + 1, fp);
+		fclose(fp);
+
+		if (n != size)
+		{
+			fprintf(stderr, "FAIL read back %lu of %lu bytes\n", n, size);
+			failures++;
+		}
+		else if (memcmp(in, out, size))
+		{
+			fail("compare", size, NULL);
+		}
+	}
+	unlink(OUT_FILE);
+	free(in);
+	free(out);
+}
+
+int main(void)
+{
+	static const unsigned long sizes[] = {
+		1, BLOCKSIZE - 1, BLOCKSIZE, BLOCKSIZE + 1, 2 * BLOCKSIZE, 3 * BLOCKSIZE - 2,
+		8 * BLOCKSIZE
+	};
+	struct tfs *fs;
+	unsigned i;
+	int err;
+
+	if (tfs_mkfs(IMAGE, 400, 32) || !(fs = tfs_open(IMAGE, 0, &err)))
+	{
+		fprintf(stderr, "%s: %s\n", IMAGE, tfs_error(NULL));
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < NSIZES; i++)
+	{
+		add_file(fs, sizes[i]);
+		check_file(fs, sizes[i]);
+	}
+	// Written back and opened again
+	if (tfs_close(fs, 1) || !(fs = tfs_open(IMAGE, TFS_OPEN_READ_ONLY, &err)))
+	{
+		fail("reopen", 0, tfs_error(NULL));
+	}
+	else
+	{
+		for (i = 0; i < NSIZES; i++)
+		{
+			check_file(fs, sizes[i]);
+		}
+		tfs_close(fs, 0);
+	}
+	// Some file that is no image
+	if (tfs_open("makefile", TFS_OPEN_READ_ONLY, &err) || err == TFS_OK)
+	{
+		fail("open of a non image", 0, NULL);
+	}
+	unlink(IMAGE);
+
+	if (failures)
+	{
+		fprintf(stderr, "%d checks failed\n", failures);
+		return EXIT_FAILURE;
+	}
+	printf("readback: all checks passed\n");
+
+	return EXIT_SUCCESS;
+}